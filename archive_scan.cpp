@@ -0,0 +1,159 @@
+#include "archive_scan.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+#include "tar_scan.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+constexpr char ar_magic[] = "!<arch>\n";
+constexpr std::size_t ar_magic_size = 8;
+constexpr std::size_t member_header_size = 60;
+// the GNU name table is read into memory, anything bigger than this is not a real archive
+constexpr off_t max_name_table = 64 * 1024 * 1024;
+
+bool read_exact(int fd, void* buf, std::size_t count, off_t offset){
+    std::size_t done = 0;
+    while (done < count) {
+        ssize_t n = ::pread(fd, static_cast<char*>(buf) + done, count - done, offset + static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+std::string trim_right(const char* text, std::size_t length){
+    std::string value(text, length);
+    std::size_t end = value.find_last_not_of(' ');
+    return end == std::string::npos ? std::string() : value.substr(0, end + 1);
+}
+
+// ar header numbers are ascii decimal padded with spaces
+bool parse_decimal(const std::string& text, off_t& value){
+    if (text.empty()) return false;
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        if (value > (static_cast<off_t>(1) << 56)) return false;
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+void malformed(const char* why){
+    std::cerr << "malformed ar archive: " << why << "\n";
+    count_error(scan_error::corrupt_archive);
+}
+
+} // namespace
+
+bool is_ar_archive(const std::uint8_t* header, std::size_t length){
+    return length >= ar_magic_size && std::memcmp(header, ar_magic, ar_magic_size) == 0;
+}
+
+std::size_t scan_ar_members(int fd, off_t size, const signature_matcher& matcher, const scan_options& options,
+                            const std::function<void(const std::string& member)>& infected){
+    std::size_t hits = 0;
+    std::string nameTable; // GNU "//" member, long names are "/offset" into it
+    off_t offset = ar_magic_size;
+
+    while (offset + static_cast<off_t>(member_header_size) <= size) {
+        char header[member_header_size];
+        if (!read_exact(fd, header, member_header_size, offset)) {
+            std::cerr << "could not read" << "\n";
+            count_error(scan_error::cant_read);
+            throw CANT_READ;
+        }
+        if (header[58] != '`' || header[59] != '\n') {
+            malformed("bad member header");
+            break;
+        }
+
+        off_t dataSize;
+        if (!parse_decimal(trim_right(header + 48, 10), dataSize)) {
+            malformed("bad member size");
+            break;
+        }
+        off_t dataOffset = offset + static_cast<off_t>(member_header_size);
+        if (dataSize > size - dataOffset) {
+            malformed("member runs past the end of the file");
+            break;
+        }
+        // members are 2 byte aligned
+        off_t next = dataOffset + dataSize + (dataSize & 1);
+
+        std::string name = trim_right(header, 16);
+        if (name == "/" || name == "/SYM64/" || name == "__.SYMDEF" || name == "__.SYMDEF SORTED") {
+            offset = next; // symbol tables
+            continue;
+        }
+        if (name == "//") {
+            if (dataSize > max_name_table) {
+                malformed("name table too big");
+                break;
+            }
+            nameTable.resize(static_cast<std::size_t>(dataSize));
+            if (!read_exact(fd, &nameTable[0], nameTable.size(), dataOffset)) {
+                std::cerr << "could not read" << "\n";
+                count_error(scan_error::cant_read);
+                throw CANT_READ;
+            }
+            offset = next;
+            continue;
+        }
+
+        off_t nameOffset;
+        if (name.size() > 1 && name[0] == '/' && parse_decimal(name.substr(1), nameOffset)) {
+            // GNU long name, ends with "/\n"
+            if (nameOffset >= static_cast<off_t>(nameTable.size())) {
+                malformed("long name outside the name table");
+                break;
+            }
+            std::size_t end = nameTable.find('\n', static_cast<std::size_t>(nameOffset));
+            name = nameTable.substr(static_cast<std::size_t>(nameOffset),
+                                    end == std::string::npos ? std::string::npos : end - static_cast<std::size_t>(nameOffset));
+            if (!name.empty() && name.back() == '/') name.pop_back();
+        }
+        else if (name.compare(0, 3, "#1/") == 0 && parse_decimal(name.substr(3), nameOffset)) {
+            // BSD long name, stored in front of the data
+            if (nameOffset > dataSize) {
+                malformed("long name longer than the member");
+                break;
+            }
+            name.resize(static_cast<std::size_t>(nameOffset));
+            if (!read_exact(fd, &name[0], name.size(), dataOffset)) {
+                std::cerr << "could not read" << "\n";
+                count_error(scan_error::cant_read);
+                throw CANT_READ;
+            }
+            name.erase(std::find(name.begin(), name.end(), '\0'), name.end());
+            dataOffset += nameOffset;
+            dataSize -= nameOffset;
+        }
+        else if (!name.empty() && name.back() == '/') {
+            name.pop_back(); // GNU short names end with '/'
+        }
+
+        trace_span span("member", name.c_str());
+        if (name.compare(0, 8, "data.tar") == 0) {
+            // the payload of a .deb, its entries are reported as data.tar.xz/usr/bin/...
+            hits += scan_tar_range(fd, dataOffset, dataSize, matcher, options, [&](const std::string& path) {
+                infected(name + "/" + path);
+            });
+        }
+        else if (contains_signature_range(fd, dataOffset, dataSize, matcher, options)) {
+            ++hits;
+            infected(name);
+        }
+        offset = next;
+    }
+    return hits;
+}
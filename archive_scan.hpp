@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <sys/types.h>
+
+#include "file_scanner.hpp"
+
+// "!<arch>\n", static libraries and .deb packages. thin archives only hold paths and are not matched
+bool is_ar_archive(const std::uint8_t* header, std::size_t length);
+
+// walks the member headers of the ar archive in fd and runs contains_signature_range() on
+// every member in place (pread at the member's offset, nothing is extracted). GNU (/123 and
+// the // name table) and BSD (#1/len) long names are resolved. infected(member) is called per
+// hit, the return value is the number of hits. the data.tar.* member of a .deb is read as a
+// tar stream and reports its entries as data.tar.xz/path
+std::size_t scan_ar_members(int fd, off_t size, const signature_matcher& matcher, const scan_options& options,
+                            const std::function<void(const std::string& member)>& infected);
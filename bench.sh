@@ -0,0 +1,36 @@
+#!/bin/sh
+# times several find_sig builds on the same corpus, the page cache is warmed first so
+# the numbers compare the code and not the disk. the first binary is the baseline
+#
+# usage: bench.sh corpus_dir runs binary...
+set -e
+
+corpus=$1
+runs=$2
+shift 2
+if [ -z "$corpus" ] || [ -z "$runs" ] || [ $# -eq 0 ]; then
+    echo "usage: $0 corpus_dir runs binary..." >&2
+    exit 1
+fi
+
+now_ms() { echo $(( $(date +%s%N) / 1000000 )); }
+
+# warm the cache
+"$1" "$corpus/tree" "$corpus/signature.sig" > /dev/null 2>&1
+
+baseline=
+printf '%-32s %10s %10s\n' "binary" "best ms" "speedup"
+for bin in "$@"; do
+    best=
+    r=0
+    while [ "$r" -lt "$runs" ]; do
+        start=$(now_ms)
+        "$bin" "$corpus/tree" "$corpus/signature.sig" > /dev/null 2>&1
+        took=$(( $(now_ms) - start ))
+        if [ -z "$best" ] || [ "$took" -lt "$best" ]; then best=$took; fi
+        r=$((r + 1))
+    done
+    [ -z "$baseline" ] && baseline=$best
+    [ "$best" -eq 0 ] && best=1
+    printf '%-32s %10s %9sx\n' "$bin" "$best" "$(awk "BEGIN { printf \"%.2f\", $baseline / $best }")"
+done
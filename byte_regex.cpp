@@ -0,0 +1,541 @@
+#include "byte_regex.hpp"
+#include "scan_metrics.hpp"
+#include "signature_matcher.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+constexpr std::size_t max_nfa_states = 20000;
+constexpr int max_repeat = 1000;
+constexpr std::size_t unbounded = std::numeric_limits<std::size_t>::max();
+
+struct regex_node {
+    enum kind_t { bytes, concat, alternate, repeat } kind;
+    std::bitset<256> set;
+    std::vector<regex_node> children;
+    int min = 1;
+    int max = 1; // -1 = no upper bound
+};
+
+int first_byte(const std::bitset<256>& set){
+    for (int b = 0; b < 256; ++b) {
+        if (set.test(b)) return b;
+    }
+    return -1;
+}
+
+class regex_parser {
+public:
+    explicit regex_parser(const std::string& text) : text(text) {}
+
+    regex_node parse(){
+        regex_node root = alternate();
+        if (pos != text.size()) fail("unmatched )");
+        return root;
+    }
+
+private:
+    const std::string& text;
+    std::size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string& why) const {
+        throw std::invalid_argument(why + " at offset " + std::to_string(pos) + " of /" + text + "/");
+    }
+
+    bool more() const { return pos < text.size(); }
+    char peek() const { return text[pos]; }
+
+    regex_node alternate(){
+        regex_node node{regex_node::alternate};
+        node.children.push_back(concat());
+        while (more() && peek() == '|') {
+            ++pos;
+            node.children.push_back(concat());
+        }
+        if (node.children.size() == 1) return std::move(node.children.front());
+        return node;
+    }
+
+    regex_node concat(){
+        regex_node node{regex_node::concat};
+        while (more() && peek() != '|' && peek() != ')') node.children.push_back(repeated());
+        return node;
+    }
+
+    regex_node repeated(){
+        regex_node node = atom();
+        while (more()) {
+            int min, max;
+            char c = peek();
+            if (c == '*') { min = 0; max = -1; ++pos; }
+            else if (c == '+') { min = 1; max = -1; ++pos; }
+            else if (c == '?') { min = 0; max = 1; ++pos; }
+            else if (c == '{') { counts(min, max); }
+            else break;
+            regex_node wrapped{regex_node::repeat};
+            wrapped.min = min;
+            wrapped.max = max;
+            wrapped.children.push_back(std::move(node));
+            node = std::move(wrapped);
+        }
+        return node;
+    }
+
+    int number(){
+        if (!more() || peek() < '0' || peek() > '9') fail("expected a number");
+        long value = 0;
+        while (more() && peek() >= '0' && peek() <= '9') {
+            value = value * 10 + (peek() - '0');
+            if (value > max_repeat) fail("repeat count over " + std::to_string(max_repeat));
+            ++pos;
+        }
+        return static_cast<int>(value);
+    }
+
+    // {n} {n,} {n,m}
+    void counts(int& min, int& max){
+        ++pos;
+        min = number();
+        max = min;
+        if (more() && peek() == ',') {
+            ++pos;
+            max = more() && peek() == '}' ? -1 : number();
+        }
+        if (!more() || peek() != '}') fail("unterminated {");
+        ++pos;
+        if (max != -1 && max < min) fail("{n,m} with m < n");
+    }
+
+    regex_node atom(){
+        regex_node node{regex_node::bytes};
+        char c = peek();
+        if (c == '(') {
+            ++pos;
+            if (text.compare(pos, 2, "?:") == 0) pos += 2;
+            node = alternate();
+            if (!more() || peek() != ')') fail("unmatched (");
+            ++pos;
+            return node;
+        }
+        if (c == '*' || c == '+' || c == '?' || c == '{') fail("nothing to repeat");
+        if (c == '[') {
+            node.set = byte_class();
+            return node;
+        }
+        ++pos;
+        if (c == '.') node.set.set();
+        else if (c == '\\') node.set = escape();
+        else node.set.set(static_cast<std::uint8_t>(c));
+        return node;
+    }
+
+    int hex_digit(){
+        if (!more()) fail("\\x needs two hex digits");
+        char c = text[pos++];
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        fail("\\x needs two hex digits");
+    }
+
+    // after the backslash
+    std::bitset<256> escape(){
+        if (!more()) fail("trailing \\");
+        std::bitset<256> set;
+        char c = text[pos++];
+        auto range = [&](int from, int to) { for (int b = from; b <= to; ++b) set.set(b); };
+        switch (c) {
+            case 'x': {
+                int high = hex_digit();
+                set.set(high << 4 | hex_digit());
+                return set;
+            }
+            case 'd': case 'D': range('0', '9'); break;
+            case 'w': case 'W': range('0', '9'); range('a', 'z'); range('A', 'Z'); set.set('_'); break;
+            case 's': case 'S': for (char s : {' ', '\t', '\n', '\r', '\f', '\v'}) set.set(static_cast<std::uint8_t>(s)); break;
+            case 'n': set.set('\n'); return set;
+            case 'r': set.set('\r'); return set;
+            case 't': set.set('\t'); return set;
+            case 'f': set.set('\f'); return set;
+            case 'v': set.set('\v'); return set;
+            case '0': set.set(0); return set;
+            default:
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                    --pos;
+                    fail(std::string("unknown escape \\") + c);
+                }
+                set.set(static_cast<std::uint8_t>(c));
+                return set;
+        }
+        if (c == 'D' || c == 'W' || c == 'S') set.flip();
+        return set;
+    }
+
+    // one byte of a class, -1 for a multi byte escape like \d
+    int class_byte(std::bitset<256>& set){
+        char c = text[pos++];
+        if (c != '\\') return static_cast<std::uint8_t>(c);
+        set = escape();
+        return set.count() == 1 ? first_byte(set) : -1;
+    }
+
+    std::bitset<256> byte_class(){
+        ++pos;
+        bool negate = more() && peek() == '^';
+        if (negate) ++pos;
+        std::bitset<256> set;
+        bool first = true;
+        while (true) {
+            if (!more()) fail("unterminated [");
+            if (peek() == ']' && !first) break;
+            first = false;
+            std::bitset<256> escaped;
+            int low = class_byte(escaped);
+            if (low >= 0 && pos + 1 < text.size() && peek() == '-' && text[pos + 1] != ']') {
+                ++pos;
+                std::bitset<256> ignored;
+                int high = class_byte(ignored);
+                if (high < 0 || high < low) fail("bad class range");
+                for (int b = low; b <= high; ++b) set.set(b);
+            }
+            else if (low >= 0) set.set(low);
+            else set |= escaped;
+        }
+        ++pos;
+        if (negate) set.flip();
+        return set;
+    }
+};
+
+std::size_t add_lengths(std::size_t a, std::size_t b){
+    return (a == unbounded || b == unbounded || a + b < a) ? unbounded : a + b;
+}
+
+std::size_t max_length(const regex_node& node){
+    switch (node.kind) {
+        case regex_node::bytes: return 1;
+        case regex_node::concat: {
+            std::size_t total = 0;
+            for (const auto& child : node.children) total = add_lengths(total, max_length(child));
+            return total;
+        }
+        case regex_node::alternate: {
+            std::size_t longest = 0;
+            for (const auto& child : node.children) longest = std::max(longest, max_length(child));
+            return longest;
+        }
+        case regex_node::repeat: {
+            std::size_t one = max_length(node.children.front());
+            if (node.max == -1) return one == 0 ? 0 : unbounded;
+            if (one == unbounded) return unbounded;
+            return one * static_cast<std::size_t>(node.max);
+        }
+    }
+    return unbounded;
+}
+
+void flatten(const regex_node& node, std::vector<const regex_node*>& sequence){
+    if (node.kind == regex_node::concat) {
+        for (const auto& child : node.children) flatten(child, sequence);
+    }
+    else {
+        sequence.push_back(&node);
+    }
+}
+
+} // namespace
+
+struct nfa_state {
+    enum kind_t : std::uint8_t { bytes, split, match } kind;
+    int set = -1;
+    int out = -1;
+    int out1 = -1;
+};
+
+struct lazy_dfa {
+    std::vector<std::vector<int>> sets; // nfa states of each dfa state, 0 is the start
+    std::map<std::vector<int>, int> ids;
+    std::vector<int> next;              // 256 per state, -1 = not built yet
+    std::vector<char> matching;
+    // bumped by every flush, the state ids of streams from before are gone
+    std::uint64_t epoch = 0;
+    // closure scratch
+    std::vector<unsigned> seen;
+    unsigned generation = 0;
+    std::vector<int> stack;
+};
+
+struct byte_regex_program {
+    std::vector<nfa_state> states;
+    std::vector<std::bitset<256>> sets;
+    int start = -1;
+    std::vector<std::uint8_t> literal;
+    std::size_t lead = 0;
+    std::unique_ptr<signature_matcher> literalFinder;
+
+    std::mutex lock;
+    std::map<std::thread::id, std::unique_ptr<lazy_dfa>> dfas;
+
+    int add(nfa_state state){
+        if (states.size() >= max_nfa_states) throw std::invalid_argument("pattern is too big");
+        states.push_back(state);
+        return static_cast<int>(states.size() - 1);
+    }
+
+    // a piece of nfa whose dangling exits (state, 0 = out / 1 = out1) still have to be pointed somewhere
+    struct fragment {
+        int start;
+        std::vector<std::pair<int, int>> exits;
+    };
+
+    void patch(const fragment& piece, int target){
+        for (auto [state, which] : piece.exits) (which ? states[state].out1 : states[state].out) = target;
+    }
+
+    fragment empty(){
+        int s = add({nfa_state::split});
+        return {s, {{s, 0}}};
+    }
+
+    fragment sequence(fragment first, const fragment& second){
+        patch(first, second.start);
+        first.exits = second.exits;
+        return first;
+    }
+
+    fragment compile(const regex_node& node){
+        switch (node.kind) {
+            case regex_node::bytes: {
+                sets.push_back(node.set);
+                int s = add({nfa_state::bytes, static_cast<int>(sets.size() - 1)});
+                return {s, {{s, 0}}};
+            }
+            case regex_node::concat: {
+                if (node.children.empty()) return empty();
+                fragment result = compile(node.children.front());
+                for (std::size_t i = 1; i < node.children.size(); ++i) result = sequence(result, compile(node.children[i]));
+                return result;
+            }
+            case regex_node::alternate: {
+                fragment result{-1, {}};
+                int previous = -1;
+                for (std::size_t i = 0; i < node.children.size(); ++i) {
+                    fragment branch = compile(node.children[i]);
+                    if (i + 1 < node.children.size()) {
+                        int s = add({nfa_state::split});
+                        states[s].out = branch.start;
+                        if (previous >= 0) states[previous].out1 = s;
+                        else result.start = s;
+                        previous = s;
+                    }
+                    else {
+                        states[previous].out1 = branch.start;
+                    }
+                    result.exits.insert(result.exits.end(), branch.exits.begin(), branch.exits.end());
+                }
+                return result;
+            }
+            case regex_node::repeat: {
+                const regex_node& inner = node.children.front();
+                fragment result = empty();
+                for (int i = 0; i < node.min; ++i) result = sequence(result, compile(inner));
+                if (node.max == -1) {
+                    int s = add({nfa_state::split});
+                    fragment body = compile(inner);
+                    states[s].out = body.start;
+                    patch(body, s);
+                    result = sequence(result, {s, {{s, 1}}});
+                }
+                for (int i = node.min; i < node.max; ++i) {
+                    int s = add({nfa_state::split});
+                    fragment body = compile(inner);
+                    states[s].out = body.start;
+                    body.exits.push_back({s, 1});
+                    result = sequence(result, {s, body.exits});
+                }
+                return result;
+            }
+        }
+        return empty();
+    }
+
+    // the longest run of single bytes in the top level sequence whose distance from the start
+    // of a match is bounded, the shortest distance breaks ties
+    void choose_literal(const regex_node& root){
+        std::vector<const regex_node*> sequence;
+        flatten(root, sequence);
+        std::size_t before = 0;
+        std::vector<std::uint8_t> run;
+        std::size_t runLead = 0;
+        auto close = [&]() {
+            if (runLead != unbounded && (run.size() > literal.size() || (run.size() == literal.size() && runLead < lead))) {
+                literal = run;
+                lead = runLead;
+            }
+            run.clear();
+        };
+        for (const regex_node* node : sequence) {
+            if (node->kind == regex_node::bytes && node->set.count() == 1) {
+                if (run.empty()) runLead = before;
+                run.push_back(static_cast<std::uint8_t>(first_byte(node->set)));
+            }
+            else {
+                close();
+            }
+            before = add_lengths(before, max_length(*node));
+        }
+        close();
+        if (!literal.empty()) literalFinder = std::make_unique<signature_matcher>(literal);
+    }
+
+    // splits followed, only byte and match states kept, sorted so equal sets compare equal
+    std::vector<int> closure(lazy_dfa& dfa, std::vector<int>& seeds) const {
+        if (++dfa.generation == 0) {
+            std::fill(dfa.seen.begin(), dfa.seen.end(), 0);
+            dfa.generation = 1;
+        }
+        std::vector<int> result;
+        dfa.stack.assign(seeds.begin(), seeds.end());
+        while (!dfa.stack.empty()) {
+            int s = dfa.stack.back();
+            dfa.stack.pop_back();
+            if (s < 0 || dfa.seen[s] == dfa.generation) continue;
+            dfa.seen[s] = dfa.generation;
+            if (states[s].kind == nfa_state::split) {
+                dfa.stack.push_back(states[s].out1);
+                dfa.stack.push_back(states[s].out);
+            }
+            else {
+                result.push_back(s);
+            }
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    int intern(lazy_dfa& dfa, std::vector<int> set) const {
+        auto known = dfa.ids.find(set);
+        if (known != dfa.ids.end()) return known->second;
+        int id = static_cast<int>(dfa.sets.size());
+        bool matches = false;
+        for (int s : set) matches |= states[s].kind == nfa_state::match;
+        dfa.ids.emplace(set, id);
+        dfa.sets.push_back(std::move(set));
+        dfa.next.resize(dfa.next.size() + 256, -1);
+        dfa.matching.push_back(matches);
+        return id;
+    }
+
+    void flush(lazy_dfa& dfa) const {
+        dfa.sets.clear();
+        dfa.ids.clear();
+        dfa.next.clear();
+        dfa.matching.clear();
+        ++dfa.epoch;
+        std::vector<int> seeds{start};
+        intern(dfa, closure(dfa, seeds));
+    }
+
+    lazy_dfa& dfa_for_this_thread(){
+        std::lock_guard<std::mutex> guard(lock);
+        auto& dfa = dfas[std::this_thread::get_id()];
+        if (!dfa) {
+            dfa = std::make_unique<lazy_dfa>();
+            dfa->seen.assign(states.size(), 0);
+            flush(*dfa);
+        }
+        return *dfa;
+    }
+
+    int step(lazy_dfa& dfa, int from, std::uint8_t byte) const {
+        int known = dfa.next[static_cast<std::size_t>(from) * 256 + byte];
+        if (known >= 0) return known;
+
+        // unanchored: the start state is in every set, a match may begin at any byte
+        std::vector<int> seeds{start};
+        for (int s : dfa.sets[from]) {
+            if (states[s].kind == nfa_state::bytes && sets[states[s].set].test(byte)) seeds.push_back(states[s].out);
+        }
+        std::vector<int> set = closure(dfa, seeds);
+        if (dfa.ids.find(set) == dfa.ids.end() && dfa.sets.size() >= max_dfa_states) {
+            flush(dfa);
+            count_event(scan_counter::regex_dfa_flushes);
+            return intern(dfa, std::move(set));
+        }
+        int id = intern(dfa, std::move(set));
+        dfa.next[static_cast<std::size_t>(from) * 256 + byte] = id;
+        return id;
+    }
+};
+
+byte_regex::byte_regex(const std::string& pattern)
+    : source(pattern), code(std::make_shared<byte_regex_program>()) {
+    regex_node root = regex_parser(pattern).parse();
+    auto piece = code->compile(root);
+    code->patch(piece, code->add({nfa_state::match}));
+    code->start = piece.start;
+    code->choose_literal(root);
+}
+
+const std::vector<std::uint8_t>& byte_regex::required() const {
+    return code->literal;
+}
+
+std::size_t byte_regex::lead() const {
+    return code->lead;
+}
+
+byte_regex_stream::byte_regex_stream(const byte_regex& regex)
+    : code(regex.code), dfa(&code->dfa_for_this_thread()), epoch(dfa->epoch) {
+    hit = dfa->matching[0];
+}
+
+void byte_regex_stream::reset(){
+    state = 0;
+    epoch = dfa->epoch;
+    hit = dfa->matching[0];
+}
+
+bool byte_regex_stream::feed(const std::uint8_t* data, std::size_t length){
+    if (hit) return true;
+    const byte_regex_program& program = *code;
+    // another stream of this thread (an archive member inside this file) flushed the states
+    if (epoch != dfa->epoch) {
+        state = state == 0 ? 0 : program.intern(*dfa, saved);
+        epoch = dfa->epoch;
+    }
+    const std::size_t literalLength = program.literal.size();
+    const std::uint8_t* p = data;
+    const std::uint8_t* end = data + length;
+
+    while (p < end) {
+        const std::uint8_t* stop = end;
+        if (state == 0 && program.literalFinder) {
+            // no match in progress, the next one has the literal at most lead bytes after its start
+            const std::uint8_t* literal = program.literalFinder->find(p, end);
+            if (literal == end) {
+                // it may still start here and continue in the next piece
+                p = end - std::min<std::size_t>(end - p, program.lead + literalLength - 1);
+            }
+            else {
+                p = literal - std::min<std::size_t>(literal - p, program.lead);
+                stop = literal + literalLength;
+            }
+        }
+        // up to stop, then on for as long as a match is in progress
+        while (p < stop || (p < end && state != 0)) {
+            state = program.step(*dfa, state, *p++);
+            if (dfa->matching[state]) return hit = true;
+        }
+    }
+    if (state != 0) saved = dfa->sets[state];
+    epoch = dfa->epoch;
+    return false;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct byte_regex_program;
+struct lazy_dfa;
+
+// a regular expression over bytes, the pcre subset that makes sense for binaries:
+//   \xHH a byte   .  any byte   [a-z\x00-\x1f] [^...] classes   \d \w \s (\D \W \S)   \n \r \t \0
+//   ab  a|b  (...) (?:...)  *  +  ?  {n} {n,} {n,m}   \ before punctuation means the character itself
+// no anchors or captures, a match may start anywhere. a syntax error throws std::invalid_argument
+// with the reason. compiled once to an nfa, streams walk it as a dfa built lazily (byte_regex_stream)
+class byte_regex {
+public:
+    explicit byte_regex(const std::string& pattern);
+
+    const std::string& pattern() const { return source; }
+
+    // bytes every match contains and how far in front of them a match can start at most. where
+    // that is bounded a stream with no match in progress skips straight to lead bytes before the
+    // next occurrence. empty when there is no such literal
+    const std::vector<std::uint8_t>& required() const;
+    std::size_t lead() const;
+
+private:
+    friend class byte_regex_stream;
+
+    std::string source;
+    // shared by copies, the per thread dfa states hang off it
+    std::shared_ptr<byte_regex_program> code;
+};
+
+// dfa states kept per regex and thread. when a pattern would need more (state explosion, e.g.
+// (a|b)*a(a|b){20}) they are thrown away and rebuilt from the current position on, so the
+// memory stays bounded and the answer stays exact, only slower
+constexpr std::size_t max_dfa_states = 2048;
+
+// one stream (a file, a decompressed member) searched for a byte_regex. pieces of any size can be
+// fed, the dfa state carries over so nothing has to be kept or searched twice
+class byte_regex_stream {
+public:
+    explicit byte_regex_stream(const byte_regex& regex);
+
+    // returns true once a match was seen, later calls do nothing
+    bool feed(const std::uint8_t* data, std::size_t length);
+    bool found() const { return hit; }
+    void reset();
+
+private:
+    std::shared_ptr<byte_regex_program> code;
+    lazy_dfa* dfa;
+    int state = 0;
+    // the nfa states behind state and the flush count they belong to, to find state again after
+    // a flush
+    std::uint64_t epoch;
+    std::vector<int> saved;
+    bool hit = false;
+};
@@ -0,0 +1,92 @@
+#include "cache_neutral.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+std::size_t page_size(){
+    static const std::size_t size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+} // namespace
+
+int open_direct(int fd){
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return ::open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+}
+
+void aligned_free::operator()(std::uint8_t* p) const {
+    std::free(p);
+}
+
+aligned_buffer make_aligned_buffer(std::size_t size){
+    void* p = nullptr;
+    if (::posix_memalign(&p, direct_alignment, size) != 0) throw std::bad_alloc();
+    return aligned_buffer(static_cast<std::uint8_t*>(p));
+}
+
+ssize_t read_direct(int directFd, std::uint8_t* buffer, std::size_t capacity, off_t offset, std::size_t length,
+                    const std::uint8_t*& data){
+    const off_t alignedOffset = offset & ~static_cast<off_t>(direct_alignment - 1);
+    const std::size_t skip = static_cast<std::size_t>(offset - alignedOffset);
+    std::size_t wanted = (skip + length + direct_alignment - 1) & ~(direct_alignment - 1);
+    if (wanted > capacity) wanted = capacity & ~(direct_alignment - 1);
+
+    std::size_t done = 0;
+    while (done < wanted) {
+        ssize_t n = ::pread(directFd, buffer + done, wanted - done, alignedOffset + static_cast<off_t>(done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += static_cast<std::size_t>(n);
+        // a short direct read is the end of the file
+        if (done % direct_alignment != 0) break;
+    }
+    data = buffer + skip;
+    if (done <= skip) return 0;
+    return static_cast<ssize_t>(std::min(done - skip, length));
+}
+
+page_cache_guard::page_cache_guard(int fd, off_t offset, off_t length, bool enabled){
+    if (!enabled || length <= 0) return;
+    const std::size_t page = page_size();
+    start = offset & ~static_cast<off_t>(page - 1);
+    const std::size_t span = static_cast<std::size_t>(offset + length - start);
+
+    // mincore only works on mappings, mapping the range does not read anything
+    void* map = ::mmap(nullptr, span, PROT_READ, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED) return;
+    resident.resize((span + page - 1) / page);
+    if (::mincore(map, span, resident.data()) != 0) resident.clear();
+    ::munmap(map, span);
+    if (!resident.empty()) this->fd = fd;
+}
+
+page_cache_guard::~page_cache_guard(){
+    if (fd < 0) return;
+    const off_t page = static_cast<off_t>(page_size());
+    // one fadvise per run of pages that came in because of the scan
+    std::size_t i = 0;
+    while (i < resident.size()) {
+        if (resident[i] & 1) {
+            ++i;
+            continue;
+        }
+        std::size_t runStart = i;
+        while (i < resident.size() && !(resident[i] & 1)) ++i;
+        ::posix_fadvise(fd, start + static_cast<off_t>(runStart) * page,
+                        static_cast<off_t>(i - runStart) * page, POSIX_FADV_DONTNEED);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <sys/types.h>
+
+// O_DIRECT needs buffer address, file offset and length aligned to the logical block size of
+// the device. 4096 covers every block size in use
+constexpr std::size_t direct_alignment = 4096;
+
+// a second descriptor for the file behind fd opened with O_DIRECT (through /proc/self/fd, so
+// it works for descriptors handed over by fanotify too). -1 when the filesystem refuses it
+// (tmpfs, some FUSE and network filesystems)
+int open_direct(int fd);
+
+struct aligned_free {
+    void operator()(std::uint8_t* p) const;
+};
+using aligned_buffer = std::unique_ptr<std::uint8_t[], aligned_free>;
+
+aligned_buffer make_aligned_buffer(std::size_t size);
+
+// reads length bytes at offset through a direct descriptor. the read is widened to aligned
+// bounds, data points at offset inside buffer afterwards. returns the bytes available at data,
+// 0 at EOF, -1 on error (errno EINVAL when the device wants a bigger alignment)
+ssize_t read_direct(int directFd, std::uint8_t* buffer, std::size_t capacity, off_t offset, std::size_t length,
+                    const std::uint8_t*& data);
+
+// remembers which pages of the range were in the page cache before the scan reads it and
+// drops the others again when it goes out of scope. pages other processes had cached stay,
+// so their hit rates do not change. does nothing when not enabled
+class page_cache_guard {
+public:
+    page_cache_guard(int fd, off_t offset, off_t length, bool enabled = true);
+    ~page_cache_guard();
+    page_cache_guard(const page_cache_guard&) = delete;
+    page_cache_guard& operator=(const page_cache_guard&) = delete;
+
+private:
+    int fd = -1;
+    off_t start = 0;
+    std::vector<unsigned char> resident;
+};
@@ -0,0 +1,324 @@
+#include "compressed_scan.hpp"
+#include "cache_neutral.hpp"
+#include "io_throttle.hpp"
+#include "scan_budget.hpp"
+#include "scan_metrics.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <lzma.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+constexpr std::size_t input_chunk = 128 * 1024;
+constexpr std::size_t output_chunk = 1024 * 1024;
+// small files may compress extremely well (sparse cores), the ratio is only judged past this
+constexpr std::uint64_t ratio_grace = 64ULL * 1024 * 1024;
+
+// keeps the totals for the bomb guard and forwards output to the sink
+struct output_guard {
+    const byte_sink& sink;
+    const scan_options& options;
+    std::uint64_t consumed = 0;
+    std::uint64_t produced = 0;
+    inflate_result verdict = inflate_result::done;
+
+    // false when decompressing has to stop, verdict says why
+    bool emit(const std::uint8_t* data, std::size_t length){
+        if (budget_expired()) {
+            verdict = inflate_result::timed_out;
+            return false;
+        }
+        if (length == 0) return true;
+        produced += length;
+        count_event(scan_counter::bytes_decompressed, length);
+        if (produced > options.max_decompressed ||
+            (produced > ratio_grace && produced / std::max<std::uint64_t>(consumed, 1) > options.max_ratio)) {
+            verdict = inflate_result::bomb;
+            return false;
+        }
+        if (!sink(data, length)) {
+            verdict = inflate_result::stopped;
+            return false;
+        }
+        return true;
+    }
+};
+
+// refills the input buffer when it ran dry, returns false at the end of the input
+struct input_buffer {
+    const byte_source& source;
+    output_guard& guard;
+    std::vector<std::uint8_t> data = std::vector<std::uint8_t>(input_chunk);
+    std::size_t length = 0;
+    bool eof = false;
+    bool failed = false;
+
+    bool refill(){
+        if (eof) return false;
+        // the decompressor's state has to be freed, no throwing from in here
+        if (budget_expired()) {
+            guard.verdict = inflate_result::timed_out;
+            eof = true;
+            return false;
+        }
+        throttle_io(data.size());
+        ssize_t n;
+        {
+            phase_timer timer(scan_phase::read);
+            n = source(data.data(), data.size());
+        }
+        if (n < 0) {
+            failed = true;
+            eof = true;
+            return false;
+        }
+        if (n == 0) {
+            eof = true;
+            return false;
+        }
+        length = static_cast<std::size_t>(n);
+        guard.consumed += length;
+        charge_budget(length);
+        count_event(scan_counter::bytes_read, length);
+        return true;
+    }
+};
+
+inflate_result finish(const output_guard& guard, const input_buffer& input, inflate_result fallback){
+    if (guard.verdict != inflate_result::done) return guard.verdict;
+    if (input.failed) return inflate_result::read_error;
+    return fallback;
+}
+
+inflate_result gunzip(const byte_source& source, output_guard& guard){
+    input_buffer input{source, guard};
+    std::vector<std::uint8_t> out(output_chunk);
+
+    z_stream zs = {};
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) return inflate_result::corrupt; // 15+32: gzip or zlib header
+    // set right after a member ended, gzip allows several members back to back and anything
+    // after the last one (tar padding) is not an error
+    bool betweenMembers = false;
+    // a full output buffer may leave more output inside zlib, drain it before reading on
+    bool outputFull = false;
+    inflate_result result = inflate_result::done;
+
+    while (true) {
+        if (zs.avail_in == 0 && !outputFull) {
+            if (!input.refill()) {
+                if (!betweenMembers) result = inflate_result::corrupt; // truncated member
+                break;
+            }
+            zs.next_in = input.data.data();
+            zs.avail_in = static_cast<uInt>(input.length);
+        }
+
+        zs.next_out = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+        int ret;
+        {
+            phase_timer timer(scan_phase::decompress);
+            ret = inflate(&zs, Z_NO_FLUSH);
+        }
+        std::size_t have = out.size() - zs.avail_out;
+        outputFull = zs.avail_out == 0;
+        if (have > 0) betweenMembers = false;
+        if (!guard.emit(out.data(), have)) break;
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);
+            betweenMembers = true;
+            continue;
+        }
+        if (ret == Z_DATA_ERROR && betweenMembers) break;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            result = inflate_result::corrupt;
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return finish(guard, input, result);
+}
+
+inflate_result unxz(const byte_source& source, output_guard& guard){
+    input_buffer input{source, guard};
+    std::vector<std::uint8_t> out(output_chunk);
+
+    lzma_stream xs = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&xs, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) return inflate_result::corrupt;
+
+    lzma_action action = LZMA_RUN;
+    inflate_result result = inflate_result::done;
+    while (true) {
+        if (xs.avail_in == 0 && action == LZMA_RUN) {
+            if (input.refill()) {
+                xs.next_in = input.data.data();
+                xs.avail_in = input.length;
+            }
+            else {
+                action = LZMA_FINISH;
+            }
+        }
+
+        xs.next_out = out.data();
+        xs.avail_out = out.size();
+        lzma_ret ret;
+        {
+            phase_timer timer(scan_phase::decompress);
+            ret = lzma_code(&xs, action);
+        }
+        if (!guard.emit(out.data(), out.size() - xs.avail_out)) break;
+
+        if (ret == LZMA_STREAM_END) break;
+        if (ret != LZMA_OK) {
+            result = inflate_result::corrupt;
+            break;
+        }
+    }
+    lzma_end(&xs);
+    return finish(guard, input, result);
+}
+
+#ifdef HAVE_ZSTD
+inflate_result unzstd(const byte_source& source, output_guard& guard){
+    input_buffer input{source, guard};
+    std::vector<std::uint8_t> out(output_chunk);
+
+    ZSTD_DCtx* ctx = ZSTD_createDCtx();
+    if (!ctx) return inflate_result::corrupt;
+
+    inflate_result result = inflate_result::done;
+    ZSTD_inBuffer in = {input.data.data(), 0, 0};
+    std::size_t last = 0;
+    bool outputFull = false;
+    while (true) {
+        if (in.pos == in.size && !outputFull) {
+            if (!input.refill()) {
+                if (last != 0) result = inflate_result::corrupt; // truncated frame
+                break;
+            }
+            in = {input.data.data(), input.length, 0};
+        }
+
+        ZSTD_outBuffer output = {out.data(), out.size(), 0};
+        {
+            phase_timer timer(scan_phase::decompress);
+            last = ZSTD_decompressStream(ctx, &output, &in);
+        }
+        if (ZSTD_isError(last)) {
+            result = inflate_result::corrupt;
+            break;
+        }
+        outputFull = output.pos == output.size;
+        if (!guard.emit(out.data(), output.pos)) break;
+    }
+    ZSTD_freeDCtx(ctx);
+    return finish(guard, input, result);
+}
+#endif
+
+} // namespace
+
+compression detect_compression(const std::uint8_t* header, std::size_t length){
+    if (length >= 2 && header[0] == 0x1F && header[1] == 0x8B) return compression::gzip;
+    if (length >= 6 && std::memcmp(header, "\xFD" "7zXZ\x00", 6) == 0) return compression::xz;
+    if (length >= 4 && header[0] == 0x28 && header[1] == 0xB5 && header[2] == 0x2F && header[3] == 0xFD) {
+        return compression::zstd;
+    }
+    return compression::none;
+}
+
+bool compression_supported(compression format){
+#ifdef HAVE_ZSTD
+    return format != compression::none;
+#else
+    return format == compression::gzip || format == compression::xz;
+#endif
+}
+
+inflate_result decompress_stream(compression format, const byte_source& source, const byte_sink& sink,
+                                 const scan_options& options){
+    output_guard guard{sink, options};
+    switch (format) {
+        case compression::gzip: return gunzip(source, guard);
+        case compression::xz: return unxz(source, guard);
+#ifdef HAVE_ZSTD
+        case compression::zstd: return unzstd(source, guard);
+#endif
+        default: return inflate_result::corrupt;
+    }
+}
+
+bool contains_signature_compressed(int fd, off_t offset, off_t length, compression format,
+                                   const signature_matcher& matcher, const scan_options& options){
+    if (!compression_supported(format)) {
+        count_event(scan_counter::skipped_non_elf);
+        return false;
+    }
+
+    const off_t end = offset + length;
+    byte_source source = [&](std::uint8_t* buf, std::size_t capacity) -> ssize_t {
+        capacity = static_cast<std::size_t>(std::min<off_t>(capacity, end - offset));
+        if (capacity == 0) return 0;
+        page_cache_guard pages(fd, offset, static_cast<off_t>(capacity), options.cache_neutral);
+        ssize_t n;
+        do {
+            n = ::pread(fd, buf, capacity, offset);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) offset += n;
+        return n;
+    };
+
+    // the inner stream has to be an ELF file too, the magic may arrive split over two pieces
+    std::uint8_t magic[4];
+    std::size_t magicLength = 0;
+    bool notElf = false;
+    stream_matcher stream(matcher);
+    byte_sink sink = [&](const std::uint8_t* data, std::size_t length) {
+        if (magicLength < 4) {
+            std::size_t take = std::min(length, 4 - magicLength);
+            std::memcpy(magic + magicLength, data, take);
+            magicLength += take;
+            if (magicLength == 4 && !is_elf(std::vector<std::uint8_t>(magic, magic + 4))) {
+                notElf = true;
+                return false;
+            }
+        }
+        phase_timer timer(scan_phase::search);
+        return !stream.feed(data, length);
+    };
+
+    inflate_result result = decompress_stream(format, source, sink, options);
+    if (result == inflate_result::bomb) {
+        std::cerr << "stopped decompressing, output is over the size/ratio limit" << "\n";
+        count_error(scan_error::decompression_bomb);
+    }
+    else if (result == inflate_result::corrupt) {
+        std::cerr << "compressed data is corrupt or truncated" << "\n";
+        count_error(scan_error::corrupt_compressed);
+    }
+    else if (result == inflate_result::read_error) {
+        std::cerr << "could not read" << "\n";
+        count_error(scan_error::cant_read);
+        throw CANT_READ;
+    }
+    else if (result == inflate_result::timed_out) {
+        throw TIMED_OUT;
+    }
+
+    if (notElf || magicLength < 4) {
+        count_event(scan_counter::skipped_non_elf);
+        return false;
+    }
+    return stream.found();
+}
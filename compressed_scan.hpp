@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include <sys/types.h>
+
+#include "file_scanner.hpp"
+
+enum class compression { none, gzip, xz, zstd };
+
+// looks at the first bytes of a file (6 are enough for every supported format)
+compression detect_compression(const std::uint8_t* header, std::size_t length);
+
+// false when the format was recognised but find_sig was built without its library (zstd)
+bool compression_supported(compression format);
+
+enum class inflate_result { done, stopped, bomb, corrupt, read_error, timed_out };
+
+// fills buf with up to capacity compressed bytes, 0 at the end of the input, < 0 on error
+using byte_source = std::function<ssize_t(std::uint8_t* buf, std::size_t capacity)>;
+// takes the next piece of decompressed output, returns false to stop decompressing
+using byte_sink = std::function<bool(const std::uint8_t* data, std::size_t length)>;
+
+// decompresses with fixed size buffers, the output is handed to the sink piece by piece and
+// never held as a whole. concatenated streams (multi member gzip, xz) are followed to the end.
+// stops with inflate_result::bomb once the output passes options.max_decompressed or
+// options.max_ratio times the compressed input read so far, and with inflate_result::timed_out
+// when the file being scanned runs out of time (scan_budget.hpp)
+inflate_result decompress_stream(compression format, const byte_source& source, const byte_sink& sink,
+                                 const scan_options& options);
+
+// the decompressed content of length bytes at offset in fd is checked for ELF magic and then
+// streamed through the matcher, nothing is written to disk
+bool contains_signature_compressed(int fd, off_t offset, off_t length, compression format,
+                                   const signature_matcher& matcher, const scan_options& options);
@@ -0,0 +1,159 @@
+#include "dir_summary.hpp"
+#include "scan_checkpoint.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+constexpr char summary_magic[] = "find_sig summary 1";
+constexpr std::size_t max_directories = 1 << 24;
+constexpr std::size_t max_entries = 1 << 24;
+// coarse kernel clocks stamp a file with the tick it was changed in, which can be milliseconds
+// behind the clock the scan reads. two seconds also covers filesystems with whole second times
+constexpr std::int64_t timestamp_granularity_ns = 2000000000;
+
+// the filesystems local to this machine that update a directory's times on every change to it
+const std::vector<std::string> trusted_filesystems = {
+    "ext2", "ext3", "ext4", "xfs", "btrfs", "f2fs", "tmpfs", "zfs", "bcachefs", "jfs", "reiserfs",
+};
+
+std::uint64_t mix(std::uint64_t hash, std::uint64_t value){
+    // FNV-1a over the 8 bytes
+    for (int i = 0; i < 8; ++i) {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::uint64_t mix(std::uint64_t hash, const std::string& text){
+    hash = mix(hash, text.size());
+    for (unsigned char byte : text) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <typename T>
+bool read_number(std::istream& in, T& value){
+    return static_cast<bool>(in >> value) && in.get() == '\n';
+}
+
+bool read_entry(std::istream& in, summary_entry& entry){
+    std::string kind;
+    if (!read_string(in, entry.name) || !read_string(in, kind)) return false;
+    if (kind.size() != 1 || (kind[0] != summary_entry::file && kind[0] != summary_entry::directory
+                             && kind[0] != summary_entry::other)) {
+        return false;
+    }
+    entry.kind = static_cast<summary_entry::kind_t>(kind[0]);
+    return read_number(in, entry.inode) && read_number(in, entry.size) && read_number(in, entry.mtime_ns)
+        && read_number(in, entry.ctime_ns) && read_number(in, entry.digest) && read_strings(in, entry.hits);
+}
+
+void write_entry(std::ostream& out, const summary_entry& entry){
+    write_string(out, entry.name);
+    write_string(out, std::string(1, static_cast<char>(entry.kind)));
+    out << entry.inode << "\n" << entry.size << "\n" << entry.mtime_ns << "\n" << entry.ctime_ns << "\n"
+        << entry.digest << "\n";
+    write_strings(out, entry.hits);
+}
+
+} // namespace
+
+std::uint64_t summary_digest(const std::vector<summary_entry>& entries){
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (const auto& entry : entries) {
+        hash = mix(hash, entry.name);
+        hash = mix(hash, entry.kind);
+        hash = mix(hash, entry.inode);
+        hash = mix(hash, entry.size);
+        hash = mix(hash, static_cast<std::uint64_t>(entry.mtime_ns));
+        hash = mix(hash, static_cast<std::uint64_t>(entry.ctime_ns));
+        hash = mix(hash, entry.digest);
+        hash = mix(hash, entry.hits.size());
+        for (const auto& hit : entry.hits) hash = mix(hash, hit);
+    }
+    return hash;
+}
+
+const summary_directory* dir_summary::find(const std::string& relative) const {
+    auto found = directories.find(relative);
+    return found == directories.end() ? nullptr : &found->second;
+}
+
+bool dir_summary::settled(std::int64_t mtime_ns, std::int64_t ctime_ns) const {
+    return std::max(mtime_ns, ctime_ns) < taken_ns - timestamp_granularity_ns;
+}
+
+bool load_summary(const fs::path& path, dir_summary& summary){
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::string magic;
+    if (!std::getline(in, magic) || magic != summary_magic) return false;
+    if (!read_number(in, summary.fingerprint) || !read_number(in, summary.taken_ns)) return false;
+    if (!read_string(in, summary.root)) return false;
+    std::size_t count;
+    if (!read_count(in, count, max_directories)) return false;
+    summary.directories.clear();
+    summary.directories.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::string relative;
+        summary_directory directory;
+        std::size_t entries;
+        if (!read_string(in, relative) || !read_number(in, directory.inode) || !read_number(in, directory.mtime_ns)
+            || !read_number(in, directory.ctime_ns) || !read_number(in, directory.digest)
+            || !read_count(in, entries, max_entries)) {
+            return false;
+        }
+        directory.entries.resize(entries);
+        for (auto& entry : directory.entries) {
+            if (!read_entry(in, entry)) return false;
+        }
+        // a torn or edited file must not vouch for anything
+        if (summary_digest(directory.entries) != directory.digest) return false;
+        summary.directories.emplace(std::move(relative), std::move(directory));
+    }
+    return true;
+}
+
+bool save_summary(const fs::path& path, const dir_summary& summary){
+    fs::path tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "could not write summary file " << tmp.string() << "\n";
+            return false;
+        }
+        out << summary_magic << "\n" << summary.fingerprint << "\n" << summary.taken_ns << "\n";
+        write_string(out, summary.root);
+        out << summary.directories.size() << "\n";
+        for (const auto& [relative, directory] : summary.directories) {
+            write_string(out, relative);
+            out << directory.inode << "\n" << directory.mtime_ns << "\n" << directory.ctime_ns << "\n"
+                << directory.digest << "\n" << directory.entries.size() << "\n";
+            for (const auto& entry : directory.entries) write_entry(out, entry);
+        }
+        out.flush();
+        if (!out) {
+            std::cerr << "could not write summary file " << tmp.string() << "\n";
+            return false;
+        }
+    }
+    std::error_code error;
+    fs::rename(tmp, path, error);
+    if (error) {
+        std::cerr << "could not write summary file " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool trusts_directory_times(const std::string& filesystem_type){
+    return std::find(trusted_filesystems.begin(), trusted_filesystems.end(), filesystem_type)
+        != trusted_filesystems.end();
+}
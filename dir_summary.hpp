@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// what a scan saw of one directory entry. for a file its identity and times and the hits it had,
+// for a directory its identity and times and the digest of everything below it
+struct summary_entry {
+    // other: an entry the walk skipped after its stat (a special file, another filesystem, a
+    // symlink loop). it is stat'ed again when its directory is not listed, the reason may be gone
+    enum kind_t : std::uint8_t { file = 'f', directory = 'd', other = 'o' };
+
+    std::string name;
+    kind_t kind = file;
+    std::uint64_t inode = 0;
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    std::int64_t ctime_ns = 0;
+    // directories: the merkle digest of the subtree
+    std::uint64_t digest = 0;
+    // files: the hits as printed minus the file's own path, "" for the file and "(member.o)" for
+    // members of an archive
+    std::vector<std::string> hits;
+};
+
+// one directory: its own identity and times, its digest and its entries in walk (name) order
+struct summary_directory {
+    std::uint64_t inode = 0;
+    std::int64_t mtime_ns = 0;
+    std::int64_t ctime_ns = 0;
+    std::uint64_t digest = 0;
+    std::vector<summary_entry> entries;
+};
+
+// the digest of a directory: every entry's name, identity, times and hits, and for directories
+// their digest, so it changes when anything anywhere below changes
+std::uint64_t summary_digest(const std::vector<summary_entry>& entries);
+
+// the directories of a previous scan by path below the root ("" is the root). fingerprint covers
+// the signatures and the options that change what a scan reports, a summary of another one is
+// not used. taken_ns is when that scan started: a file or directory changed in the second or
+// two before could have changed again without its time moving, it is not trusted
+class dir_summary {
+public:
+    std::string root;
+    std::uint64_t fingerprint = 0;
+    std::int64_t taken_ns = 0;
+    std::unordered_map<std::string, summary_directory> directories;
+
+    const summary_directory* find(const std::string& relative) const;
+
+    // times older than the scan that recorded them by more than the timestamp granularity
+    bool settled(std::int64_t mtime_ns, std::int64_t ctime_ns) const;
+};
+
+// false when the file is missing or not a summary
+bool load_summary(const fs::path& path, dir_summary& summary);
+// written next to path and renamed into place
+bool save_summary(const fs::path& path, const dir_summary& summary);
+
+// filesystems whose directory mtime/ctime move with every entry added, removed or renamed. on
+// others (network, FUSE, overlay) a directory is listed again even when its times match
+bool trusts_directory_times(const std::string& filesystem_type);
@@ -0,0 +1,60 @@
+#include "extent_order.hpp"
+#include "file_stat.hpp"
+#include "scan_metrics.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+physical_location locate_extent(const fs::path& path){
+    physical_location location;
+    location.offset = no_physical_offset;
+    int fd = ::open(path.c_str(), O_RDONLY | O_NOATIME | O_CLOEXEC);
+    if (fd < 0) fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC); // O_NOATIME needs ownership
+    if (fd < 0) return location; // the scan itself reports it
+
+    file_stat info;
+    if (stat_fd(fd, STATX_TYPE, stat_sync::cached, info) == 0 && S_ISREG(info.mode)) {
+        location.device = info.device;
+        // room for the first extent only, that is where the head has to go first
+        alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        auto* map = reinterpret_cast<struct fiemap*>(request);
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_extent_count = 1;
+        if (::ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+            !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+            location.offset = map->fm_extents[0].fe_physical;
+        }
+    }
+    ::close(fd);
+    return location;
+}
+
+std::vector<std::size_t> extent_order(const std::vector<fs::path>& paths){
+    std::vector<physical_location> locations;
+    locations.reserve(paths.size());
+    for (const auto& path : paths) {
+        phase_timer timer(scan_phase::stat);
+        locations.push_back(locate_extent(path));
+    }
+
+    std::vector<std::size_t> order(paths.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+        const physical_location& left = locations[a];
+        const physical_location& right = locations[b];
+        const bool leftKnown = left.offset != no_physical_offset;
+        const bool rightKnown = right.offset != no_physical_offset;
+        if (leftKnown != rightKnown) return leftKnown;
+        if (!leftKnown) return false;
+        if (left.device != right.device) return left.device < right.device;
+        return left.offset < right.offset;
+    });
+    return order;
+}
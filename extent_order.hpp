@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// where a file's data starts on disk: the device and the physical byte offset of its first
+// extent (FIEMAP). files without one (empty, inline in the inode, delayed allocation, a
+// filesystem without FIEMAP) get no_physical_offset and sort behind the rest
+struct physical_location {
+    std::uint64_t device = 0;
+    std::uint64_t offset = 0;
+};
+
+constexpr std::uint64_t no_physical_offset = UINT64_MAX;
+
+physical_location locate_extent(const fs::path& path);
+
+// the order to scan a batch of files in so a spinning disk's head sweeps across the platter
+// once instead of seeking back and forth: ascending device and physical offset, files that
+// could not be located last in the order given
+std::vector<std::size_t> extent_order(const std::vector<fs::path>& paths);
@@ -1,4 +1,18 @@
 #include "file_scanner.hpp"
+#include "file_stat.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+#include "compressed_scan.hpp"
+#include "archive_scan.hpp"
+#include "tree_walk.hpp"
+#include "parallel_scan.hpp"
+#include "uring_scan.hpp"
+#include "isolated_scan.hpp"
+#include "io_throttle.hpp"
+#include "cache_neutral.hpp"
+#include "read_tuning.hpp"
+#include "huge_pages.hpp"
+#include "scan_budget.hpp"
 
 #include <filesystem>
 #include <vector>
@@ -6,8 +20,17 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
-#include <iostream>
+#include <chrono>
+#include <functional>
+#include <cerrno>
+#include <cstdio>
 #include <deque>
+#include <optional>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
@@ -43,83 +66,434 @@ std::vector<std::uint8_t> extract_sig(const fs::path& path){
     return fileData;
 }
 
-bool contains_signature(const fs::path& path, const std::vector<std::uint8_t>& signature){
+signature_list extract_sig_list(const fs::path& path){
+
     if(!fs::is_regular_file(path) || !fs::exists(path)){
         std::cerr << "path does not point to a file" << "\n";
         throw NOT_FILE;
     }
 
-    std::ifstream file(path, std::ifstream::binary | std::ifstream::ate);
-    
+    std::ifstream file(path);
     if (!file){
         std::cerr << "could not open file" << "\n";
         throw CANT_OPEN;
     }
 
-    std::streamsize size = file.tellg();
-    if(size < 4){
-        std::clog << "not an elf file";
-        return false;
+    auto hex = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    signature_list signatures;
+    std::string line;
+    std::size_t lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+        std::size_t first = line.find_first_not_of(" \t\r");
+        std::size_t last = line.find_last_not_of(" \t\r");
+        if (first != std::string::npos && line[first] == '/') {
+            if (last == first || line[last] != '/') {
+                std::cerr << "line " << lineNumber << " of the signature list has no closing /" << "\n";
+                throw CANT_READ;
+            }
+            std::string regex = line.substr(first + 1, last - first - 1);
+            try {
+                byte_regex check(regex);
+            }
+            catch (const std::invalid_argument& error) {
+                std::cerr << "line " << lineNumber << " of the signature list: " << error.what() << "\n";
+                throw CANT_READ;
+            }
+            signatures.regexes.push_back(regex);
+            continue;
+        }
+        std::string digits;
+        for (char c : line) {
+            if (c != ' ' && c != '\t' && c != '\r') digits += c;
+        }
+        if (digits.empty() || digits[0] == '#') continue;
+        if (digits.size() % 2 != 0) {
+            std::cerr << "line " << lineNumber << " of the signature list is not hex" << "\n";
+            throw CANT_READ;
+        }
+        std::vector<std::uint8_t> signature;
+        for (std::size_t i = 0; i < digits.size(); i += 2) {
+            int high = hex(digits[i]);
+            int low = hex(digits[i + 1]);
+            if (high < 0 || low < 0) {
+                std::cerr << "line " << lineNumber << " of the signature list is not hex" << "\n";
+                throw CANT_READ;
+            }
+            signature.push_back(static_cast<std::uint8_t>(high << 4 | low));
+        }
+        signatures.literals.push_back(std::move(signature));
     }
-    file.seekg(0, std::ios::beg);
+    if (file.bad() || (signatures.literals.empty() && signatures.regexes.empty())){
+        std::cerr << "could not read a signature from the list" << "\n";
+        throw CANT_READ;
+    }
+
+    return signatures;
+}
+
+namespace {
+
+// closes the descriptor on every way out of contains_signature (including the int throws)
+struct fd_guard {
+    int fd;
+    ~fd_guard() { if (fd >= 0) ::close(fd); }
+};
+
+// pread that retries on EINTR and short reads, returns the number of bytes read (0 at EOF)
+ssize_t read_at(int fd, std::uint8_t* buf, std::size_t count, off_t offset){
+    std::size_t done = 0;
+    while (done < count) {
+        ssize_t n = ::pread(fd, buf + done, count - done, offset + static_cast<off_t>(done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += static_cast<std::size_t>(n);
+    }
+    return static_cast<ssize_t>(done);
+}
 
-    //check if elf
-    std::vector<std::uint8_t> elfBuffer;
-    elfBuffer.resize(4);
-    if(!file.read(reinterpret_cast<char*>(elfBuffer.data()), 4)){
+// enough for the ELF magic, every compression magic and "!<arch>\n"
+constexpr std::size_t header_size = 8;
+
+std::size_t read_header(int fd, off_t offset, off_t length, std::uint8_t* header){
+    std::size_t wanted = static_cast<std::size_t>(std::min<off_t>(length, header_size));
+    if(read_at(fd, header, wanted, offset) != static_cast<ssize_t>(wanted)){
         std::cerr << "could not read" << "\n";
+        count_error(scan_error::cant_read);
         throw CANT_READ;
     }
-    if( !is_elf(elfBuffer)){
-        return false;
+    return wanted;
+}
+
+//the idea is so read chuncks from the file and search in each of them using the build in search function ,
+// also there have to be a overlap between chunks to not miss the signiture.
+// pread is used so the descriptor's offset is never touched - the fd might be shared (fanotify)
+bool search_range(int fd, off_t begin, off_t length, const signature_matcher& matcher, const scan_options& options){
+    if (matcher.matches_everything()) return true;
+    // regexes run in the same pass and see every byte once, their dfa state carries over from
+    // chunk to chunk so they need no overlap
+    std::vector<byte_regex_stream> regexes(matcher.regexes().begin(), matcher.regexes().end());
+    for (const auto& regex : regexes) {
+        if (regex.found()) return true;
+    }
+    off_t fed = begin;
+    // chunk size and readahead depth depend on the device, see read_tuning.hpp
+    read_plan plan = plan_reads(fd);
+    if (options.chunk_size) {
+        plan.chunk = options.chunk_size;
+        plan.device = nullptr;
     }
+    // under --max-io-rate the chunks shrink to the bucket size so reads stay short bursts
+    std::size_t buffer_size = std::min(plan.chunk, std::max(io_burst_size(), 2 * matcher.size()));
+    buffer_size = std::max(buffer_size, 2 * matcher.size());
+    if (buffer_size != plan.chunk) plan.device = nullptr;
+    const std::size_t chunk = std::min<std::size_t>(buffer_size, static_cast<std::size_t>(length));
 
-    //the idea is so read chuncks from the file and search in each of them using the build in search function ,
-    // also there have to be a overlap between chunks to not miss the signiture
-    std::size_t buffer_size  = 8 * 1024 * 1024; //8Mb chuncks
-    std::vector<std::uint8_t> buffer(buffer_size );
-    auto bm_searcher  = std::boyer_moore_searcher(signature.begin(), signature.end());
-    const std::size_t overlap = signature.size() - 1;
+    // cache neutral: read around the page cache with O_DIRECT, where the filesystem refuses
+    // that read normally and drop the pages that were not cached before after each chunk
+    fd_guard direct{options.cache_neutral ? open_direct(fd) : -1};
+    aligned_buffer alignedBuffer;
+    // kept per thread and reused for every file: no allocation and zero fill per file, and
+    // its pages are first touched by (so allocated on the node of) the thread that scans
+    // huge page backed, an 8MB buffer is 4 TLB entries instead of 2048
+    thread_local huge_buffer buffer;
+    // an unaligned start costs up to one block in front, the rounded up end one behind
+    const std::size_t directCapacity = chunk + 2 * direct_alignment;
+    if (direct.fd >= 0) alignedBuffer = make_aligned_buffer(directCapacity);
+    else if (buffer.size() < chunk) buffer.grow(buffer_size);
 
-    while (file) {
-        file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
-        std::streamsize bytes_read = file.gcount();
-        if (bytes_read <= 0) break; // EOF or read error
+    const std::size_t overlap = matcher.size() > 0 ? matcher.size() - 1 : 0;
+    const off_t end = begin + length;
+    off_t offset = begin;
 
-        auto it = std::search(buffer.begin(), buffer.begin() + bytes_read, bm_searcher);
-        if (it != buffer.begin() + bytes_read) {
+    // the kernel reads the next chunks while this one is searched. not for cache neutral scans,
+    // that would fill the page cache behind their back
+    const bool hint = !options.cache_neutral && plan.readahead_chunks > 0 && static_cast<std::size_t>(length) > chunk;
+    off_t hinted = begin;
+    if (hint) ::posix_fadvise(fd, begin, length, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < end) {
+        char chunkName[32] = "";
+        if (tracing_enabled()) std::snprintf(chunkName, sizeof(chunkName), "offset %lld", static_cast<long long>(offset));
+        trace_span span("chunk", chunkName);
+
+        std::size_t wanted = static_cast<std::size_t>(std::min<off_t>(end - offset, chunk));
+        check_budget();
+        throttle_io(wanted);
+        if (hint) {
+            off_t from = std::max<off_t>(hinted, offset + static_cast<off_t>(wanted));
+            off_t to = std::min<off_t>(end, offset + static_cast<off_t>(wanted * (1 + plan.readahead_chunks)));
+            if (to > from) {
+                ::posix_fadvise(fd, from, to - from, POSIX_FADV_WILLNEED);
+                hinted = to;
+            }
+        }
+        auto readStart = std::chrono::steady_clock::now();
+        const std::uint8_t* data = nullptr;
+        std::optional<page_cache_guard> dropAfterSearch;
+        ssize_t bytes_read = -1;
+        {
+            phase_timer timer(scan_phase::read);
+            if (direct.fd >= 0) {
+                bytes_read = read_direct(direct.fd, alignedBuffer.get(), directCapacity, offset, wanted, data);
+                if (bytes_read < 0 && errno == EINVAL) {
+                    // the device wants a bigger alignment, go on with the fallback
+                    ::close(direct.fd);
+                    direct.fd = -1;
+                    alignedBuffer.reset();
+                    if (buffer.size() < chunk) buffer.grow(buffer_size);
+                }
+            }
+            if (direct.fd < 0) {
+                dropAfterSearch.emplace(fd, offset, static_cast<off_t>(wanted), options.cache_neutral);
+                bytes_read = read_at(fd, buffer.data(), wanted, offset);
+                data = buffer.data();
+            }
+        }
+        if (bytes_read < 0) {
+            std::cerr << "could not read" << "\n";
+            count_error(scan_error::cant_read);
+            throw CANT_READ;
+        }
+        if (bytes_read == 0) break; // EOF
+        count_event(scan_counter::bytes_read, static_cast<std::uint64_t>(bytes_read));
+        charge_budget(static_cast<std::size_t>(bytes_read));
+        note_read(plan, static_cast<std::size_t>(bytes_read), static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - readStart).count()));
+
+        bool found;
+        {
+            phase_timer timer(scan_phase::search);
+            const std::uint8_t* last = data + bytes_read;
+            found = matcher.find(data, last) != last;
+            const std::uint8_t* fresh = data + (fed - offset);
+            for (auto it = regexes.begin(); !found && it != regexes.end(); ++it) found = it->feed(fresh, last - fresh);
+            fed = offset + bytes_read;
+        }
+        if (found) {
             return true;
         }
 
         // last chunk
-        if (bytes_read < static_cast<std::streamsize>(buffer_size)) break;
+        if (bytes_read < static_cast<ssize_t>(wanted) || offset + bytes_read >= end) break;
 
-        //return to scann the overlap between to chunks
-        if (!file.seekg(-static_cast<std::streamoff>(overlap), std::ios::cur)) {
-            std::cerr << "seekg failed\n";
-            throw CANT_READ;
-        }
+        //step back to scann the overlap between to chunks
+        offset += std::max<off_t>(bytes_read - static_cast<off_t>(overlap), 1);
     }
 
     return false; // not found
 }
 
-void scanner(const fs::path& root, const std::vector<std::uint8_t>& signature){
+// the ELF (or compressed ELF) check and the search, header holds the first bytes of the range
+bool check_range(int fd, off_t offset, off_t length, const std::uint8_t* header, std::size_t headerLength,
+                 const signature_matcher& matcher, const scan_options& options){
+    compression format = compression::none;
+    {
+        phase_timer timer(scan_phase::elf_check);
+        if (options.decompress) format = detect_compression(header, headerLength);
+        if (format == compression::none && !is_elf(std::vector<std::uint8_t>(header, header + headerLength))) {
+            count_event(scan_counter::skipped_non_elf);
+            return false;
+        }
+    }
+    if (format != compression::none) {
+        return contains_signature_compressed(fd, offset, length, format, matcher, options);
+    }
+    return search_range(fd, offset, length, matcher, options);
+}
+
+using report_fn = std::function<void(const std::string&)>;
 
-    if(!fs::exists(root)){
-        return;
+// the header check, archive members or the search of a file of size >= 4, report gets every hit
+void scan_contents(int fd, const std::string& name, off_t size, const signature_matcher& matcher,
+                   const scan_options& options, const report_fn& report){
+    // the header is read through the page cache, its page goes again unless it was cached before.
+    // no readahead, it would pull in pages the guard does not know about
+    if (options.cache_neutral) ::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    page_cache_guard headerPage(fd, 0, header_size, options.cache_neutral);
+    std::uint8_t header[header_size];
+    std::size_t headerLength;
+    {
+        phase_timer timer(scan_phase::elf_check);
+        headerLength = read_header(fd, 0, size, header);
     }
 
-    if(fs::is_directory(root)){
-        for(auto const& entry : fs::directory_iterator(root)){
-            scanner(entry.path(), signature);
-        }
+    if (options.scan_archives && is_ar_archive(header, headerLength)) {
+        // member headers and compressed members are small reads all over the file
+        page_cache_guard archivePages(fd, 0, size, options.cache_neutral);
+        scan_ar_members(fd, size, matcher, options, [&](const std::string& member){
+            count_event(scan_counter::infected);
+            report(name + "(" + member + ")");
+        });
         return;
     }
 
-    if(contains_signature(root, signature)){
-        std::cout << root.string() << " is infected!" << "\n";
+    if (!check_range(fd, 0, size, header, headerLength, matcher, options)) return;
+    count_event(scan_counter::infected);
+    report(name);
+}
+
+// everything contains_signature_fd does, and on top names every hit: the file itself or
+// name(member) for members of an ar archive. returns the number of hits
+// known is what the caller already has on the file, its mode is taken from there. the size is not:
+// the walk's may be cached attributes, older than the file on NFS or FUSE. asked of the open file
+// it is fresh, and costs no round trip there, the open revalidated the attributes
+std::size_t scan_descriptor(int fd, const std::string& name, const signature_matcher& matcher,
+                            const scan_options& options, const report_fn& report, const file_stat* known){
+    file_stat info;
+    int statResult;
+    {
+        phase_timer timer(scan_phase::stat);
+        statResult = stat_fd(fd, known ? STATX_SIZE : STATX_TYPE | STATX_SIZE, stat_sync::as_stat, info);
+    }
+    if (known) info.mode = known->mode;
+    if (statResult != 0 || !S_ISREG(info.mode)) {
+        std::cerr << "path does not point to a file" << "\n";
+        count_error(scan_error::not_file);
+        throw NOT_FILE;
+    }
+    count_event(scan_counter::files_scanned);
+    file_budget budget(options, info.size);
+
+    const off_t size = static_cast<off_t>(info.size);
+    if(size < 4){
+        std::clog << "not an elf file";
+        count_event(scan_counter::skipped_non_elf);
+        return 0;
+    }
+
+    std::size_t hits = 0;
+    try {
+        check_budget();
+        scan_contents(fd, name, size, matcher, options, [&](const std::string& hit){
+            ++hits;
+            if (report) report(hit);
+        });
+    }
+    catch (int code) {
+        if (code != TIMED_OUT) throw;
+        // past the deadline before the first byte: not started rather than cut short
+        const file_coverage& coverage = last_file_coverage();
+        if (!name.empty() && (!coverage.by_deadline || coverage.covered > 0)) report_timeout(name, coverage);
+    }
+    return hits;
+}
+
+// known: the caller already made sure this is a regular file, an open cannot block on a fifo
+void open_file(const fs::path& path, fd_guard& file, const file_stat* known = nullptr){
+    bool isFile = known && S_ISREG(known->mode);
+    if (!known) {
+        phase_timer timer(scan_phase::stat);
+        file_stat info;
+        isFile = stat_path(path.c_str(), STATX_TYPE, stat_sync::as_stat, info) == 0 && S_ISREG(info.mode);
+    }
+    if(!isFile){
+        std::cerr << "path does not point to a file" << "\n";
+        count_error(scan_error::not_file);
+        throw NOT_FILE;
+    }
+
+    {
+        phase_timer timer(scan_phase::open);
+        file.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (file.fd < 0){
+        std::cerr << "could not open file" << "\n";
+        count_error(scan_error::cant_open);
+        throw CANT_OPEN;
+    }
+}
+
+} // namespace
+
+bool contains_signature_range(int fd, off_t offset, off_t length, const signature_matcher& matcher,
+                              const scan_options& options){
+    if (length < 4) {
+        count_event(scan_counter::skipped_non_elf);
+        return false;
     }
+    page_cache_guard headerPage(fd, offset, header_size, options.cache_neutral);
+    std::uint8_t header[header_size];
+    std::size_t headerLength;
+    {
+        phase_timer timer(scan_phase::elf_check);
+        headerLength = read_header(fd, offset, length, header);
+    }
+    return check_range(fd, offset, length, header, headerLength, matcher, options);
+}
+
+bool contains_signature_fd(int fd, const signature_matcher& matcher, const scan_options& options,
+                           const file_stat* known){
+    return scan_descriptor(fd, std::string(), matcher, options, nullptr, known) > 0;
+}
+
+bool contains_signature_fd(int fd, const std::vector<std::uint8_t>& signature){
+    return contains_signature_fd(fd, signature_matcher(signature));
+}
+
+bool contains_signature(const fs::path& path, const signature_matcher& matcher, const scan_options& options,
+                        const file_stat* known){
+    trace_span span("file", path.c_str());
+    fd_guard file{-1};
+    open_file(path, file, known);
+    return contains_signature_fd(file.fd, matcher, options, known);
+}
+
+bool contains_signature(const fs::path& path, const std::vector<std::uint8_t>& signature){
+    return contains_signature(path, signature_matcher(signature));
+}
 
-    return;
-}
\ No newline at end of file
+std::size_t scan_path(const fs::path& path, const signature_matcher& matcher, const scan_options& options,
+                      const std::function<void(const std::string& name)>& report, const file_stat* known){
+    trace_span span("file", path.c_str());
+    fd_guard file{-1};
+    open_file(path, file, known);
+    return scan_descriptor(file.fd, path.string(), matcher, options, report, known);
+}
+
+std::size_t scan_fd(int fd, const std::string& name, const signature_matcher& matcher, const scan_options& options,
+                    const std::function<void(const std::string& name)>& report, const file_stat* known){
+    return scan_descriptor(fd, name, matcher, options, report, known);
+}
+
+bool scanner(const fs::path& root, const std::vector<std::uint8_t>& signature, const scan_options& options){
+    return scanner(root, signature_list{{signature}, {}}, options);
+}
+
+bool scan_walk(tree_walk& walk, const signature_list& signatures, const scan_options& options){
+    if (options.isolate > 0) return isolated_scan(walk, signatures, options);
+    if (options.threads > 1) return parallel_scan(walk, signatures, options);
+    if (options.io_uring) return uring_scan(walk, signatures, options);
+    // the matcher for this signature length (or the prefilter for a big set, the regex
+    // programs) is built once for the whole tree
+    const signature_matcher matcher(signatures);
+    return walk.run([&](const fs::path& path, const std::vector<std::string>&, std::uint64_t,
+                        const file_stat& info){
+        scan_path(path, matcher, options, [&](const std::string& name){ walk.report(name); }, &info);
+    }, true);
+}
+
+bool scanner(const fs::path& root, const signature_list& signatures, const scan_options& options){
+    tree_walk walk(root, signatures, options);
+    walk.resume();
+
+    const bool completed = scan_walk(walk, signatures, options);
+    if (!completed) {
+        if (!walk.deadline_passed()) std::cout << "stopped, continue with --resume" << "\n";
+        else if (options.checkpoint_file.empty()) std::cout << "deadline reached, the scan is not complete" << "\n";
+        else std::cout << "deadline reached, continue with --resume" << "\n";
+        return false;
+    }
+    // nothing left to resume
+    walk.complete();
+    return true;
+}
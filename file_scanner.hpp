@@ -1,18 +1,136 @@
 #pragma once
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <string>
 #include <vector>
 #include <cstdint>
 
+#include <sys/types.h>
+
+#include "signature_matcher.hpp"
+
 #define CANT_OPEN 300
 #define NOT_FILE 400
 #define CANT_READ 500
+// a file out of time (scan_options::file_timeout, deadline), never thrown out of scan_path
+#define TIMED_OUT 700
 
 namespace fs = std::filesystem;
 
+struct file_stat;
+class tree_walk;
+
+// knobs of a scan, the defaults are what a plain "find_sig root sig" run uses
+struct scan_options {
+    // gzip / xz / zstd files are decompressed on the fly and their content checked for ELF magic
+    bool decompress = true;
+    // decompression bomb guard: give up once the output is this many times the compressed
+    // input (judged after the first 64 MiB) or bigger than max_decompressed
+    std::uint64_t max_ratio = 1000;
+    std::uint64_t max_decompressed = 256ULL << 30;
+    // members of ar archives (.a, .deb) are checked one by one and reported as archive.a(member.o)
+    bool scan_archives = true;
+    // keep the page cache as it was: O_DIRECT reads, or POSIX_FADV_DONTNEED on the pages the
+    // scan pulled in where the filesystem does not support O_DIRECT
+    bool cache_neutral = false;
+    // bytes per read, 0 picks it per device and adapts it to the throughput seen (read_tuning.hpp)
+    std::size_t chunk_size = 0;
+    // scanner() scans files on this many threads, with numa they are pinned node by node and
+    // keep their buffers and matcher tables on their own node
+    unsigned threads = 1;
+    bool numa = false;
+    // scanner() collects this many files, looks up where their data is on disk and scans them in
+    // physical order (extent_order.hpp), for spinning disks. 0 scans in walk order
+    std::size_t extent_batch = 0;
+    // the single threaded scanner() reads small files through io_uring, open, read and close of
+    // many files in one system call (uring_scan.hpp). falls back to blocking reads without it
+    bool io_uring = false;
+    // scanner() scans files in this many worker processes (isolated_scan.hpp), a file that
+    // crashes the scan takes down its worker and not the scan. 0 scans in this process
+    unsigned isolate = 0;
+    // scanner() scans the paths listed in files_from ("-" for stdin) instead of walking the root,
+    // separated by NUL or by newlines, whichever comes first. paths are scanned as they are read,
+    // the list may still be written to. a listed directory is walked. there is no checkpoint or
+    // summary of a list
+    std::string files_from;
+    // the walk skips entries matching an exclude glob along with everything below them, with
+    // include globs only files matching one are scanned, directories are still entered
+    // (path_filter.hpp). both are decided on the name, before the entry is stat'ed
+    std::vector<std::string> exclude;
+    std::vector<std::string> include;
+    // stay on the root's filesystem: directories with another st_dev are not entered
+    bool one_file_system = false;
+    // mounts below the root of pseudo filesystems (proc, sysfs, devtmpfs, ...) and of the
+    // filesystem types in skip_fstypes are not entered, the root itself always is
+    bool skip_pseudo_filesystems = true;
+    std::vector<std::string> skip_fstypes;
+    // the single threaded scanner() keeps what it saw of every directory in summary_file
+    // (dir_summary.hpp). the next scan does not read a file whose inode, size, mtime and ctime are
+    // unchanged, its hits come from the summary, and does not list a directory whose times did
+    // not move. with trust_dir_times the files of an unchanged directory are not even stat'ed,
+    // only right where files are replaced and never rewritten in place (package managed trees)
+    fs::path summary_file;
+    bool trust_dir_times = false;
+    // a file is given up on after file_timeout (0: never) and the scan after deadline: the loops
+    // reading a file look at the clock before every read. the file is reported with how much of
+    // it was scanned (scan_budget.hpp), a scan past the deadline stops like after a SIGINT. a read
+    // that does not return (a hung NFS server) is only cut short with isolate, its worker is
+    // killed
+    std::chrono::milliseconds file_timeout{0};
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // scanner() saves where it is to checkpoint_file every checkpoint_interval (and when it gets
+    // SIGINT/SIGTERM, it then stops), with resume it skips what the checkpoint says is done
+    fs::path checkpoint_file;
+    std::chrono::seconds checkpoint_interval{30};
+    bool resume = false;
+};
+
 bool is_elf(const std::vector<std::uint8_t>& fileData);
 
 bool contains_signature(const fs::path& path, const std::vector<std::uint8_t>& signature);
 
+// same as contains_signature but on an already open descriptor (e.g. one handed over by fanotify),
+// the descriptor's file offset is left untouched
+bool contains_signature_fd(int fd, const std::vector<std::uint8_t>& signature);
+
+// the same with a matcher built once up front, this is what scanner() and the on-access workers use.
+// known is the file's mode and size when the caller already has them (file_stat.hpp), the path is
+// not stat'ed before the open then. the size scanned is always the open file's own
+bool contains_signature(const fs::path& path, const signature_matcher& matcher,
+                        const scan_options& options = scan_options(), const file_stat* known = nullptr);
+bool contains_signature_fd(int fd, const signature_matcher& matcher,
+                           const scan_options& options = scan_options(), const file_stat* known = nullptr);
+
+// the ELF (or compressed ELF) check and the search applied to length bytes at offset, used for
+// archive members. the descriptor's offset is left untouched
+bool contains_signature_range(int fd, off_t offset, off_t length, const signature_matcher& matcher,
+                              const scan_options& options = scan_options());
+
+// opens and scans one file, report gets every hit: the path, or path(member) for archive members.
+// returns the number of hits
+std::size_t scan_path(const fs::path& path, const signature_matcher& matcher, const scan_options& options,
+                      const std::function<void(const std::string& name)>& report, const file_stat* known = nullptr);
+// the same on a descriptor the caller opened, hits are name or name(member)
+std::size_t scan_fd(int fd, const std::string& name, const signature_matcher& matcher, const scan_options& options,
+                    const std::function<void(const std::string& name)>& report, const file_stat* known = nullptr);
+
 std::vector<std::uint8_t> extract_sig(const fs::path& path);
 
-void scanner(const fs::path& root, const std::vector<std::uint8_t>& signature);
\ No newline at end of file
+// a text file with one hex signature per line ("7f454c46", spaces allowed between bytes) or a
+// byte regex between slashes (/http:\/\/[a-z.]+\x48\x8b/, see byte_regex.hpp), empty lines and
+// lines starting with # are skipped. throws like extract_sig, and CANT_READ when a line is not
+// hex, a regex does not compile or there is no signature at all
+signature_list extract_sig_list(const fs::path& path);
+
+bool scanner(const fs::path& root, const std::vector<std::uint8_t>& signature,
+             const scan_options& options = scan_options());
+// reports files with any of the signatures. false when the scan was stopped before the end (a
+// signal, the deadline). a file that cannot be opened or read throws its error out (NOT_FILE,
+// CANT_OPEN, CANT_READ) and ends the scan, except with options.isolate
+bool scanner(const fs::path& root, const signature_list& signatures,
+             const scan_options& options = scan_options());
+
+// the scan behind scanner() on a walk the caller set up (the workers of shard_scan.hpp): in
+// worker processes, on threads, through io_uring or on this thread as options say. false when it was stopped
+bool scan_walk(tree_walk& walk, const signature_list& signatures, const scan_options& options);
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "file_stat.hpp"
+
+#include <atomic>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/sysmacros.h>
+
+namespace {
+
+std::atomic<bool> statx_missing{false};
+// statx left out a field that was asked for
+constexpr int statx_incomplete = -1;
+
+void from_stat(const struct stat& st, file_stat& out){
+    out.mode = st.st_mode & S_IFMT;
+    out.size = static_cast<std::uint64_t>(st.st_size);
+    out.inode = st.st_ino;
+    out.mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    out.ctime_ns = static_cast<std::int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+    out.links = st.st_nlink;
+    out.device = st.st_dev;
+}
+
+int call_statx(int dirfd, const char* path, int flags, unsigned fields, stat_sync sync, file_stat& out){
+    struct statx sx;
+    flags |= sync == stat_sync::cached ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT;
+    if (::statx(dirfd, path, flags, fields, &sx) != 0) return errno;
+    // a filesystem may not have them all, the field would read as 0. stat fills in something
+    if ((sx.stx_mask & fields) != fields) return statx_incomplete;
+    out.mode = sx.stx_mode & S_IFMT;
+    out.size = sx.stx_size;
+    out.inode = static_cast<ino_t>(sx.stx_ino);
+    out.mtime_ns = sx.stx_mtime.tv_sec * 1000000000 + sx.stx_mtime.tv_nsec;
+    out.ctime_ns = sx.stx_ctime.tv_sec * 1000000000 + sx.stx_ctime.tv_nsec;
+    out.links = sx.stx_nlink;
+    out.device = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    return 0;
+}
+
+} // namespace
+
+int stat_path(const char* path, unsigned fields, stat_sync sync, file_stat& out){
+    if (!statx_missing.load(std::memory_order_relaxed)) {
+        int error = call_statx(AT_FDCWD, path, 0, fields, sync, out);
+        if (error != ENOSYS && error != statx_incomplete) return error;
+        if (error == ENOSYS) statx_missing = true;
+    }
+    struct stat st;
+    if (::stat(path, &st) != 0) return errno;
+    from_stat(st, out);
+    return 0;
+}
+
+int stat_fd(int fd, unsigned fields, stat_sync sync, file_stat& out){
+    if (!statx_missing.load(std::memory_order_relaxed)) {
+        int error = call_statx(fd, "", AT_EMPTY_PATH, fields, sync, out);
+        if (error != ENOSYS && error != statx_incomplete) return error;
+        if (error == ENOSYS) statx_missing = true;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) return errno;
+    from_stat(st, out);
+    return 0;
+}
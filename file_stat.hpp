@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// file metadata through statx, asking only for the fields a caller needs. on network and FUSE
+// filesystems each field asked for can mean revalidating the attributes with the server, a plain
+// stat asks for all of them
+struct file_stat {
+    mode_t mode = 0;           // STATX_TYPE, the S_IFMT bits
+    std::uint64_t size = 0;    // STATX_SIZE
+    ino_t inode = 0;           // STATX_INO
+    std::int64_t mtime_ns = 0; // STATX_MTIME
+    std::int64_t ctime_ns = 0; // STATX_CTIME
+    std::uint64_t links = 0;   // STATX_NLINK
+    dev_t device = 0;          // always there
+};
+
+// cached takes whatever attributes the client has without asking the server
+// (AT_STATX_DONT_SYNC), local filesystems ignore it
+enum class stat_sync { as_stat, cached };
+
+// fields are STATX_* bits. return 0 or the errno, on kernels without statx, or when the
+// filesystem did not return all the fields asked for, they fall back to stat / fstat. stat_path
+// follows symlinks
+int stat_path(const char* path, unsigned fields, stat_sync sync, file_stat& out);
+int stat_fd(int fd, unsigned fields, stat_sync sync, file_stat& out);
@@ -1,27 +1,338 @@
 #include "file_scanner.hpp"
+#include "io_throttle.hpp"
+#include "isolated_scan.hpp"
+#include "huge_pages.hpp"
+#include "on_access.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+#include "shard_scan.hpp"
+#include "tar_scan.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
+#include <memory>
+#include <string>
 #include <vector>
+#include <unistd.h>
 
 
 
 namespace fs = std::filesystem;
 
+namespace {
+
+void usage(){
+    std::cout << "usage: find_sig [options] path_of_root path_of_sig" << "\n";
+    std::cout << "       find_sig [options] --tar LAYER [--tar LAYER...] path_of_sig" << "\n";
+    std::cout << "       find_sig [options] --files-from LIST path_of_sig" << "\n";
+    std::cout << "       find_sig [options] --coordinator ADDRESS path_of_root path_of_sig" << "\n";
+    std::cout << "       find_sig [options] --worker ADDRESS path_of_sig" << "\n";
+    std::cout << "       (with --sigs LIST the path_of_sig is left out)" << "\n";
+    std::cout << "options:" << "\n";
+    std::cout << "  --sigs LIST                 look for every signature in LIST, one hex signature or /byte regex/ per line" << "\n";
+    std::cout << "  --on-access                 block execve of infected files on the mount of path_of_root (fanotify)" << "\n";
+    std::cout << "  --verdict-deadline-ms N     answer every exec within N ms (default 200)" << "\n";
+    std::cout << "  --deny-on-timeout           deny instead of allow when the deadline is missed" << "\n";
+    std::cout << "  --deny-on-error             deny instead of allow when the binary cannot be read" << "\n";
+    std::cout << "  --workers N                 scanning threads for --on-access (default 4)" << "\n";
+    std::cout << "  --threads N                 scan files on N threads (default 1)" << "\n";
+    std::cout << "  --io-uring                  read small files through io_uring, many open/read/close in one system call" << "\n";
+    std::cout << "  --isolate N                 scan files in N worker processes, a file that crashes one is reported and the scan goes on" << "\n";
+    std::cout << "  --numa                      pin the --threads workers node by node, buffers and tables stay node local" << "\n";
+    std::cout << "  --extent-order N            scan files N at a time in the order their data lies on disk, for spinning disks (e.g. 1024)" << "\n";
+    std::cout << "  --exclude GLOB              skip files and directories matching GLOB (name, or path below the root with a /), repeatable" << "\n";
+    std::cout << "  --include GLOB              only scan files matching GLOB, repeatable" << "\n";
+    std::cout << "  --one-file-system           do not enter directories on other filesystems than the root's" << "\n";
+    std::cout << "  --skip-fstype TYPE          do not enter mounts of TYPE (e.g. nfs), repeatable. proc, sysfs, devtmpfs and the like are always skipped" << "\n";
+    std::cout << "  --no-decompress             do not look inside gzip/xz/zstd compressed files" << "\n";
+    std::cout << "  --no-archives               do not look at the members of ar archives (.a, .deb)" << "\n";
+    std::cout << "  --files-from LIST           scan the paths in LIST (- for stdin, NUL or newline separated) as they are read, instead of a directory" << "\n";
+    std::cout << "  --coordinator ADDRESS       hand the tree out in pieces to the workers connecting to ADDRESS (unix:/path or host:port), print their hits" << "\n";
+    std::cout << "  --worker ADDRESS            scan the pieces the coordinator at ADDRESS hands out" << "\n";
+    std::cout << "  --shards N                  pieces the coordinator cuts the tree into up front (default 256)" << "\n";
+    std::cout << "  --tar PATH                  scan a tar stream (plain or compressed, - for stdin) instead of a directory, repeat for image layers lowest first" << "\n";
+    std::cout << "  --whiteouts                 treat the --tar layers as one image, whiteouts in upper layers hide lower files" << "\n";
+    std::cout << "  --max-ratio N               stop decompressing past N times the compressed size (default 1000)" << "\n";
+    std::cout << "  --chunk-size SIZE           read SIZE bytes at a time, K/M suffixes (default picked per device and adapted)" << "\n";
+    std::cout << "  --no-huge-pages             do not back scan buffers with huge pages (MAP_HUGETLB / transparent huge pages)" << "\n";
+    std::cout << "  --cache-neutral             read with O_DIRECT (or drop what was read) so the page cache stays as it was" << "\n";
+    std::cout << "  --max-io-rate RATE          read at most RATE bytes per second, K/M/G suffixes (default unlimited)" << "\n";
+    std::cout << "  --idle-io                   only use disk time nobody else wants (ioprio idle class)" << "\n";
+    std::cout << "  --idle-cpu                  only use cpu time nobody else wants (SCHED_IDLE)" << "\n";
+    std::cout << "  --file-timeout TIME         give up on a file after TIME (500ms, 30s, 10m, 1h), report how much of it was scanned" << "\n";
+    std::cout << "  --deadline TIME             stop the scan TIME after it started, the file being scanned is cut short" << "\n";
+    std::cout << "  --checkpoint PATH           save the scan position to PATH, also on SIGINT/SIGTERM (then stops)" << "\n";
+    std::cout << "  --checkpoint-interval SEC   how often the checkpoint is saved (default 30)" << "\n";
+    std::cout << "  --resume                    continue from the --checkpoint file instead of starting over" << "\n";
+    std::cout << "  --summary-file PATH         remember every directory and file in PATH, the next scan skips what did not change" << "\n";
+    std::cout << "  --trust-dir-times           with --summary-file, do not stat files in directories whose times did not move" << "\n";
+    std::cout << "  --metrics-file PATH         write per phase metrics in prometheus text format" << "\n";
+    std::cout << "  --metrics-interval SEC      rewrite the metrics file every SEC seconds (default 10, 0 = only at the end)" << "\n";
+    std::cout << "  --trace PATH                record a span per directory, file and chunk as chrome trace-event json" << "\n";
+    std::cout << "exit status: 0 when the scan got to the end, 1 on an error, 2 when --deadline or a signal stopped it first" << "\n";
+}
+
+// "50M" -> 50 * 1024 * 1024, throws std::invalid_argument like stoull
+std::uint64_t parse_size(const std::string& text){
+    std::size_t end = 0;
+    std::uint64_t value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") return value << 10;
+    if (suffix == "M" || suffix == "m") return value << 20;
+    if (suffix == "G" || suffix == "g") return value << 30;
+    if (!suffix.empty()) throw std::invalid_argument(text);
+    return value;
+}
+
+// "500ms", "30s", "10m", "2h", a bare number is seconds. throws std::invalid_argument like stoull,
+// also for a sign (stoull takes "-1" as the biggest number there is), and std::out_of_range past
+// 100 years: the deadline is added to the clock, that has to stay in steady_clock's range
+std::chrono::milliseconds parse_duration(const std::string& text){
+    if (text.empty() || text[0] < '0' || text[0] > '9') throw std::invalid_argument(text);
+    std::size_t end = 0;
+    const std::uint64_t value = std::stoull(text, &end);
+    const std::string suffix = text.substr(end);
+    std::chrono::milliseconds unit;
+    if (suffix == "ms") unit = std::chrono::milliseconds(1);
+    else if (suffix.empty() || suffix == "s") unit = std::chrono::seconds(1);
+    else if (suffix == "m") unit = std::chrono::minutes(1);
+    else if (suffix == "h") unit = std::chrono::hours(1);
+    else throw std::invalid_argument(text);
+    const std::chrono::milliseconds longest = std::chrono::hours(24 * 365 * 100);
+    if (value > static_cast<std::uint64_t>(longest / unit)) throw std::out_of_range(text);
+    return unit * static_cast<std::chrono::milliseconds::rep>(value);
+}
+
+} // namespace
+
 
 int main(int argc, char* argv[]){
 
 
     //handling the input a bit
 
-    if(argc !=3){
-        std::cout << "please enter the root directory path" << "\n";
-        std::cout << "please enter the sig file's path" << "\n";
+    bool onAccess = false;
+    scan_options options;
+    on_access_options accessOptions;
+    fs::path metricsFile;
+    fs::path traceFile;
+    std::chrono::seconds metricsInterval(10);
+    std::vector<std::string> positional;
+    std::vector<std::string> tarLayers;
+    fs::path sigList;
+    bool whiteouts = false;
+    std::uint64_t maxIoRate = 0;
+    bool idleIo = false;
+    bool idleCpu = false;
+    std::string coordinator;
+    std::string worker;
+    std::size_t shards = default_shards;
+
+    try{
+        for(int i = 1; i < argc; ++i){
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if(i + 1 >= argc){
+                    std::cout << arg << " needs a value" << "\n";
+                    throw 1;
+                }
+                return argv[++i];
+            };
+
+            if(arg == "--sigs"){
+                sigList = value();
+            }
+            else if(arg == "--on-access"){
+                onAccess = true;
+            }
+            else if(arg == "--verdict-deadline-ms"){
+                accessOptions.verdict_deadline = std::chrono::milliseconds(std::stoul(value()));
+            }
+            else if(arg == "--deny-on-timeout"){
+                accessOptions.deny_on_timeout = true;
+            }
+            else if(arg == "--deny-on-error"){
+                accessOptions.deny_on_error = true;
+            }
+            else if(arg == "--workers"){
+                accessOptions.workers = static_cast<unsigned>(std::stoul(value()));
+            }
+            else if(arg == "--threads"){
+                options.threads = static_cast<unsigned>(std::stoul(value()));
+            }
+            else if(arg == "--io-uring"){
+                options.io_uring = true;
+            }
+            else if(arg == "--isolate"){
+                options.isolate = static_cast<unsigned>(std::stoul(value()));
+            }
+            else if(arg == "--numa"){
+                options.numa = true;
+            }
+            else if(arg == "--extent-order"){
+                options.extent_batch = static_cast<std::size_t>(std::stoull(value()));
+            }
+            else if(arg == "--exclude"){
+                options.exclude.push_back(value());
+            }
+            else if(arg == "--include"){
+                options.include.push_back(value());
+            }
+            else if(arg == "--one-file-system"){
+                options.one_file_system = true;
+            }
+            else if(arg == "--skip-fstype"){
+                options.skip_fstypes.push_back(value());
+            }
+            else if(arg == "--no-decompress"){
+                options.decompress = false;
+            }
+            else if(arg == "--no-archives"){
+                options.scan_archives = false;
+            }
+            else if(arg == "--files-from"){
+                options.files_from = value();
+            }
+            else if(arg == "--coordinator"){
+                coordinator = value();
+            }
+            else if(arg == "--worker"){
+                worker = value();
+            }
+            else if(arg == "--shards"){
+                shards = static_cast<std::size_t>(std::stoull(value()));
+            }
+            else if(arg == "--tar"){
+                tarLayers.push_back(value());
+            }
+            else if(arg == "--whiteouts"){
+                whiteouts = true;
+            }
+            else if(arg == "--max-ratio"){
+                options.max_ratio = std::stoull(value());
+            }
+            else if(arg == "--chunk-size"){
+                options.chunk_size = static_cast<std::size_t>(parse_size(value()));
+            }
+            else if(arg == "--no-huge-pages"){
+                enable_huge_pages(false);
+            }
+            else if(arg == "--cache-neutral"){
+                options.cache_neutral = true;
+            }
+            else if(arg == "--max-io-rate"){
+                maxIoRate = parse_size(value());
+            }
+            else if(arg == "--idle-io"){
+                idleIo = true;
+            }
+            else if(arg == "--idle-cpu"){
+                idleCpu = true;
+            }
+            else if(arg == "--checkpoint"){
+                options.checkpoint_file = value();
+            }
+            else if(arg == "--file-timeout"){
+                options.file_timeout = parse_duration(value());
+            }
+            else if(arg == "--deadline"){
+                // counted from now, the start of the scan
+                options.deadline = std::chrono::steady_clock::now() + parse_duration(value());
+            }
+            else if(arg == "--checkpoint-interval"){
+                options.checkpoint_interval = std::chrono::seconds(std::stoul(value()));
+            }
+            else if(arg == "--resume"){
+                options.resume = true;
+            }
+            else if(arg == "--summary-file"){
+                options.summary_file = value();
+            }
+            else if(arg == "--trust-dir-times"){
+                options.trust_dir_times = true;
+            }
+            else if(arg == "--metrics-file"){
+                metricsFile = value();
+            }
+            else if(arg == "--metrics-interval"){
+                metricsInterval = std::chrono::seconds(std::stoul(value()));
+            }
+            else if(arg == "--trace"){
+                traceFile = value();
+            }
+            else if(arg == "--help" || arg == "-h"){
+                usage();
+                return 0;
+            }
+            else if(arg.size() > 2 && arg.compare(0, 2, "--") == 0){
+                std::cout << "unknown option " << arg << "\n";
+                usage();
+                return 1;
+            }
+            else{
+                positional.push_back(arg);
+            }
+        }
+    }
+    catch(int){
+        return 1;
+    }
+    catch(const std::exception&){
+        std::cout << "invalid option value" << "\n";
+        return 1;
+    }
+
+    if(options.resume && options.checkpoint_file.empty()){
+        std::cout << "--resume needs --checkpoint" << "\n";
+        return 1;
+    }
+    if(options.trust_dir_times && options.summary_file.empty()){
+        std::cout << "--trust-dir-times needs --summary-file" << "\n";
+        return 1;
+    }
+    if(!options.files_from.empty() && (!tarLayers.empty() || onAccess || !options.checkpoint_file.empty()
+                                       || !options.summary_file.empty())){
+        std::cout << "--files-from does not go with --tar, --on-access, --checkpoint or --summary-file" << "\n";
+        return 1;
+    }
+    if((!coordinator.empty() || !worker.empty())
+       && (!coordinator.empty() == !worker.empty() || !tarLayers.empty() || onAccess || !options.files_from.empty()
+           || !options.checkpoint_file.empty() || !options.summary_file.empty())){
+        std::cout << "--coordinator or --worker, not both and not with --tar, --on-access, --files-from, --checkpoint or --summary-file" << "\n";
+        return 1;
+    }
+    const bool timed = options.file_timeout.count() > 0 || options.deadline != std::chrono::steady_clock::time_point::max();
+    if(timed && (!tarLayers.empty() || onAccess)){
+        std::cout << "--file-timeout and --deadline do not go with --tar or --on-access (see --verdict-deadline-ms)" << "\n";
+        return 1;
+    }
+    if(options.isolate > 0 && (options.threads > 1 || options.io_uring || !options.summary_file.empty()
+                               || !tarLayers.empty() || onAccess)){
+        std::cout << "--isolate does not go with --threads, --io-uring, --summary-file, --tar or --on-access" << "\n";
+        return 1;
+    }
+    // the summary knows whose hits it gets only on the plain single threaded walk
+    if(!options.summary_file.empty() && (options.threads > 1 || options.io_uring || options.extent_batch > 0)){
+        std::cout << "--summary-file does not go with --threads, --io-uring or --extent-order" << "\n";
+        return 1;
+    }
+
+    // a tar, --files-from or worker scan has no root directory, a --sigs scan no sig file
+    const bool wantRoot = tarLayers.empty() && options.files_from.empty() && worker.empty();
+    const bool wantSig = sigList.empty();
+    if(positional.size() != std::size_t(wantRoot) + std::size_t(wantSig)){
+        if(wantRoot) std::cout << "please enter the root directory path" << "\n";
+        if(wantSig) std::cout << "please enter the sig file's path" << "\n";
+        usage();
+        return 1;
     }
-    
-    const fs::path root(argv[1]);
-    const fs::path sigFile(argv[2]);
 
-    if(!fs::exists(root)){
+    const fs::path root(wantRoot ? positional[0] : std::string());
+    const fs::path sigFile(wantSig ? fs::path(positional.back()) : sigList);
+
+    if(wantRoot && !fs::exists(root)){
         std::cout << "the root path you entered does not exists" << "\n";
     }
 
@@ -29,10 +340,17 @@ int main(int argc, char* argv[]){
         std::cout << "the sig file's path path you entered does not exists" << "\n";
     }
 
-    std::vector<uint8_t> signiture ;
+    // the walk would only find out after the threads and the metrics exporter are up
+    if(!options.files_from.empty() && options.files_from != "-" && ::access(options.files_from.c_str(), R_OK) != 0){
+        std::cout << "could\'nt open the list of files " << options.files_from << "\n";
+        return 1;
+    }
+
+    signature_list signitures;
 
     try{
-        signiture = extract_sig(sigFile);
+        if(wantSig) signitures.literals.push_back(extract_sig(sigFile));
+        else signitures = extract_sig_list(sigFile);
     }
     catch(int eNum){
 
@@ -53,10 +371,109 @@ int main(int argc, char* argv[]){
         return 1;
     }
 
+    // before any thread is started, they inherit the priorities
+    if(idleIo && !set_idle_io_priority()){
+        std::cout << "could\'nt switch to the idle io class: " << std::strerror(errno) << "\n";
+    }
+    if(idleCpu && !set_idle_cpu_policy()){
+        std::cout << "could\'nt switch to SCHED_IDLE: " << std::strerror(errno) << "\n";
+    }
+    set_io_rate_limit(maxIoRate);
+
+    // the scan workers come from a process forked here, while this one has no other threads yet
+    if(options.isolate > 0 && coordinator.empty()){
+        try{
+            prepare_isolated_scan(signitures, options);
+        }
+        catch(int){
+            std::cout << "could\'nt start the scan workers" << "\n";
+            return 1;
+        }
+    }
+
+    // written at the interval and once more when main returns
+    std::unique_ptr<metrics_exporter> metrics;
+    if(!metricsFile.empty()){
+        metrics = std::make_unique<metrics_exporter>(metricsFile, metricsInterval);
+    }
+
+    if(!traceFile.empty()){
+        enable_tracing();
+        set_trace_thread_name("main");
+    }
+
+    if(onAccess){
+        accessOptions.scan = options;
+        std::cout << "guarding exec on the mount of " << root.string() << "\n";
+        try{
+            on_access_guard(root, signitures, accessOptions);
+        }
+        catch(int){
+            std::cout << "could\'nt start on-access scanning (fanotify needs CAP_SYS_ADMIN)" << "\n";
+            return 1;
+        }
+        if(!traceFile.empty()) write_trace_file(traceFile);
+        return 0;
+    }
+
     //starting the scanner
     std::cout << "scanning" << "\n";
-    
-    scanner(root, signiture);
 
-    return 0;
-}
\ No newline at end of file
+    if(!tarLayers.empty()){
+        try{
+            scan_tar_layers(tarLayers, signature_matcher(signitures), options, whiteouts, [](const std::string& name){
+                std::cout << name << " is infected!" << "\n";
+            });
+        }
+        catch(int){
+            std::cout << "could\'nt read the tar stream" << "\n";
+            if(!traceFile.empty()) write_trace_file(traceFile);
+            return 1;
+        }
+        if(!traceFile.empty()) write_trace_file(traceFile);
+        return 0;
+    }
+
+    if(!coordinator.empty() || !worker.empty()){
+        try{
+            if(!worker.empty()) shard_worker(worker, signitures, options);
+            else shard_coordinator(root, coordinator, signitures, options, shards);
+        }
+        catch(int){
+            if(!traceFile.empty()) write_trace_file(traceFile);
+            return 1;
+        }
+        if(!traceFile.empty()) write_trace_file(traceFile);
+        return 0;
+    }
+
+    // a file that cannot be opened or read stops the in-process scans (--isolate skips it), so
+    // does a worker pool that cannot be forked again. what went wrong is already on stderr
+    bool completed;
+    try{
+        completed = scanner(root, signitures, options);
+    }
+    catch(int eNum){
+        if(CANT_OPEN == eNum){
+            std::cout << "could\'nt open a file, the scan is not complete" << "\n";
+        }
+        else if(NOT_FILE == eNum){
+            std::cout << "a path stopped being a file, the scan is not complete" << "\n";
+        }
+        else{
+            std::cout << "could\'nt read a file, the scan is not complete" << "\n";
+        }
+        if(!traceFile.empty()) write_trace_file(traceFile);
+        return 1;
+    }
+    catch(const std::exception& error){
+        std::cout << "the scan stopped: " << error.what() << "\n";
+        if(!traceFile.empty()) write_trace_file(traceFile);
+        return 1;
+    }
+
+    if(!traceFile.empty()) write_trace_file(traceFile);
+
+    // a script can tell a scan stopped by --deadline or a signal from one that got to the end
+    return completed ? 0 : 2;
+}
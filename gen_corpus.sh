@@ -0,0 +1,78 @@
+#!/bin/sh
+# builds a scan corpus that looks like our trees: nested directories full of small ELF
+# executables and objects, text/config files that are dropped after the header check,
+# a few big ELF images and a handful of infected files.
+# used to train the PGO build and for the benchmarks
+#
+# usage: gen_corpus.sh out_dir [size_mb] [lib_dir]
+#   out_dir/tree           the directory to scan
+#   out_dir/signature.sig  the signature planted in the infected files
+#   lib_dir                where the shared libraries come from, by default the multiarch
+#                          directory gcc reports (/usr/lib/<triplet>), or /usr/lib without one
+set -e
+
+out=$1
+size_mb=${2:-256}
+lib_dir=$3
+if [ -z "$out" ]; then
+    echo "usage: $0 out_dir [size_mb] [lib_dir]" >&2
+    exit 1
+fi
+if [ -z "$lib_dir" ]; then
+    triplet=$(gcc -print-multiarch 2>/dev/null || true)
+    lib_dir=/usr/lib${triplet:+/$triplet}
+fi
+
+rm -rf "$out"
+mkdir -p "$out/tree"
+head -c 16 /dev/urandom > "$out/signature.sig"
+
+# real executables give the searcher the byte distribution of actual code, the big
+# ones are left out so the size budget stays predictable
+real_elfs=$(for f in /usr/bin/* "$lib_dir"/*.so*; do
+    [ -f "$f" ] && [ "$(stat -L -c %s "$f")" -lt 4194304 ] &&
+        [ "$(head -c 4 "$f" | od -An -c | tr -d ' ')" = "177ELF" ] && echo "$f"
+done 2>/dev/null | head -n 300)
+
+i=0
+for f in $real_elfs; do
+    d="$out/tree/usr/d$((i % 16))"
+    mkdir -p "$d"
+    cp "$f" "$d/bin$i"
+    i=$((i + 1))
+done
+
+# synthetic small objects and text files, sizes from a fixed seed so runs are comparable
+awk 'BEGIN { srand(42); for (i = 0; i < 1500; i++) print i, int(1024 + rand() * 65536), int(rand() * 3) }' |
+while read -r n size kind; do
+    d="$out/tree/src/m$((n % 24))/s$((n % 5))"
+    mkdir -p "$d"
+    if [ "$kind" -eq 0 ]; then
+        head -c "$size" /dev/urandom | base64 > "$d/notes$n.txt"
+    else
+        { printf '\177ELF'; head -c "$size" /dev/urandom; } > "$d/obj$n.o"
+    fi
+done
+
+# whatever is left of the budget goes into two big images built from real code
+used_kb=$(du -sk "$out/tree" | cut -f1)
+left_mb=$(( size_mb - used_kb / 1024 ))
+if [ "$left_mb" -gt 2 ] && [ -n "$real_elfs" ]; then
+    mkdir -p "$out/tree/images"
+    for img in 0 1; do
+        target=$(( left_mb / 2 * 1024 * 1024 ))
+        file="$out/tree/images/vmimage$img"
+        printf '\177ELF' > "$file"
+        while [ "$(stat -c %s "$file")" -lt "$target" ]; do
+            for f in $real_elfs; do cat "$f"; done >> "$file"
+        done
+        truncate -s "$target" "$file"
+    done
+fi
+
+# plant the signature in a few files, one of them at the very end of a big image
+for f in "$out/tree/usr/d3/bin3" "$out/tree/src/m7/s2/obj7.o" "$out/tree/images/vmimage1"; do
+    [ -f "$f" ] && cat "$out/signature.sig" >> "$f"
+done
+
+echo "corpus: $(find "$out/tree" -type f | wc -l) files, $(du -sh "$out/tree" | cut -f1) in $out/tree"
@@ -0,0 +1,124 @@
+#include "huge_pages.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+#include <sys/mman.h>
+
+namespace {
+
+std::atomic<bool> enabled{true};
+
+enum class backing { hugetlb, thp };
+
+struct region {
+    std::size_t length;
+    backing kind;
+};
+
+std::mutex registry_lock;
+// live mappings by address, everything else came from operator new
+std::map<std::uintptr_t, region>& registry(){
+    static std::map<std::uintptr_t, region> regions;
+    return regions;
+}
+// totals of released mappings
+huge_page_report retired;
+
+std::size_t round_up(std::size_t bytes){
+    return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+}
+
+// AnonHugePages of every registered mapping, one pass over /proc/self/smaps
+std::map<std::uintptr_t, std::uint64_t> measure_thp(){
+    std::map<std::uintptr_t, std::uint64_t> measured;
+    std::FILE* smaps = std::fopen("/proc/self/smaps", "r");
+    if (!smaps) return measured;
+    char line[512];
+    bool tracked = false;
+    std::uintptr_t start = 0;
+    while (std::fgets(line, sizeof(line), smaps)) {
+        unsigned long from, to;
+        unsigned long long kb;
+        // field lines ("Size:", "AnonHugePages:" ...) never parse as two hex numbers
+        if (std::sscanf(line, "%lx-%lx ", &from, &to) == 2) {
+            // a mapping header, the kernel may have merged it with a neighbour so look for
+            // registered regions inside it
+            auto it = registry().lower_bound(from);
+            tracked = it != registry().end() && it->first < to && it->second.kind == backing::thp;
+            start = tracked ? it->first : 0;
+        }
+        else if (tracked && std::sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+            measured[start] += kb * 1024;
+        }
+    }
+    std::fclose(smaps);
+    return measured;
+}
+
+} // namespace
+
+void enable_huge_pages(bool on){
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+bool huge_pages_enabled(){
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void* allocate_huge(std::size_t bytes){
+    if (bytes < huge_page_threshold || !huge_pages_enabled()) return ::operator new(bytes);
+
+    const std::size_t length = round_up(bytes);
+    backing kind = backing::hugetlb;
+    void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        // no reserved huge pages: over-map, cut it to a 2MB aligned piece and ask for THP
+        kind = backing::thp;
+        const std::size_t padded = length + huge_page_size;
+        void* raw = ::mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return ::operator new(bytes);
+        std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(raw);
+        std::uintptr_t aligned = (begin + huge_page_size - 1) & ~(huge_page_size - 1);
+        if (aligned > begin) ::munmap(raw, aligned - begin);
+        std::size_t tail = (begin + padded) - (aligned + length);
+        if (tail) ::munmap(reinterpret_cast<void*>(aligned + length), tail);
+        p = reinterpret_cast<void*>(aligned);
+        ::madvise(p, length, MADV_HUGEPAGE);
+    }
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry()[reinterpret_cast<std::uintptr_t>(p)] = region{length, kind};
+    return p;
+}
+
+void deallocate_huge(void* p, std::size_t bytes){
+    if (!p) return;
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        auto it = registry().find(reinterpret_cast<std::uintptr_t>(p));
+        if (it != registry().end()) {
+            retired.bytes += it->second.length;
+            if (it->second.kind == backing::hugetlb) retired.hugetlb_bytes += it->second.length;
+            else retired.thp_bytes += measure_thp()[it->first];
+            ::munmap(p, it->second.length);
+            registry().erase(it);
+            return;
+        }
+    }
+    ::operator delete(p, bytes);
+}
+
+huge_page_report huge_page_coverage(){
+    std::lock_guard<std::mutex> guard(registry_lock);
+    huge_page_report report = retired;
+    std::map<std::uintptr_t, std::uint64_t> thp = measure_thp();
+    for (const auto& entry : registry()) {
+        report.bytes += entry.second.length;
+        if (entry.second.kind == backing::hugetlb) report.hugetlb_bytes += entry.second.length;
+        else report.thp_bytes += thp[entry.first];
+    }
+    return report;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// allocations of at least huge_page_threshold bytes are mapped with MAP_HUGETLB when the system
+// has reserved huge pages, otherwise as a 2MB aligned mapping with madvise(MADV_HUGEPAGE) so
+// transparent huge pages can back it. smaller ones come from operator new. on by default
+void enable_huge_pages(bool on);
+bool huge_pages_enabled();
+
+constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+constexpr std::size_t huge_page_threshold = 1024 * 1024;
+
+void* allocate_huge(std::size_t bytes);
+void deallocate_huge(void* p, std::size_t bytes);
+
+// what the huge page capable allocations of the process got so far. thp_bytes is measured in
+// /proc/self/smaps (AnonHugePages) when a mapping is released or the report is taken, so pages
+// the kernel never collapsed do not count
+struct huge_page_report {
+    std::uint64_t bytes = 0;
+    std::uint64_t hugetlb_bytes = 0;
+    std::uint64_t thp_bytes = 0;
+};
+
+huge_page_report huge_page_coverage();
+
+// a read buffer from allocate_huge. growing it neither keeps nor zeroes the old contents, a
+// vector would value-initialize every byte
+class huge_buffer {
+public:
+    huge_buffer() = default;
+    ~huge_buffer(){ deallocate_huge(bytes, length); }
+    huge_buffer(const huge_buffer&) = delete;
+    huge_buffer& operator=(const huge_buffer&) = delete;
+
+    std::uint8_t* data(){ return bytes; }
+    std::size_t size() const { return length; }
+
+    void grow(std::size_t size){
+        if (size <= length) return;
+        deallocate_huge(bytes, length);
+        bytes = nullptr;
+        length = 0;
+        bytes = static_cast<std::uint8_t*>(allocate_huge(size));
+        length = size;
+    }
+
+private:
+    std::uint8_t* bytes = nullptr;
+    std::size_t length = 0;
+};
+
+// for containers holding matcher tables
+template <typename T>
+struct huge_page_allocator {
+    using value_type = T;
+
+    huge_page_allocator() = default;
+    template <typename U>
+    huge_page_allocator(const huge_page_allocator<U>&) {}
+
+    T* allocate(std::size_t n){
+        return static_cast<T*>(allocate_huge(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n){
+        deallocate_huge(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const huge_page_allocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const huge_page_allocator<U>&) const { return false; }
+};
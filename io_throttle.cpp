@@ -0,0 +1,82 @@
+#include "io_throttle.hpp"
+#include "scan_metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// from linux/ioprio.h, which older kernel headers do not ship
+constexpr int ioprio_who_process = 1;
+constexpr int ioprio_class_idle = 3;
+constexpr int ioprio_class_shift = 13;
+
+constexpr std::size_t min_burst = 64 * 1024;
+
+std::atomic<std::uint64_t> rate{0};
+
+std::mutex bucket_lock;
+double tokens = 0;
+std::chrono::steady_clock::time_point refilled;
+
+double bucket_capacity(std::uint64_t bytes_per_second){
+    return std::max<double>(static_cast<double>(bytes_per_second) / 10, min_burst);
+}
+
+} // namespace
+
+void set_io_rate_limit(std::uint64_t bytes_per_second){
+    std::lock_guard<std::mutex> lock(bucket_lock);
+    tokens = bucket_capacity(bytes_per_second);
+    refilled = std::chrono::steady_clock::now();
+    rate.store(bytes_per_second, std::memory_order_release);
+}
+
+std::uint64_t io_rate_limit(){
+    return rate.load(std::memory_order_acquire);
+}
+
+void throttle_io(std::size_t bytes){
+    std::uint64_t limit = rate.load(std::memory_order_acquire);
+    if (limit == 0) return;
+
+    // the bytes are taken right away and the debt is slept off outside the lock, threads
+    // that come in meanwhile queue up behind it by going further into debt
+    std::chrono::duration<double> wait(0);
+    {
+        std::lock_guard<std::mutex> lock(bucket_lock);
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - refilled;
+        refilled = now;
+        tokens = std::min(tokens + elapsed.count() * static_cast<double>(limit), bucket_capacity(limit));
+        tokens -= static_cast<double>(bytes);
+        if (tokens < 0) wait = std::chrono::duration<double>(-tokens / static_cast<double>(limit));
+    }
+    if (wait.count() > 0) {
+        phase_timer timer(scan_phase::throttle);
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+std::size_t io_burst_size(){
+    std::uint64_t limit = rate.load(std::memory_order_acquire);
+    if (limit == 0) return std::numeric_limits<std::size_t>::max();
+    return static_cast<std::size_t>(bucket_capacity(limit));
+}
+
+bool set_idle_io_priority(){
+    return ::syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) == 0;
+}
+
+bool set_idle_cpu_policy(){
+    struct sched_param param = {};
+    return ::sched_setscheduler(0, SCHED_IDLE, &param) == 0;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// one token bucket for the whole process, every bulk read (file chunks, compressed input,
+// tar streams) asks it first. 0 turns it off, which is the default
+void set_io_rate_limit(std::uint64_t bytes_per_second);
+std::uint64_t io_rate_limit();
+
+// blocks until bytes may be read. the bucket holds 100ms worth of tokens, so a scan that was
+// idle (or waiting on a slow directory) can not come back with a burst
+void throttle_io(std::size_t bytes);
+
+// largest read a throttled scan should issue, a whole 8MB chunk at once would still hit the
+// disk as one burst. SIZE_MAX when there is no limit
+std::size_t io_burst_size();
+
+// the calling thread, and the threads it starts afterwards, only get disk time (ioprio idle
+// class) / cpu time (SCHED_IDLE) nobody else wants. false with errno set when refused
+bool set_idle_io_priority();
+bool set_idle_cpu_policy();
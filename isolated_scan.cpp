@@ -0,0 +1,779 @@
+#include "isolated_scan.hpp"
+#include "file_stat.hpp"
+#include "io_throttle.hpp"
+#include "scan_budget.hpp"
+#include "scan_checkpoint.hpp"
+#include "scan_metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the ring positions are shared between processes");
+static_assert(std::is_trivially_copyable<file_stat>::value, "file_stat goes over the socket as it is");
+
+// a worker dies of these instead of running the handlers it inherited (a test framework's)
+const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGSYS};
+// workers that keep dying with no file in flight are not going to start working
+constexpr unsigned max_idle_deaths = 8;
+// hit names are cut to this, the ring has to hold a few
+constexpr std::size_t max_record_text = 16 * 1024;
+// a worker still on a file this long after its time ran out is stuck in a read and killed
+constexpr auto stuck_grace = std::chrono::seconds(1);
+
+// sent along with the descriptor
+struct job_message {
+    std::uint64_t job;
+    file_stat info;
+};
+
+// the zygote is asked for a worker for slot, the worker's end of its socket comes along
+struct spawn_request {
+    std::uint64_t slot;
+};
+
+// and answers with its pid, or tells of a worker that died with its wait status
+enum report_kind : std::int32_t { report_spawned, report_not_spawned, report_died };
+struct zygote_report {
+    std::int32_t kind;
+    std::int32_t pid;
+    std::int32_t status;
+};
+
+// timed_out and cut (by the deadline, the file is not done) carry the bytes covered, failed the
+// error code
+enum record_kind : std::uint32_t { record_hit, record_done, record_timed_out, record_cut, record_failed, record_skip };
+
+// records are 16 byte aligned. one that does not fit before the end of the ring is put at its
+// start, after a skip record over the rest
+struct record_header {
+    std::uint64_t job;
+    std::uint32_t kind;
+    std::uint32_t length;
+};
+static_assert(sizeof(record_header) == 16, "records stay 16 byte aligned");
+
+// one worker writes, the walking process reads. written and read only grow, a record's offset in
+// data is its position modulo the size
+struct result_ring {
+    std::atomic<std::uint64_t> written;
+    std::atomic<std::uint64_t> read;
+    char data[isolated_ring_size];
+};
+
+std::size_t record_size(std::size_t length){
+    return sizeof(record_header) + ((length + 15) & ~std::size_t(15));
+}
+
+void wake_up(int wake){
+    const std::uint64_t one = 1;
+    while (::write(wake, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+void put_record(result_ring& ring, int wake, std::uint64_t job, record_kind kind, const std::string& text){
+    const std::size_t length = std::min(text.size(), max_record_text);
+    const std::size_t size = record_size(length);
+    std::uint64_t at = ring.written.load(std::memory_order_relaxed);
+    std::size_t offset = at % isolated_ring_size;
+    const std::size_t rest = isolated_ring_size - offset;
+    const std::size_t needed = size > rest ? rest + size : size;
+    while (isolated_ring_size - (at - ring.read.load(std::memory_order_acquire)) < needed) {
+        // full, the walking process is busy with the other workers
+        wake_up(wake);
+        ::usleep(100);
+    }
+    if (size > rest) {
+        const record_header skip{job, record_skip, 0};
+        std::memcpy(ring.data + offset, &skip, sizeof(skip));
+        at += rest;
+        offset = 0;
+    }
+    const record_header header{job, kind, static_cast<std::uint32_t>(length)};
+    std::memcpy(ring.data + offset, &header, sizeof(header));
+    std::memcpy(ring.data + offset + sizeof(header), text.data(), length);
+    ring.written.store(at + size, std::memory_order_release);
+}
+
+// size bytes of data and a descriptor in one message
+bool send_with_fd(int socket, int fd, const void* data, std::size_t size){
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec vector{const_cast<void*>(data), size};
+    msghdr header = {};
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(rights), &fd, sizeof(fd));
+    for (;;) {
+        // MSG_NOSIGNAL: a worker that died is seen on its socket, not as a SIGPIPE
+        const ssize_t n = ::sendmsg(socket, &header, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        return n == static_cast<ssize_t>(size);
+    }
+}
+
+// the descriptor of the next message, -1 once the other end closed its socket
+int receive_with_fd(int socket, void* data, std::size_t size){
+    for (;;) {
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        iovec vector{data, size};
+        msghdr header = {};
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        const ssize_t n = ::recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        cmsghdr* rights = n == static_cast<ssize_t>(size) ? CMSG_FIRSTHDR(&header) : nullptr;
+        if (!rights || rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS) return -1;
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(rights), sizeof(fd));
+        return fd;
+    }
+}
+
+// everything but the standard streams and keep. a descriptor of the walk or another worker's
+// socket kept open in here would keep that from ever seeing its end of file
+void close_inherited(std::vector<int> keep){
+    keep.push_back(2);
+    std::sort(keep.begin(), keep.end());
+    int from = 3;
+    for (int fd : keep) {
+        if (fd < from) continue;
+        if (fd > from) {
+            if (::syscall(SYS_close_range, from, fd - 1, 0) != 0) {
+                for (int other = from; other < fd; ++other) ::close(other);
+            }
+        }
+        from = fd + 1;
+    }
+    if (::syscall(SYS_close_range, from, UINT_MAX, 0) != 0) {
+        rlimit limit = {};
+        ::getrlimit(RLIMIT_NOFILE, &limit);
+        const int last = static_cast<int>(std::min<rlim_t>(limit.rlim_cur, 1 << 16));
+        for (int other = from; other < last; ++other) ::close(other);
+    }
+}
+
+[[noreturn]] void worker_main(int socket, int wake, result_ring& ring, const signature_matcher& matcher,
+                              const scan_options& options){
+    for (int signal : fatal_signals) ::signal(signal, SIG_DFL);
+    // its counters are never exported, and a lock some thread held at the fork is never let go
+    enable_metrics(false);
+    for (;;) {
+        job_message message;
+        const int fd = receive_with_fd(socket, &message, sizeof(message));
+        if (fd < 0) ::_exit(0);
+        record_kind verdict = record_done;
+        std::string detail;
+        try {
+            // hits are "" for the file and "(member.o)" for archive members, the walking process
+            // puts the path in front
+            scan_fd(fd, std::string(), matcher, options, [&](const std::string& hit){
+                put_record(ring, wake, message.job, record_hit, hit);
+            }, &message.info);
+        }
+        catch (int error) {
+            verdict = record_failed;
+            detail = std::to_string(error);
+        }
+        const file_coverage& coverage = last_file_coverage();
+        if (verdict == record_done && coverage.timed_out) {
+            verdict = coverage.by_deadline ? record_cut : record_timed_out;
+            detail = std::to_string(coverage.covered);
+        }
+        ::close(fd);
+        put_record(ring, wake, message.job, verdict, detail);
+        wake_up(wake);
+    }
+}
+
+std::string describe_death(int status){
+    if (WIFSIGNALED(status)) return "signal " + std::to_string(WTERMSIG(status));
+    return "exit status " + std::to_string(WEXITSTATUS(status));
+}
+
+std::string describe_failure(int code){
+    if (code == NOT_FILE) return "is not a file";
+    if (code == CANT_OPEN) return "could not be opened";
+    return "could not be read";
+}
+
+// the process the workers are forked from, itself forked while the scanning process has a single
+// thread: a process forked while another thread holds a lock (the metrics registry's, a stream's)
+// finds it held forever. it reaps the workers and passes their wait status on. the rings and
+// eventfds are made before it, so the workers share them with the walking process
+class worker_zygote {
+public:
+    worker_zygote(const signature_list& signatures, const scan_options& options)
+        : scanMatcher(signatures), scanOptions(options),
+          signatureHash(hash_signatures(signatures.literals, signatures.regexes)) {
+        const unsigned count = options.isolate;
+        ringBytes = sizeof(result_ring) * count;
+        void* mapped = ::mmap(nullptr, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "could not start the scan workers" << "\n";
+            throw CANT_READ;
+        }
+        rings = mapped;
+        try {
+            for (unsigned i = 0; i < count; ++i) {
+                new (static_cast<result_ring*>(rings) + i) result_ring;
+                wakes.push_back(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+                if (wakes.back() < 0) {
+                    std::cerr << "could not start the scan workers" << "\n";
+                    throw CANT_READ;
+                }
+            }
+            int pair[2];
+            if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+                std::cerr << "could not start the scan workers" << "\n";
+                throw CANT_READ;
+            }
+            // a worker would write out what is still buffered a second time the first time it
+            // flushes (cerr flushes cout)
+            std::cout.flush();
+            std::fflush(stdout);
+            const pid_t parent = ::getpid();
+            pid = ::fork();
+            if (pid < 0) {
+                ::close(pair[0]);
+                ::close(pair[1]);
+                std::cerr << "could not start the scan workers" << "\n";
+                throw CANT_READ;
+            }
+            if (pid == 0) {
+                // left behind by a killed scan it would only wait on its socket
+                ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (::getppid() != parent) ::_exit(1);
+                serve(pair[1]);
+            }
+            ::close(pair[1]);
+            control = pair[0];
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    // its end of file tells the zygote to exit, after the workers are reaped
+    ~worker_zygote(){ release(); }
+    worker_zygote(const worker_zygote&) = delete;
+    worker_zygote& operator=(const worker_zygote&) = delete;
+
+    bool fits(const signature_list& signatures, const scan_options& options) const {
+        return options.isolate == wakes.size()
+            && hash_signatures(signatures.literals, signatures.regexes) == signatureHash;
+    }
+
+    const signature_matcher& matcher() const { return scanMatcher; }
+    result_ring& ring(std::size_t slot) const { return static_cast<result_ring*>(rings)[slot]; }
+    int wake(std::size_t slot) const { return wakes[slot]; }
+
+    // a worker for slot on the given end of its socket, returns its pid
+    pid_t spawn(std::size_t slot, int socket){
+        const spawn_request request{slot};
+        zygote_report report;
+        if (send_with_fd(control, socket, &request, sizeof(request))) {
+            while (next_report(report)) {
+                if (report.kind == report_spawned) return report.pid;
+                if (report.kind != report_died) break;
+                deaths.emplace_back(report.pid, report.status);
+            }
+        }
+        std::cerr << "could not start a scan worker" << "\n";
+        throw CANT_READ;
+    }
+
+    // waits for the worker to be gone, returns its wait status
+    int reap(pid_t worker){
+        for (;;) {
+            auto found = std::find_if(deaths.begin(), deaths.end(),
+                                      [&](const std::pair<pid_t, int>& death){ return death.first == worker; });
+            if (found != deaths.end()) {
+                const int status = found->second;
+                deaths.erase(found);
+                return status;
+            }
+            zygote_report report;
+            // the zygote is gone, its workers died with it
+            if (!next_report(report)) return SIGKILL;
+            if (report.kind == report_died) deaths.emplace_back(report.pid, report.status);
+        }
+    }
+
+private:
+    [[noreturn]] void serve(int socket){
+        for (int signal : fatal_signals) ::signal(signal, SIG_DFL);
+        sigset_t childSignal;
+        sigemptyset(&childSignal);
+        sigaddset(&childSignal, SIGCHLD);
+        sigset_t oldMask;
+        ::sigprocmask(SIG_BLOCK, &childSignal, &oldMask);
+        const int reaper = ::signalfd(-1, &childSignal, SFD_CLOEXEC | SFD_NONBLOCK);
+        std::vector<int> keep = wakes;
+        keep.push_back(socket);
+        keep.push_back(reaper);
+        close_inherited(keep);
+        const pid_t zygote = ::getpid();
+        // every worker has its own token bucket, read by read like the plain scan, between the
+        // checks of its file's time. together they stay under the limit
+        const std::uint64_t rate = io_rate_limit();
+        if (rate > 0) set_io_rate_limit(std::max<std::uint64_t>(1, rate / wakes.size()));
+
+        for (;;) {
+            pollfd fds[2] = {{socket, POLLIN, 0}, {reaper, POLLIN, 0}};
+            if (::poll(fds, 2, -1) < 0) continue;
+            if (fds[1].revents & POLLIN) {
+                signalfd_siginfo info;
+                while (::read(reaper, &info, sizeof(info)) > 0) {}
+                int status;
+                pid_t died;
+                while ((died = ::waitpid(-1, &status, WNOHANG)) > 0) {
+                    const zygote_report report{report_died, died, status};
+                    ::send(socket, &report, sizeof(report), MSG_NOSIGNAL);
+                }
+            }
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            spawn_request request;
+            const int workerSocket = receive_with_fd(socket, &request, sizeof(request));
+            // the walking process is done, it waited for the workers
+            if (workerSocket < 0) ::_exit(0);
+            const std::size_t slot = request.slot;
+            const pid_t worker = slot < wakes.size() ? ::fork() : -1;
+            if (worker == 0) {
+                ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (::getppid() != zygote) ::_exit(1);
+                ::sigprocmask(SIG_SETMASK, &oldMask, nullptr);
+                close_inherited({workerSocket, wakes[slot]});
+                worker_main(workerSocket, wakes[slot], ring(slot), scanMatcher, scanOptions);
+            }
+            ::close(workerSocket);
+            const zygote_report report{worker < 0 ? report_not_spawned : report_spawned, worker, 0};
+            ::send(socket, &report, sizeof(report), MSG_NOSIGNAL);
+        }
+    }
+
+    bool next_report(zygote_report& report){
+        for (;;) {
+            const ssize_t n = ::recv(control, &report, sizeof(report), 0);
+            if (n < 0 && errno == EINTR) continue;
+            return n == static_cast<ssize_t>(sizeof(report));
+        }
+    }
+
+    void release(){
+        if (control >= 0) ::close(control);
+        control = -1;
+        if (pid > 0) {
+            while (::waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+        pid = -1;
+        for (int wake : wakes) {
+            if (wake >= 0) ::close(wake);
+        }
+        wakes.clear();
+        if (rings) ::munmap(rings, ringBytes);
+        rings = nullptr;
+    }
+
+    // built before the fork, the workers share its tables until one writes to them
+    const signature_matcher scanMatcher;
+    const scan_options scanOptions;
+    const std::uint64_t signatureHash;
+    void* rings = nullptr;
+    std::size_t ringBytes = 0;
+    std::vector<int> wakes;
+    int control = -1;
+    pid_t pid = -1;
+    // reported before anyone asked
+    std::vector<std::pair<pid_t, int>> deaths;
+};
+
+// prepare_isolated_scan's, for the next isolated_scan
+std::unique_ptr<worker_zygote> prepared;
+
+// the workers, each with its socket, the eventfd it wakes the walking process with and its ring.
+// files go to the worker with the fewest in flight, a worker handles its files in order
+class worker_pool {
+public:
+    worker_pool(worker_zygote& zygote, const scan_options& options, tree_walk& walk, completion_tracker* progress)
+        : zygote(zygote), options(options), walk(walk), progress(progress) {
+        workers.resize(options.isolate);
+        try {
+            for (std::size_t i = 0; i < workers.size(); ++i) {
+                workers[i].ring = &zygote.ring(i);
+                workers[i].wake = zygote.wake(i);
+                spawn(i);
+            }
+        }
+        catch (...) {
+            shut();
+            throw;
+        }
+    }
+
+    ~worker_pool(){ shut(); }
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    // waits while every worker has isolated_depth files
+    void submit(const fs::path& path, std::uint64_t sequence, const file_stat& info){
+        place_retries();
+        job next{path, sequence, info, {}};
+        while (!place(next)) wait();
+    }
+
+    // waits for every file handed out
+    void drain(){
+        for (;;) {
+            place_retries();
+            if (retry.empty() && std::all_of(workers.begin(), workers.end(),
+                                             [](const worker& w){ return w.jobs.empty(); })) {
+                return;
+            }
+            wait();
+        }
+    }
+
+private:
+    struct job {
+        fs::path path;
+        std::uint64_t sequence;
+        file_stat info;
+        std::vector<std::string> hits;
+    };
+
+    struct worker {
+        pid_t pid = -1;
+        int socket = -1;
+        int wake = -1;
+        result_ring* ring = nullptr;
+        std::deque<job> jobs;
+        // when the worker got to the first of jobs
+        std::chrono::steady_clock::time_point busySince;
+        // killed for overrunning the file's time
+        bool stuck = false;
+    };
+
+    void spawn(std::size_t slot){
+        worker& w = workers[slot];
+        int pair[2];
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+            std::cerr << "could not start a scan worker" << "\n";
+            throw CANT_READ;
+        }
+        // what the last one left behind
+        w.ring->written.store(0, std::memory_order_relaxed);
+        w.ring->read.store(0, std::memory_order_relaxed);
+        std::uint64_t stale;
+        while (::read(w.wake, &stale, sizeof(stale)) > 0) {}
+
+        pid_t pid;
+        try {
+            pid = zygote.spawn(slot, pair[1]);
+        }
+        catch (...) {
+            ::close(pair[0]);
+            ::close(pair[1]);
+            throw;
+        }
+        ::close(pair[1]);
+        w.pid = pid;
+        w.socket = pair[0];
+        w.stuck = false;
+    }
+
+    // the files of a dead worker go first, in walk order
+    void place_retries(){
+        while (!retry.empty()) {
+            if (!place(retry.front())) {
+                wait();
+                continue;
+            }
+            retry.pop_front();
+        }
+    }
+
+    // false when every worker has isolated_depth files
+    bool place(job& next){
+        for (;;) {
+            auto least = std::min_element(workers.begin(), workers.end(), [](const worker& a, const worker& b){
+                return a.jobs.size() < b.jobs.size();
+            });
+            if (least->jobs.size() >= isolated_depth) return false;
+
+            int fd;
+            {
+                phase_timer timer(scan_phase::open);
+                fd = ::open(next.path.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+            if (fd < 0) {
+                // like a file a worker could not read, it is left out and the scan goes on
+                std::cout << next.path.string() << " " << describe_failure(CANT_OPEN) << ", skipped" << "\n";
+                count_error(scan_error::cant_open);
+                if (progress) progress->done(next.sequence, {}, walk);
+                return true;
+            }
+            const job_message message{next.sequence, next.info};
+            const bool sent = send_with_fd(least->socket, fd, &message, sizeof(message));
+            ::close(fd);
+            if (sent) {
+                if (least->jobs.empty()) least->busySince = std::chrono::steady_clock::now();
+                least->jobs.push_back(std::move(next));
+                return true;
+            }
+            // died since the last look, its files go to retry and this one to the next worker
+            lost(static_cast<std::size_t>(least - workers.begin()));
+        }
+    }
+
+    void wait(){
+        std::vector<pollfd> fds;
+        fds.reserve(workers.size() * 2);
+        for (const auto& w : workers) {
+            fds.push_back({w.wake, POLLIN, 0});
+            // no events asked for, a hang up is always reported
+            fds.push_back({w.socket, 0, 0});
+        }
+        // EINTR: a stop request, the caller looks at the walk
+        const int ready = ::poll(fds.data(), fds.size(), watchdog());
+        if (ready == 0) kill_stuck();
+        if (ready <= 0) return;
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            if (fds[2 * i].revents & POLLIN) {
+                std::uint64_t count;
+                while (::read(workers[i].wake, &count, sizeof(count)) > 0) {}
+                collect(workers[i]);
+            }
+            if (fds[2 * i + 1].revents & (POLLHUP | POLLERR)) lost(i);
+        }
+    }
+
+    // the records the worker published since the last look
+    void collect(worker& w){
+        result_ring& ring = *w.ring;
+        std::uint64_t at = ring.read.load(std::memory_order_relaxed);
+        const std::uint64_t end = ring.written.load(std::memory_order_acquire);
+        while (at < end) {
+            const std::size_t offset = at % isolated_ring_size;
+            record_header header;
+            std::memcpy(&header, ring.data + offset, sizeof(header));
+            if (header.kind == record_skip) {
+                at += isolated_ring_size - offset;
+                continue;
+            }
+            if (header.length > max_record_text || header.kind > record_skip || w.jobs.empty()
+                || w.jobs.front().sequence != header.job) {
+                // only a worker whose memory is corrupt writes this, the hang up follows
+                ::kill(w.pid, SIGKILL);
+                at = end;
+                break;
+            }
+            const std::string text(ring.data + offset + sizeof(header), header.length);
+            at += record_size(header.length);
+            job& current = w.jobs.front();
+            if (header.kind == record_hit) {
+                current.hits.push_back(current.path.string() + text);
+            }
+            else if (header.kind == record_timed_out || header.kind == record_cut) {
+                file_coverage coverage;
+                coverage.timed_out = true;
+                coverage.by_deadline = header.kind == record_cut;
+                coverage.covered = std::strtoull(text.c_str(), nullptr, 10);
+                coverage.size = current.info.size;
+                // past the deadline before the first byte: not started rather than cut short
+                if (!coverage.by_deadline || coverage.covered > 0) report_timeout(current.path.string(), coverage);
+                finish(current, !coverage.by_deadline);
+                next_job(w);
+            }
+            else if (header.kind == record_failed) {
+                // one damaged file does not cost the scan, the hits found before the error stand
+                const int code = std::atoi(text.c_str());
+                std::cout << current.path.string() << " " << describe_failure(code) << ", skipped" << "\n";
+                count_error(code == NOT_FILE ? scan_error::not_file
+                            : code == CANT_OPEN ? scan_error::cant_open : scan_error::cant_read);
+                finish(current, true);
+                next_job(w);
+            }
+            else {
+                finish(current, true);
+                next_job(w);
+            }
+        }
+        ring.read.store(at, std::memory_order_release);
+    }
+
+    // complete is false for a file the deadline cut short, the checkpoint stays in front of it
+    void finish(job& done, bool complete){
+        count_event(scan_counter::files_scanned);
+        for (const auto& hit : done.hits) {
+            count_event(scan_counter::infected);
+            walk.report(hit, false);
+        }
+        if (progress && complete) progress->done(done.sequence, std::move(done.hits), walk);
+    }
+
+    void next_job(worker& w){
+        idleDeaths = 0;
+        w.jobs.pop_front();
+        w.busySince = std::chrono::steady_clock::now();
+    }
+
+    // when the first of a worker's files has to be done by: file_timeout after the worker got to
+    // it, and the deadline, each with the grace for the worker to notice itself. also a file it
+    // got after the deadline gets the grace to be answered as cut
+    std::chrono::steady_clock::time_point due(const worker& w) const {
+        auto limit = options.deadline;
+        if (options.file_timeout.count() > 0) limit = std::min(limit, w.busySince + options.file_timeout);
+        return limit == std::chrono::steady_clock::time_point::max() ? limit : std::max(limit, w.busySince) + stuck_grace;
+    }
+
+    // the poll timeout in ms until the next worker is due, -1 without limits
+    int watchdog() const {
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (const auto& w : workers) {
+            if (!w.jobs.empty() && !w.stuck) next = std::min(next, due(w));
+        }
+        if (next == std::chrono::steady_clock::time_point::max()) return -1;
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+        return static_cast<int>(std::max<std::chrono::milliseconds::rep>(0, std::min<std::chrono::milliseconds::rep>(wait.count() + 1, INT_MAX)));
+    }
+
+    // a read that does not return (a hung NFS server) is only ended by killing the worker, the
+    // hang up follows
+    void kill_stuck(){
+        const auto now = std::chrono::steady_clock::now();
+        for (auto& w : workers) {
+            if (w.jobs.empty() || w.stuck || now < due(w)) continue;
+            w.stuck = true;
+            ::kill(w.pid, SIGKILL);
+        }
+    }
+
+    // the worker's socket hung up: whatever it finished is taken, the file it was on is the one
+    // that killed it
+    void lost(std::size_t slot){
+        worker& w = workers[slot];
+        collect(w);
+        const int status = zygote.reap(w.pid);
+        ::close(w.socket);
+        w.pid = -1;
+        w.socket = -1;
+        if (!w.jobs.empty()) {
+            job crashed = std::move(w.jobs.front());
+            w.jobs.pop_front();
+            if (w.stuck) {
+                std::cout << crashed.path.string() << " timed out in a read that did not return, its worker was killed" << "\n";
+                count_error(scan_error::timed_out);
+            }
+            else {
+                std::cout << crashed.path.string() << " crashed a scan worker (" << describe_death(status) << ")" << "\n";
+                count_error(scan_error::worker_crash);
+            }
+            // one the deadline stopped is not done
+            const bool pastDeadline = w.stuck && std::chrono::steady_clock::now() >= options.deadline;
+            if (progress && !pastDeadline) progress->done(crashed.sequence, {}, walk);
+            for (auto& queued : w.jobs) retry.push_back(std::move(queued));
+            w.jobs.clear();
+            std::sort(retry.begin(), retry.end(), [](const job& a, const job& b){ return a.sequence < b.sequence; });
+        }
+        else if (++idleDeaths > max_idle_deaths) {
+            std::cerr << "the scan workers keep dying (" << describe_death(status) << ")" << "\n";
+            throw CANT_READ;
+        }
+        spawn(slot);
+    }
+
+    void shut(){
+        for (auto& w : workers) {
+            if (w.pid > 0) {
+                // still busy only when the scan failed, nobody waits for the answer
+                if (!w.jobs.empty()) ::kill(w.pid, SIGKILL);
+                // the end of file tells an idle worker to exit
+                ::close(w.socket);
+                zygote.reap(w.pid);
+                w.pid = -1;
+            }
+        }
+    }
+
+    worker_zygote& zygote;
+    const scan_options& options;
+    tree_walk& walk;
+    completion_tracker* progress;
+    std::vector<worker> workers;
+    std::deque<job> retry;
+    unsigned idleDeaths = 0;
+};
+
+} // namespace
+
+void prepare_isolated_scan(const signature_list& signatures, const scan_options& options){
+    prepared.reset();
+    if (options.isolate > 0) prepared = std::make_unique<worker_zygote>(signatures, options);
+}
+
+bool isolated_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options){
+    std::unique_ptr<worker_zygote> zygote = std::move(prepared);
+    if (!zygote || !zygote->fits(signatures, options)) {
+        zygote.reset();
+        zygote = std::make_unique<worker_zygote>(signatures, options);
+    }
+    const signature_matcher& matcher = zygote->matcher();
+    const bool tracking = !options.checkpoint_file.empty();
+    completion_tracker progress;
+    worker_pool pool(*zygote, options, walk, tracking ? &progress : nullptr);
+
+    const bool completed = walk.run([&](const fs::path& path, const std::vector<std::string>& position,
+                                        std::uint64_t sequence, const file_stat& info){
+        if (tracking) progress.queued(sequence, position);
+        if (!S_ISREG(info.mode)) {
+            // a root that is no file fails here like in the plain scan
+            scan_path(path, matcher, options, nullptr, &info);
+            return;
+        }
+        pool.submit(path, sequence, info);
+    }, false);
+    // also after a stop: the files in flight are scanned and recorded
+    pool.drain();
+
+    if (!completed || walk.stop_requested()) {
+        if (tracking) progress.flush(walk);
+        return false;
+    }
+    return true;
+}
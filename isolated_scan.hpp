@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+
+#include "file_scanner.hpp"
+#include "tree_walk.hpp"
+
+// files handed to a worker and not answered yet, so a worker never waits for its next one
+constexpr unsigned isolated_depth = 4;
+// bytes of the ring each worker writes its hits and verdicts to
+constexpr std::size_t isolated_ring_size = 256 * 1024;
+
+// scanner() with options.isolate: files are scanned in that many worker processes forked up front,
+// so a file that crashes the ELF check, a decompressor or the regex engine takes down one worker and
+// not the scan. the walk stays on the calling thread, which opens each file and passes the
+// descriptor to the least busy worker over a unix socket (SCM_RIGHTS). a worker writes the hits and
+// the verdict of every file to a ring in memory it shares with the walking process. a worker that
+// dies is forked again right away, the file it was on is printed as "<path> crashed a scan worker
+// (signal N)" and counted as a worker_crash error, the files queued behind it go to the next free
+// worker. a file that cannot be opened or read is printed as "<path> could not be read, skipped",
+// counted and left behind, the scan goes on (the in-process scans stop on it with the file's error).
+// the workers' own metrics (bytes read, phase times) are not collected, files scanned and infected
+// are. the workers are forked by a zygote process, see prepare_isolated_scan. returns false when the
+// walk was stopped, throws CANT_READ when a worker can not be forked again
+bool isolated_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options);
+
+// forks the zygote the next isolated_scan with the same signatures and options.isolate forks its
+// workers from, for as long as the process has a single thread: call it before starting any (the
+// metrics writer, a shard worker's reader). a process forked while another thread holds a lock has
+// it held forever. without it isolated_scan forks its zygote itself
+void prepare_isolated_scan(const signature_list& signatures, const scan_options& options);
@@ -0,0 +1,87 @@
+#include "numa_topology.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// from linux/mempolicy.h
+constexpr int mpol_local = 4;
+
+std::string read_line(const std::string& path){
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+} // namespace
+
+std::vector<int> parse_cpu_list(const std::string& list){
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty()) continue;
+        std::size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+        catch (const std::exception&) {
+            return {};
+        }
+    }
+    return cpus;
+}
+
+std::vector<numa_node> numa_nodes(){
+    std::vector<numa_node> nodes;
+    for (int id : parse_cpu_list(read_line("/sys/devices/system/node/online"))) {
+        std::string dir = "/sys/devices/system/node/node" + std::to_string(id);
+        numa_node node;
+        node.id = id;
+        node.cpus = parse_cpu_list(read_line(dir + "/cpulist"));
+        std::stringstream distances(read_line(dir + "/distance"));
+        int distance;
+        while (distances >> distance) node.distances.push_back(distance);
+        // memory only nodes get no workers
+        if (!node.cpus.empty()) nodes.push_back(node);
+    }
+    if (nodes.empty()) {
+        numa_node all;
+        unsigned count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < count; ++cpu) all.cpus.push_back(static_cast<int>(cpu));
+        nodes.push_back(all);
+    }
+
+    // distances come indexed by node id, the callers index by position
+    std::vector<numa_node> byPosition = nodes;
+    for (auto& node : byPosition) {
+        std::vector<int> distances;
+        for (const auto& other : nodes) {
+            std::size_t index = static_cast<std::size_t>(other.id);
+            distances.push_back(index < node.distances.size() ? node.distances[index] : (other.id == node.id ? 10 : 20));
+        }
+        node.distances = distances;
+    }
+    return byPosition;
+}
+
+bool bind_thread_to_node(const numa_node& node){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : node.cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    bool pinned = ::sched_setaffinity(0, sizeof(set), &set) == 0;
+    bool local = ::syscall(SYS_set_mempolicy, mpol_local, nullptr, 0) == 0;
+    return pinned && local;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+#include <vector>
+
+struct numa_node {
+    int id = 0;
+    std::vector<int> cpus;
+    // distance to every node, indexed like the vector numa_nodes() returns (10 = local)
+    std::vector<int> distances;
+};
+
+// the online nodes with cpus, from /sys/devices/system/node. a machine without NUMA (or
+// without that directory) is one node holding every cpu
+std::vector<numa_node> numa_nodes();
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// pins the calling thread to the node's cpus and makes it allocate from the local node
+// (MPOL_LOCAL, overriding e.g. numactl --interleave). false when the kernel refused either
+bool bind_thread_to_node(const numa_node& node);
@@ -0,0 +1,310 @@
+#include "on_access.hpp"
+#include "file_scanner.hpp"
+#include "file_stat.hpp"
+#include "scan_trace.hpp"
+#include "verdict_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+using steady = std::chrono::steady_clock;
+
+std::atomic<bool> stop_requested{false};
+
+void request_stop(int){
+    stop_requested = true;
+}
+
+// latency from reading the event to writing the response, power of two microsecond buckets
+struct latency_histogram {
+    std::atomic<std::uint64_t> buckets[32] = {};
+
+    void record(steady::duration elapsed){
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        std::size_t bucket = 0;
+        while (us > 0 && bucket < 31) {
+            us >>= 1;
+            ++bucket;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // upper bound (in microseconds) of the bucket holding the given percentile
+    std::uint64_t percentile(double p) const {
+        std::uint64_t total = 0;
+        for (auto& b : buckets) total += b.load(std::memory_order_relaxed);
+        if (total == 0) return 0;
+        std::uint64_t wanted = static_cast<std::uint64_t>(p * static_cast<double>(total - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < 32; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= wanted) return i == 0 ? 1 : (std::uint64_t(1) << i);
+        }
+        return std::uint64_t(1) << 31;
+    }
+};
+
+// one exec waiting for its verdict. the kernel's fd stays open until both the reader
+// (who enforces the deadline) and the worker are done with it, so a response can never
+// be written for a reused fd number
+struct pending_exec {
+    int fd;
+    file_key key;
+    steady::time_point received;
+    steady::time_point deadline;
+    std::atomic<bool> answered{false};
+
+    ~pending_exec(){ ::close(fd); }
+};
+
+struct guard_state {
+    int fan_fd = -1;
+    const signature_matcher* matcher = nullptr;
+    const on_access_options* options = nullptr;
+    verdict_cache* cache = nullptr;
+
+    std::mutex queue_lock;
+    std::condition_variable queue_ready;
+    std::deque<std::shared_ptr<pending_exec>> queue;
+
+    std::mutex output_lock;
+    latency_histogram latency;
+    std::atomic<std::uint64_t> events{0};
+    std::atomic<std::uint64_t> cache_hits{0};
+    std::atomic<std::uint64_t> denied{0};
+    std::atomic<std::uint64_t> timeouts{0};
+};
+
+std::string fd_path(int fd){
+    char link[64];
+    std::snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    char target[4096];
+    ssize_t n = ::readlink(link, target, sizeof(target) - 1);
+    if (n < 0) return "(unknown)";
+    return std::string(target, static_cast<std::size_t>(n));
+}
+
+void respond(guard_state& state, int fd, bool allow, steady::time_point received){
+    struct fanotify_response response;
+    response.fd = fd;
+    response.response = allow ? FAN_ALLOW : FAN_DENY;
+    if (::write(state.fan_fd, &response, sizeof(response)) != static_cast<ssize_t>(sizeof(response))) {
+        std::cerr << "could not answer fanotify event: " << std::strerror(errno) << "\n";
+    }
+    state.latency.record(steady::now() - received);
+}
+
+// only the first caller (worker or deadline) gets to answer
+bool answer_once(guard_state& state, pending_exec& exec, bool allow){
+    if (exec.answered.exchange(true)) return false;
+    respond(state, exec.fd, allow, exec.received);
+    return true;
+}
+
+void report_denied(guard_state& state, int fd){
+    state.denied.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(state.output_lock);
+    std::cout << fd_path(fd) << " is infected! (exec denied)" << "\n" << std::flush;
+}
+
+void worker_loop(guard_state& state){
+    set_trace_thread_name("on-access worker");
+    while (true) {
+        std::shared_ptr<pending_exec> exec;
+        {
+            trace_span wait("queue wait");
+            std::unique_lock<std::mutex> guard(state.queue_lock);
+            state.queue_ready.wait(guard, [&]{ return stop_requested || !state.queue.empty(); });
+            if (stop_requested) return;
+            exec = std::move(state.queue.front());
+            state.queue.pop_front();
+        }
+
+        // the scan runs even when the deadline already passed, the next exec of the same
+        // binary then gets its verdict from the cache
+        std::string path = tracing_enabled() ? fd_path(exec->fd) : std::string();
+        trace_span span("exec scan", path.c_str());
+        bool infected;
+        try {
+            // the event's fstat already said regular file, the size is only a hint, the scan reads to eof
+            file_stat info;
+            info.mode = S_IFREG;
+            info.size = static_cast<std::uint64_t>(exec->key.size);
+            infected = contains_signature_fd(exec->fd, *state.matcher, state.options->scan, &info);
+        }
+        catch (int) {
+            answer_once(state, *exec, !state.options->deny_on_error);
+            continue;
+        }
+        state.cache->store(exec->key, infected);
+        if (answer_once(state, *exec, !infected) && infected) {
+            report_denied(state, exec->fd);
+        }
+    }
+}
+
+// answers everything whose deadline passed, returns how long the reader may sleep
+timespec expire_deadlines(guard_state& state, std::deque<std::shared_ptr<pending_exec>>& waiting){
+    // all execs get the same budget so arrival order is deadline order
+    auto now = steady::now();
+    while (!waiting.empty()) {
+        auto& front = waiting.front();
+        if (!front->answered && front->deadline > now) break;
+        if (answer_once(state, *front, !state.options->deny_on_timeout)) {
+            state.timeouts.fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> guard(state.output_lock);
+            std::clog << "verdict deadline missed for " << fd_path(front->fd) << "\n";
+        }
+        waiting.pop_front();
+    }
+
+    steady::duration sleep = std::chrono::milliseconds(100);
+    if (!waiting.empty()) sleep = std::min(sleep, waiting.front()->deadline - now);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sleep).count();
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+    return ts;
+}
+
+void handle_event(guard_state& state, const struct fanotify_event_metadata* event,
+                  std::deque<std::shared_ptr<pending_exec>>& waiting){
+    auto received = steady::now();
+    state.events.fetch_add(1, std::memory_order_relaxed);
+
+    struct stat st;
+    if (::fstat(event->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        respond(state, event->fd, true, received);
+        ::close(event->fd);
+        return;
+    }
+
+    // fast path: the binary was scanned before and did not change since, answer right here
+    // without a thread hop
+    file_key key = make_file_key(st);
+    bool infected;
+    trace_span span("exec event");
+    if (state.cache->lookup(key, infected)) {
+        state.cache_hits.fetch_add(1, std::memory_order_relaxed);
+        respond(state, event->fd, !infected, received);
+        if (infected) report_denied(state, event->fd);
+        ::close(event->fd);
+        return;
+    }
+
+    auto exec = std::make_shared<pending_exec>();
+    exec->fd = event->fd;
+    exec->key = key;
+    exec->received = received;
+    exec->deadline = received + state.options->verdict_deadline;
+    waiting.push_back(exec);
+    {
+        std::lock_guard<std::mutex> guard(state.queue_lock);
+        state.queue.push_back(std::move(exec));
+    }
+    state.queue_ready.notify_one();
+}
+
+} // namespace
+
+void on_access_guard(const fs::path& mount, const signature_list& signatures,
+                     const on_access_options& options){
+
+    int fan_fd = ::fanotify_init(FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK,
+                                 O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    if (fan_fd < 0) {
+        std::cerr << "could not start fanotify: " << std::strerror(errno) << "\n";
+        throw CANT_WATCH;
+    }
+    if (::fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN_EXEC_PERM,
+                        AT_FDCWD, mount.c_str()) != 0) {
+        std::cerr << "could not watch " << mount.string() << ": " << std::strerror(errno) << "\n";
+        ::close(fan_fd);
+        throw CANT_WATCH;
+    }
+
+    verdict_cache cache(options.cache_entries);
+    const signature_matcher matcher(signatures);
+    guard_state state;
+    state.fan_fd = fan_fd;
+    state.matcher = &matcher;
+    state.options = &options;
+    state.cache = &cache;
+
+    // no SA_RESTART so ppoll wakes up on the signal
+    struct sigaction action = {};
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    ::sigaction(SIGINT, &action, nullptr);
+    ::sigaction(SIGTERM, &action, nullptr);
+    stop_requested = false;
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::max(1u, options.workers); ++i) {
+        workers.emplace_back(worker_loop, std::ref(state));
+    }
+
+    set_trace_thread_name("fanotify reader");
+    std::deque<std::shared_ptr<pending_exec>> waiting;
+    alignas(struct fanotify_event_metadata) char buffer[64 * 1024];
+
+    while (!stop_requested) {
+        timespec timeout = expire_deadlines(state, waiting);
+        struct pollfd pfd = {fan_fd, POLLIN, 0};
+        int ready = ::ppoll(&pfd, 1, &timeout, nullptr);
+        if (ready <= 0) continue;
+
+        ssize_t len = ::read(fan_fd, buffer, sizeof(buffer));
+        if (len <= 0) continue;
+
+        auto* event = reinterpret_cast<const struct fanotify_event_metadata*>(buffer);
+        for (; FAN_EVENT_OK(event, len); event = FAN_EVENT_NEXT(event, len)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION) {
+                std::cerr << "fanotify metadata version mismatch" << "\n";
+                stop_requested = true;
+                break;
+            }
+            if (event->fd == FAN_NOFD) continue; // queue overflow, nothing to answer
+            if (event->mask & FAN_OPEN_EXEC_PERM) {
+                handle_event(state, event, waiting);
+            }
+            else {
+                ::close(event->fd);
+            }
+        }
+    }
+
+    state.queue_ready.notify_all();
+    for (auto& worker : workers) worker.join();
+
+    // never leave a process hanging in execve on the way out
+    for (auto& exec : waiting) answer_once(state, *exec, true);
+    waiting.clear();
+    state.queue.clear();
+    ::close(fan_fd);
+
+    std::clog << "on-access: " << state.events << " execs, " << state.cache_hits << " cached, "
+              << state.denied << " denied, " << state.timeouts << " past deadline, "
+              << "latency p50 <= " << state.latency.percentile(0.50) << "us, "
+              << "p99 <= " << state.latency.percentile(0.99) << "us" << "\n";
+}
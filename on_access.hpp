@@ -0,0 +1,31 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "file_scanner.hpp"
+
+#define CANT_WATCH 600
+
+namespace fs = std::filesystem;
+
+struct on_access_options {
+    // every exec gets an answer within this time, scans that take longer are answered
+    // with the timeout verdict and finish in the background (their result is still cached)
+    std::chrono::microseconds verdict_deadline{std::chrono::milliseconds(200)};
+    bool deny_on_timeout = false;
+    // a binary that cannot be read (EIO, a file gone from under the scan) is denied instead of
+    // allowed. the deadline policy does not apply, that is about slow scans and not broken files
+    bool deny_on_error = false;
+    unsigned workers = 4;
+    std::size_t cache_entries = 65536;
+    scan_options scan;
+};
+
+// blocks execve of infected ELF files on the mount that holds `mount` using fanotify
+// FAN_OPEN_EXEC_PERM events. runs until SIGINT/SIGTERM, needs CAP_SYS_ADMIN.
+// throws CANT_WATCH when fanotify can not be set up
+void on_access_guard(const fs::path& mount, const signature_list& signatures,
+                     const on_access_options& options);
@@ -0,0 +1,186 @@
+#include "parallel_scan.hpp"
+#include "numa_topology.hpp"
+#include "scan_budget.hpp"
+#include "scan_trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace {
+
+// files waiting per worker before the walker waits, keeps memory flat on huge trees
+constexpr std::size_t queued_per_worker = 64;
+
+struct scan_task {
+    fs::path path;
+    std::uint64_t sequence;
+    file_stat info;
+};
+
+struct worker_queue {
+    std::mutex lock;
+    std::deque<scan_task> tasks;
+    std::size_t node = 0;
+    // the other workers in the order this one steals from them
+    std::vector<std::size_t> victims;
+};
+
+} // namespace
+
+bool parallel_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options){
+    const std::size_t threads = std::max(1u, options.threads);
+    const std::vector<numa_node> nodes = options.numa ? numa_nodes() : std::vector<numa_node>(1);
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    for (std::size_t w = 0; w < threads; ++w) {
+        queues.push_back(std::make_unique<worker_queue>());
+        queues[w]->node = w % nodes.size();
+    }
+    for (std::size_t w = 0; w < threads; ++w) {
+        // nearest nodes first, starting after w so the thieves do not all pick the same victim
+        auto distance = [&](std::size_t other) {
+            const auto& distances = nodes[queues[w]->node].distances;
+            std::size_t node = queues[other]->node;
+            return node < distances.size() ? distances[node] : (node == queues[w]->node ? 10 : 20);
+        };
+        for (std::size_t i = 1; i < threads; ++i) queues[w]->victims.push_back((w + i) % threads);
+        std::stable_sort(queues[w]->victims.begin(), queues[w]->victims.end(),
+                         [&](std::size_t a, std::size_t b) { return distance(a) < distance(b); });
+    }
+
+    // queued counts files handed out and not yet taken, it only changes under idleLock so neither
+    // an idle worker nor the waiting walker misses a wakeup. it goes up before the push, so a
+    // take never finds it at 0
+    std::mutex idleLock;
+    std::condition_variable work;
+    std::condition_variable space;
+    std::size_t queued = 0;
+    bool walkDone = false;
+    std::atomic<bool> abort{false};
+    std::exception_ptr failure;
+    const std::size_t maxQueued = threads * queued_per_worker;
+
+    const bool tracking = !options.checkpoint_file.empty();
+    completion_tracker progress;
+
+    auto take = [&](std::size_t self, scan_task& task) {
+        {
+            std::lock_guard<std::mutex> guard(queues[self]->lock);
+            if (!queues[self]->tasks.empty()) {
+                task = std::move(queues[self]->tasks.front());
+                queues[self]->tasks.pop_front();
+                return true;
+            }
+        }
+        for (std::size_t victim : queues[self]->victims) {
+            std::lock_guard<std::mutex> guard(queues[victim]->lock);
+            if (!queues[victim]->tasks.empty()) {
+                task = std::move(queues[victim]->tasks.back());
+                queues[victim]->tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto worker = [&](std::size_t self) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "scan worker %zu", self);
+        set_trace_thread_name(name);
+        if (options.numa) bind_thread_to_node(nodes[queues[self]->node]);
+        // built after binding, so the tables are allocated on this worker's node
+        const signature_matcher matcher(signatures);
+
+        scan_task task;
+        while (true) {
+            if (!take(self, task)) {
+                std::unique_lock<std::mutex> guard(idleLock);
+                if (walkDone && queued == 0) return;
+                work.wait(guard, [&] { return queued > 0 || walkDone || abort; });
+                if (abort) return;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> guard(idleLock);
+                if (queued-- == maxQueued) space.notify_one();
+            }
+            // stopped: finish nothing new, what is queued stays unscanned and unrecorded
+            if (abort || walk.stop_requested()) return;
+
+            std::vector<std::string> hits;
+            try {
+                scan_path(task.path, matcher, options, [&](const std::string& hit){
+                    walk.report(hit, false);
+                    if (tracking) hits.push_back(hit);
+                }, &task.info);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> guard(idleLock);
+                if (!failure) failure = std::current_exception();
+                abort = true;
+                work.notify_all();
+                space.notify_all();
+                return;
+            }
+            if (tracking && !cut_by_deadline()) progress.done(task.sequence, std::move(hits), walk);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < threads; ++w) workers.emplace_back(worker, w);
+
+    std::size_t next = 0;
+    bool completed = false;
+    std::exception_ptr walkFailure;
+    try {
+        completed = walk.run([&](const fs::path& path, const std::vector<std::string>& position,
+                                 std::uint64_t sequence, const file_stat& info){
+            {
+                std::unique_lock<std::mutex> guard(idleLock);
+                // signals do not notify, look at the stop flag now and then
+                while (queued >= maxQueued && !abort && !walk.stop_requested()) {
+                    space.wait_for(guard, std::chrono::milliseconds(100));
+                }
+                if (abort) std::rethrow_exception(failure);
+                // counted before it is pushed, a thief may take it the moment it is in a queue
+                ++queued;
+            }
+            if (tracking) progress.queued(sequence, position);
+            {
+                std::lock_guard<std::mutex> guard(queues[next]->lock);
+                queues[next]->tasks.push_back({path, sequence, info});
+            }
+            next = (next + 1) % threads;
+            work.notify_one();
+        }, false);
+    }
+    catch (...) {
+        walkFailure = std::current_exception();
+        abort = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        walkDone = true;
+    }
+    work.notify_all();
+    for (auto& thread : workers) thread.join();
+
+    if (failure) std::rethrow_exception(failure);
+    if (walkFailure) std::rethrow_exception(walkFailure);
+    if (!completed || walk.stop_requested()) {
+        if (tracking) progress.flush(walk);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "file_scanner.hpp"
+#include "tree_walk.hpp"
+
+// walks on the calling thread and scans the files on options.threads workers. every worker has
+// its own deque: the walker deals the files out round robin, a worker that runs dry steals from
+// the back of the others' deques, the ones on its own NUMA node first. with options.numa the
+// workers are spread over the nodes and pinned, and each builds its own matcher so the tables
+// it reads are local. progress reaches the walk's checkpoint once every file before it is
+// scanned. returns false when the walk was stopped
+bool parallel_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options);
@@ -0,0 +1,185 @@
+#include "path_filter.hpp"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+#include <sys/sysmacros.h>
+
+namespace {
+
+// matches tokens[t..] against text[i..]. the memo holds the (t, i) pairs already known to fail,
+// which keeps ** and * from going exponential on long paths
+template <class Token>
+bool match_from(const std::vector<Token>& tokens, std::size_t t, const std::string& text, std::size_t i,
+                std::vector<bool>& failed){
+    const std::size_t stride = text.size() + 1;
+    for (;;) {
+        if (failed[t * stride + i]) return false;
+        if (t == tokens.size()) return i == text.size();
+        const Token& token = tokens[t];
+        if (token.kind == Token::directories) {
+            for (std::size_t end = i; end <= text.size(); ++end) {
+                if ((end == i || text[end - 1] == '/') && match_from(tokens, t + 1, text, end, failed)) return true;
+            }
+            failed[t * stride + i] = true;
+            return false;
+        }
+        if (token.kind == Token::star || token.kind == Token::globstar) {
+            for (std::size_t end = i;; ++end) {
+                if (match_from(tokens, t + 1, text, end, failed)) return true;
+                if (end == text.size() || (token.kind == Token::star && text[end] == '/')) break;
+            }
+            failed[t * stride + i] = true;
+            return false;
+        }
+        bool ok = i < text.size();
+        if (ok) {
+            const unsigned char c = static_cast<unsigned char>(text[i]);
+            if (token.kind == Token::literal) {
+                ok = text[i] == token.byte;
+            }
+            else if (token.kind == Token::any_one) {
+                ok = c != '/';
+            }
+            else {
+                bool inSet = false;
+                for (const auto& range : token.ranges) inSet = inSet || (c >= range.first && c <= range.second);
+                ok = c != '/' && inSet != token.negated;
+            }
+        }
+        if (!ok) {
+            failed[t * stride + i] = true;
+            return false;
+        }
+        ++t;
+        ++i;
+    }
+}
+
+} // namespace
+
+const std::vector<std::string> pseudo_filesystems = {
+    "proc", "sysfs", "devtmpfs", "devpts", "cgroup", "cgroup2", "debugfs", "tracefs", "securityfs",
+    "pstore", "bpf", "configfs", "fusectl", "mqueue", "hugetlbfs", "autofs", "binfmt_misc",
+    "selinuxfs", "efivarfs", "rpc_pipefs", "nsfs",
+};
+
+path_filter::path_filter(const std::vector<std::string>& exclude, const std::vector<std::string>& include){
+    compile(exclude, excludes);
+    compile(include, includes);
+}
+
+void path_filter::compile(const std::vector<std::string>& patterns, glob_set& set){
+    for (std::string pattern : patterns) {
+        if (pattern.empty()) continue;
+        set.any = true;
+        // build/ is a name like build, the walk does not tell directories apart before the stat
+        while (pattern.size() > 1 && pattern.back() == '/') pattern.pop_back();
+        const bool onPath = pattern.find('/') != std::string::npos;
+        if (onPath && pattern[0] == '/') pattern.erase(0, 1);
+
+        compiled_glob glob{{}, onPath};
+        bool wild = false;
+        for (std::size_t i = 0; i < pattern.size(); ++i) {
+            token next;
+            const char c = pattern[i];
+            if (c == '*') {
+                wild = true;
+                next.kind = token::star;
+                if (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+                    while (i + 1 < pattern.size() && pattern[i + 1] == '*') ++i;
+                    next.kind = token::globstar;
+                    // **/ is any number of whole directories, none too: a/**/b matches a/b
+                    if (i + 1 < pattern.size() && pattern[i + 1] == '/') {
+                        ++i;
+                        next.kind = token::directories;
+                    }
+                }
+            }
+            else if (c == '?') {
+                wild = true;
+                next.kind = token::any_one;
+            }
+            else if (c == '[' && pattern.find(']', i + 2) != std::string::npos) {
+                wild = true;
+                next.kind = token::set;
+                std::size_t j = i + 1;
+                if (pattern[j] == '!' || pattern[j] == '^') {
+                    next.negated = true;
+                    ++j;
+                }
+                // a ] right after [ or [! is a member
+                bool first = true;
+                for (; j < pattern.size() && (first || pattern[j] != ']'); ++j, first = false) {
+                    unsigned char low = static_cast<unsigned char>(pattern[j]);
+                    unsigned char high = low;
+                    if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                        high = static_cast<unsigned char>(pattern[j + 2]);
+                        j += 2;
+                    }
+                    next.ranges.emplace_back(low, high);
+                }
+                i = j;
+            }
+            else {
+                next.kind = token::literal;
+                next.byte = (c == '\\' && i + 1 < pattern.size()) ? pattern[++i] : c;
+            }
+            glob.tokens.push_back(std::move(next));
+        }
+
+        if (!wild) {
+            std::string literal;
+            for (const auto& t : glob.tokens) literal += t.byte;
+            (onPath ? set.paths : set.names).insert(literal);
+        }
+        else {
+            set.globs.push_back(std::move(glob));
+        }
+    }
+}
+
+bool path_filter::matches(const glob_set& set, const std::string& relative, const std::string& name){
+    if (set.names.count(name) || set.paths.count(relative)) return true;
+    std::vector<bool> failed;
+    for (const auto& glob : set.globs) {
+        const std::string& text = glob.onPath ? relative : name;
+        failed.assign((glob.tokens.size() + 1) * (text.size() + 1), false);
+        if (match_from(glob.tokens, 0, text, 0, failed)) return true;
+    }
+    return false;
+}
+
+bool path_filter::excluded(const std::string& relative, const std::string& name) const {
+    return excludes.any && matches(excludes, relative, name);
+}
+
+bool path_filter::included(const std::string& relative, const std::string& name) const {
+    return !includes.any || matches(includes, relative, name);
+}
+
+std::string filesystem_type(dev_t device){
+    static std::once_flag loaded;
+    static std::unordered_map<dev_t, std::string> types;
+    std::call_once(loaded, [] {
+        // 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+        std::ifstream in("/proc/self/mountinfo");
+        for (std::string line; std::getline(in, line);) {
+            std::istringstream fields(line);
+            std::string id, parent, numbers, field;
+            fields >> id >> parent >> numbers;
+            while (fields >> field && field != "-") {}
+            std::string type;
+            unsigned major = 0, minor = 0;
+            char colon = 0;
+            std::istringstream dev(numbers);
+            if (fields >> type && dev >> major >> colon >> minor && colon == ':') {
+                types.emplace(makedev(major, minor), type);
+            }
+        }
+    });
+    auto it = types.find(device);
+    return it == types.end() ? std::string() : it->second;
+}
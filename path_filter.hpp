@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+
+// --exclude / --include globs, compiled once and asked per directory entry before it is stat'ed:
+//   *  any run of characters but /   **  any run including /   **/  no or any directories
+//   ?  one character but /
+//   [a-z] [!a-z] a class   \c  c itself
+// a glob with a / matches the entry's path below the root (a leading / is dropped), one without
+// matches the entry's name at any depth. globs without wildcards are looked up in a hash set
+class path_filter {
+public:
+    path_filter(const std::vector<std::string>& exclude, const std::vector<std::string>& include);
+
+    // relative is the entry's path below the root, name its last component
+    bool excluded(const std::string& relative, const std::string& name) const;
+    // with no include globs every file is included
+    bool included(const std::string& relative, const std::string& name) const;
+
+    bool empty() const { return !excludes.any && !includes.any; }
+    bool has_includes() const { return includes.any; }
+
+private:
+    struct token {
+        enum kind_t { literal, any_one, star, globstar, directories, set } kind;
+        char byte = 0;
+        bool negated = false;
+        std::vector<std::pair<unsigned char, unsigned char>> ranges;
+    };
+    struct compiled_glob {
+        std::vector<token> tokens;
+        bool onPath;
+    };
+    struct glob_set {
+        bool any = false;
+        std::unordered_set<std::string> names;
+        std::unordered_set<std::string> paths;
+        std::vector<compiled_glob> globs;
+    };
+
+    static void compile(const std::vector<std::string>& patterns, glob_set& set);
+    static bool matches(const glob_set& set, const std::string& relative, const std::string& name);
+
+    glob_set excludes;
+    glob_set includes;
+};
+
+// filesystem types that are not files on a disk, mounts of them below the root are not entered
+extern const std::vector<std::string> pseudo_filesystems;
+
+// the type of the filesystem mounted as device ("ext4", "proc", "fuse.sshfs") from
+// /proc/self/mountinfo, read once. empty when the device is not listed there
+std::string filesystem_type(dev_t device);
@@ -0,0 +1,144 @@
+#include "read_tuning.hpp"
+#include "file_stat.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+
+namespace {
+
+// from linux/magic.h
+constexpr long tmpfs_magic = 0x01021994;
+constexpr long ramfs_magic = 0x858458f6;
+
+constexpr unsigned window_reads = 32;
+
+struct device_profile {
+    std::mutex lock;
+    storage_class storage = storage_class::unknown;
+    unsigned readahead_chunks = 1;
+    std::size_t chunk = 8 * 1024 * 1024;
+
+    // the current measuring window
+    std::uint64_t windowBytes = 0;
+    std::uint64_t windowNanoseconds = 0;
+    unsigned windowCount = 0;
+    // throughput (bytes per ns) of the previous window, 0 before the first one
+    double previousThroughput = 0;
+    int direction = 1;
+};
+
+std::mutex devices_lock;
+std::unordered_map<dev_t, std::unique_ptr<device_profile>>& devices(){
+    static std::unordered_map<dev_t, std::unique_ptr<device_profile>> profiles;
+    return profiles;
+}
+
+bool read_sysfs_number(dev_t device, const char* file, long& value){
+    char path[128];
+    // partitions have no queue of their own, the disk's is one level up
+    for (const char* queue : {"queue", "../queue"}) {
+        std::snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/%s", major(device), minor(device), queue, file);
+        std::ifstream in(path);
+        if (in >> value) return true;
+    }
+    return false;
+}
+
+void probe(device_profile& profile, int fd, dev_t device){
+    struct statfs fs;
+    if (::fstatfs(fd, &fs) == 0 && (fs.f_type == tmpfs_magic || fs.f_type == ramfs_magic)) {
+        // a read is a copy, small chunks stay in the cpu caches and readahead has nothing to do
+        profile.storage = storage_class::memory;
+        profile.chunk = 1024 * 1024;
+        profile.readahead_chunks = 0;
+        return;
+    }
+
+    long rotational, readAheadKb = 0;
+    if (major(device) == 0 || !read_sysfs_number(device, "rotational", rotational)) {
+        // overlay, network and fuse filesystems, no queue to look at
+        profile.storage = storage_class::unknown;
+        profile.chunk = 4 * 1024 * 1024;
+        profile.readahead_chunks = 1;
+        return;
+    }
+    read_sysfs_number(device, "read_ahead_kb", readAheadKb);
+    const std::size_t deviceReadAhead = static_cast<std::size_t>(std::max(readAheadKb, 0L)) * 1024;
+
+    if (rotational) {
+        // seeks are what costs, big reads and the next chunks already on their way
+        profile.storage = storage_class::rotational;
+        profile.chunk = std::max<std::size_t>(8 * 1024 * 1024, 4 * deviceReadAhead);
+        profile.readahead_chunks = 2;
+    }
+    else {
+        profile.storage = storage_class::solid_state;
+        profile.chunk = std::max<std::size_t>(2 * 1024 * 1024, 2 * deviceReadAhead);
+        profile.readahead_chunks = 1;
+    }
+    profile.chunk = std::min(profile.chunk, max_read_chunk);
+}
+
+} // namespace
+
+read_plan plan_reads(int fd){
+    read_plan plan;
+    // only the device is needed, which statx always fills in
+    file_stat st;
+    if (stat_fd(fd, STATX_TYPE, stat_sync::cached, st) != 0) return plan;
+
+    device_profile* profile;
+    {
+        std::lock_guard<std::mutex> guard(devices_lock);
+        auto& slot = devices()[st.device];
+        if (!slot) {
+            slot = std::make_unique<device_profile>();
+            probe(*slot, fd, st.device);
+        }
+        profile = slot.get();
+    }
+
+    std::lock_guard<std::mutex> guard(profile->lock);
+    plan.storage = profile->storage;
+    plan.chunk = profile->chunk;
+    plan.readahead_chunks = profile->readahead_chunks;
+    plan.device = profile;
+    return plan;
+}
+
+void note_read(const read_plan& plan, std::size_t bytes, std::uint64_t nanoseconds){
+    auto* profile = static_cast<device_profile*>(plan.device);
+    if (!profile || bytes != plan.chunk || nanoseconds == 0) return;
+
+    std::lock_guard<std::mutex> guard(profile->lock);
+    // a read planned before the last change, it says nothing about the current size
+    if (plan.chunk != profile->chunk) return;
+    profile->windowBytes += bytes;
+    profile->windowNanoseconds += nanoseconds;
+    if (++profile->windowCount < window_reads) return;
+
+    double throughput = static_cast<double>(profile->windowBytes) / static_cast<double>(profile->windowNanoseconds);
+    // the last step made it slower, go back the other way
+    if (profile->previousThroughput > 0 && throughput < profile->previousThroughput) {
+        profile->direction = -profile->direction;
+    }
+    profile->previousThroughput = throughput;
+    profile->windowBytes = 0;
+    profile->windowNanoseconds = 0;
+    profile->windowCount = 0;
+
+    std::size_t next = profile->direction > 0 ? profile->chunk * 2 : profile->chunk / 2;
+    if (next < min_read_chunk || next > max_read_chunk) {
+        profile->direction = -profile->direction;
+        next = profile->direction > 0 ? profile->chunk * 2 : profile->chunk / 2;
+    }
+    profile->chunk = next;
+}
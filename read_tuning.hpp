@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+// what kind of storage a file is on, from sysfs queue/rotational and statfs
+enum class storage_class { rotational, solid_state, memory, unknown };
+
+// how search_range reads one file: chunk size and how many chunks ahead the kernel is asked to
+// read (posix_fadvise WILLNEED) while the current one is searched
+struct read_plan {
+    storage_class storage = storage_class::unknown;
+    std::size_t chunk = 8 * 1024 * 1024;
+    unsigned readahead_chunks = 1;
+    // the device the reads are accounted to, see note_read
+    void* device = nullptr;
+};
+
+// the plan for the device holding fd. the first file of a device reads sysfs (rotational,
+// read_ahead_kb), later ones get the device's current chunk size, which moves with the
+// throughput seen on that device
+read_plan plan_reads(int fd);
+
+// feeds the throughput of one read back into the device's chunk size. only full chunk reads
+// count, every 32 of them the chunk is doubled or halved, towards whatever was faster
+void note_read(const read_plan& plan, std::size_t bytes, std::uint64_t nanoseconds);
+
+// bounds of the adaptive chunk size
+constexpr std::size_t min_read_chunk = 256 * 1024;
+constexpr std::size_t max_read_chunk = 32 * 1024 * 1024;
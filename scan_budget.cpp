@@ -0,0 +1,71 @@
+#include "scan_budget.hpp"
+#include "scan_metrics.hpp"
+
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+struct budget_state {
+    bool active = false;
+    std::chrono::steady_clock::time_point expiry;
+    // expiry is options.deadline
+    bool deadline = false;
+    file_coverage coverage;
+};
+
+thread_local budget_state state;
+
+} // namespace
+
+file_budget::file_budget(const scan_options& options, std::uint64_t size){
+    state.coverage = file_coverage();
+    state.coverage.size = size;
+    state.active = options.file_timeout.count() > 0 || options.deadline != std::chrono::steady_clock::time_point::max();
+    if (!state.active) return;
+    state.expiry = options.deadline;
+    state.deadline = true;
+    if (options.file_timeout.count() > 0) {
+        const auto timeout = std::chrono::steady_clock::now() + options.file_timeout;
+        if (timeout < state.expiry) {
+            state.expiry = timeout;
+            state.deadline = false;
+        }
+    }
+}
+
+file_budget::~file_budget(){
+    state.active = false;
+}
+
+bool budget_expired(){
+    if (!state.active) return false;
+    if (state.coverage.timed_out) return true;
+    if (std::chrono::steady_clock::now() < state.expiry) return false;
+    state.coverage.timed_out = true;
+    state.coverage.by_deadline = state.deadline;
+    return true;
+}
+
+void check_budget(){
+    if (budget_expired()) throw TIMED_OUT;
+}
+
+void charge_budget(std::size_t bytes){
+    if (state.active) state.coverage.covered += bytes;
+}
+
+const file_coverage& last_file_coverage(){
+    return state.coverage;
+}
+
+bool cut_by_deadline(){
+    return state.coverage.timed_out && state.coverage.by_deadline;
+}
+
+void report_timeout(const std::string& name, const file_coverage& coverage){
+    count_error(scan_error::timed_out);
+    // one write, lines of other threads do not get in between
+    std::cout << name + " timed out after " + std::to_string(coverage.covered) + " of "
+                     + std::to_string(coverage.size) + " bytes\n";
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "file_scanner.hpp"
+
+// how far the scan of a file got before it ran out of time
+struct file_coverage {
+    bool timed_out = false;
+    // options.deadline ran out before options.file_timeout
+    bool by_deadline = false;
+    std::uint64_t covered = 0;
+    std::uint64_t size = 0;
+};
+
+// the time the file scanned on the calling thread may take: options.file_timeout from here on and
+// never past options.deadline. scan_path holds one for the whole file, archive members included
+class file_budget {
+public:
+    file_budget(const scan_options& options, std::uint64_t size);
+    ~file_budget();
+    file_budget(const file_budget&) = delete;
+    file_budget& operator=(const file_budget&) = delete;
+};
+
+// asked before every read of a file (chunks, compressed input, decompressed output, tar data):
+// true once the file on this thread is out of time. a branch when there is no budget
+bool budget_expired();
+// the same, throws TIMED_OUT. for loops that hold no library state
+void check_budget();
+// every read's bytes, for the coverage of a file that runs out of time
+void charge_budget(std::size_t bytes);
+
+// the last file scanned on this thread
+const file_coverage& last_file_coverage();
+// it ran into options.deadline: it is not done, a checkpoint must not move past it
+bool cut_by_deadline();
+
+// "<name> timed out after <covered> of <size> bytes" on std::cout, counted as timed_out
+void report_timeout(const std::string& name, const file_coverage& coverage);
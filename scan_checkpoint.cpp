@@ -0,0 +1,107 @@
+#include "scan_checkpoint.hpp"
+
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+constexpr char checkpoint_magic[] = "find_sig checkpoint 1";
+// a path component or a hit name, anything longer is a broken file
+constexpr std::size_t max_string = 1 << 20;
+constexpr std::size_t max_strings = 1 << 24;
+
+} // namespace
+
+void write_string(std::ostream& out, const std::string& text){
+    out << text.size() << "\n" << text << "\n";
+}
+
+bool read_count(std::istream& in, std::size_t& count, std::size_t limit){
+    if (!(in >> count) || count > limit) return false;
+    return in.get() == '\n';
+}
+
+bool read_string(std::istream& in, std::string& text){
+    std::size_t length;
+    if (!read_count(in, length, max_string)) return false;
+    text.resize(length);
+    if (!in.read(&text[0], static_cast<std::streamsize>(length))) return false;
+    return in.get() == '\n';
+}
+
+bool read_strings(std::istream& in, std::vector<std::string>& strings){
+    std::size_t count;
+    if (!read_count(in, count, max_strings)) return false;
+    strings.resize(count);
+    for (auto& text : strings) {
+        if (!read_string(in, text)) return false;
+    }
+    return true;
+}
+
+void write_strings(std::ostream& out, const std::vector<std::string>& strings){
+    out << strings.size() << "\n";
+    for (const auto& text : strings) write_string(out, text);
+}
+
+std::uint64_t hash_signature(const std::vector<std::uint8_t>& signature){
+    // FNV-1a
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (std::uint8_t byte : signature) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::uint64_t hash_signatures(const std::vector<std::vector<std::uint8_t>>& signatures,
+                              const std::vector<std::string>& regexes){
+    if (signatures.size() == 1 && regexes.empty()) return hash_signature(signatures.front());
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (const auto& signature : signatures) {
+        // the length goes in too, {ab, c} and {a, bc} are different sets
+        hash = (hash ^ hash_signature(signature) ^ signature.size()) * 1099511628211ULL;
+    }
+    for (const auto& regex : regexes) {
+        // ~ so a regex never hashes like the literal with the same bytes
+        hash = (hash ^ ~hash_signature(std::vector<std::uint8_t>(regex.begin(), regex.end())) ^ regex.size()) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool load_checkpoint(const fs::path& path, scan_checkpoint& checkpoint){
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::string magic;
+    if (!std::getline(in, magic) || magic != checkpoint_magic) return false;
+    if (!(in >> checkpoint.signature_hash) || in.get() != '\n') return false;
+    return read_string(in, checkpoint.root) && read_strings(in, checkpoint.done) && read_strings(in, checkpoint.hits);
+}
+
+bool save_checkpoint(const fs::path& path, const scan_checkpoint& checkpoint){
+    fs::path tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "could not write checkpoint file " << tmp.string() << "\n";
+            return false;
+        }
+        out << checkpoint_magic << "\n" << checkpoint.signature_hash << "\n";
+        write_string(out, checkpoint.root);
+        write_strings(out, checkpoint.done);
+        write_strings(out, checkpoint.hits);
+        out.flush();
+        if (!out) {
+            std::cerr << "could not write checkpoint file " << tmp.string() << "\n";
+            return false;
+        }
+    }
+    std::error_code error;
+    fs::rename(tmp, path, error);
+    if (error) {
+        std::cerr << "could not write checkpoint file " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
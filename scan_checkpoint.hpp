@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// where a scan stopped. scanner() walks every directory in sorted name order, so one path is
+// enough: everything up to and including `done` (a path relative to the root, as components,
+// with its whole subtree) has been scanned. a resumed scan only lists the directories on that path
+struct scan_checkpoint {
+    std::string root;                 // absolute, to refuse a checkpoint of another tree
+    std::uint64_t signature_hash = 0; // same for another signature
+    std::vector<std::string> done;
+    // hits of the scanned part, printed again on resume so the last run has the whole report
+    std::vector<std::string> hits;
+};
+
+std::uint64_t hash_signature(const std::vector<std::uint8_t>& signature);
+// a set of one hashes like its signature, so a --sigs file with one line resumes a plain scan.
+// regex signatures go in by their source text
+std::uint64_t hash_signatures(const std::vector<std::vector<std::uint8_t>>& signatures,
+                              const std::vector<std::string>& regexes = {});
+
+// false when the file is missing or not a checkpoint
+bool load_checkpoint(const fs::path& path, scan_checkpoint& checkpoint);
+
+// written next to path and renamed into place, a kill in the middle leaves the previous checkpoint
+bool save_checkpoint(const fs::path& path, const scan_checkpoint& checkpoint);
+
+// strings are written as "<length>\n<bytes>\n" so names with newlines survive, the summary file
+// (dir_summary.hpp) is written the same way. the readers are false on anything malformed
+void write_string(std::ostream& out, const std::string& text);
+void write_strings(std::ostream& out, const std::vector<std::string>& strings);
+bool read_count(std::istream& in, std::size_t& count, std::size_t limit);
+bool read_string(std::istream& in, std::string& text);
+bool read_strings(std::istream& in, std::vector<std::string>& strings);
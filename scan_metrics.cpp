@@ -0,0 +1,227 @@
+#include "scan_metrics.hpp"
+#include "huge_pages.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t phase_count = static_cast<std::size_t>(scan_phase::count);
+constexpr std::size_t counter_count = static_cast<std::size_t>(scan_counter::count);
+constexpr std::size_t error_count = static_cast<std::size_t>(scan_error::count);
+
+const char* const phase_names[phase_count] = {"dir_read", "stat", "open", "elf_check", "read", "search", "decompress", "throttle"};
+const char* const error_names[error_count] = {"not_file", "cant_open", "cant_read", "dir_iterate",
+                                              "decompression_bomb", "corrupt_compressed", "corrupt_archive",
+                                              "worker_crash", "timed_out"};
+
+// every thread writes only its own block, so an increment is a plain load+store and the
+// cache line never bounces. the exporter reads the blocks with relaxed loads
+struct thread_metrics {
+    std::atomic<std::uint64_t> phase_buckets[phase_count][metrics_bucket_count] = {};
+    std::atomic<std::uint64_t> phase_nanoseconds[phase_count] = {};
+    std::atomic<std::uint64_t> counters[counter_count] = {};
+    std::atomic<std::uint64_t> errors[error_count] = {};
+};
+
+void bump(std::atomic<std::uint64_t>& value, std::uint64_t amount){
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+std::atomic<bool> enabled{false};
+
+// blocks outlive their threads so nothing is lost when a worker exits before the export
+std::mutex registry_lock;
+std::vector<std::unique_ptr<thread_metrics>>& registry(){
+    static std::vector<std::unique_ptr<thread_metrics>> blocks;
+    return blocks;
+}
+
+thread_metrics& local_metrics(){
+    thread_local thread_metrics* local = nullptr;
+    if (!local) {
+        auto block = std::make_unique<thread_metrics>();
+        local = block.get();
+        std::lock_guard<std::mutex> guard(registry_lock);
+        registry().push_back(std::move(block));
+    }
+    return *local;
+}
+
+std::size_t bucket_for(std::uint64_t nanoseconds){
+    std::uint64_t bound = 1000;
+    for (std::size_t i = 0; i + 1 < metrics_bucket_count; ++i) {
+        if (nanoseconds <= bound) return i;
+        bound *= 4;
+    }
+    return metrics_bucket_count - 1;
+}
+
+std::string bucket_bound(std::size_t i){
+    if (i + 1 == metrics_bucket_count) return "+Inf";
+    double seconds = 1e-6;
+    for (std::size_t k = 0; k < i; ++k) seconds *= 4;
+    char text[32];
+    std::snprintf(text, sizeof(text), "%g", seconds);
+    return text;
+}
+
+} // namespace
+
+void enable_metrics(bool on){
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+bool metrics_enabled(){
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void record_phase(scan_phase phase, std::uint64_t nanoseconds){
+    if (!metrics_enabled()) return;
+    thread_metrics& local = local_metrics();
+    auto p = static_cast<std::size_t>(phase);
+    bump(local.phase_buckets[p][bucket_for(nanoseconds)], 1);
+    bump(local.phase_nanoseconds[p], nanoseconds);
+}
+
+void count_event(scan_counter counter, std::uint64_t amount){
+    if (!metrics_enabled()) return;
+    bump(local_metrics().counters[static_cast<std::size_t>(counter)], amount);
+}
+
+void count_error(scan_error error){
+    if (!metrics_enabled()) return;
+    bump(local_metrics().errors[static_cast<std::size_t>(error)], 1);
+}
+
+metrics_snapshot collect_metrics(){
+    metrics_snapshot snapshot;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (auto& block : registry()) {
+        for (std::size_t p = 0; p < phase_count; ++p) {
+            for (std::size_t b = 0; b < metrics_bucket_count; ++b) {
+                snapshot.phase_buckets[p][b] += block->phase_buckets[p][b].load(std::memory_order_relaxed);
+            }
+            snapshot.phase_nanoseconds[p] += block->phase_nanoseconds[p].load(std::memory_order_relaxed);
+        }
+        for (std::size_t c = 0; c < counter_count; ++c) {
+            snapshot.counters[c] += block->counters[c].load(std::memory_order_relaxed);
+        }
+        for (std::size_t e = 0; e < error_count; ++e) {
+            snapshot.errors[e] += block->errors[e].load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+bool write_metrics_file(const fs::path& path){
+    metrics_snapshot snapshot = collect_metrics();
+
+    fs::path tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out) {
+            std::cerr << "could not write metrics file " << tmp.string() << "\n";
+            return false;
+        }
+
+        out << "# HELP find_sig_phase_duration_seconds Time spent in each phase of the scan.\n";
+        out << "# TYPE find_sig_phase_duration_seconds histogram\n";
+        for (std::size_t p = 0; p < phase_count; ++p) {
+            std::uint64_t cumulative = 0;
+            for (std::size_t b = 0; b < metrics_bucket_count; ++b) {
+                cumulative += snapshot.phase_buckets[p][b];
+                out << "find_sig_phase_duration_seconds_bucket{phase=\"" << phase_names[p]
+                    << "\",le=\"" << bucket_bound(b) << "\"} " << cumulative << "\n";
+            }
+            out << "find_sig_phase_duration_seconds_sum{phase=\"" << phase_names[p] << "\"} "
+                << static_cast<double>(snapshot.phase_nanoseconds[p]) / 1e9 << "\n";
+            out << "find_sig_phase_duration_seconds_count{phase=\"" << phase_names[p] << "\"} "
+                << cumulative << "\n";
+        }
+
+        out << "# HELP find_sig_bytes_read_total Bytes read from scanned files.\n";
+        out << "# TYPE find_sig_bytes_read_total counter\n";
+        out << "find_sig_bytes_read_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::bytes_read)] << "\n";
+        out << "# HELP find_sig_bytes_decompressed_total Bytes produced by decompressing gzip/xz/zstd files.\n";
+        out << "# TYPE find_sig_bytes_decompressed_total counter\n";
+        out << "find_sig_bytes_decompressed_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::bytes_decompressed)] << "\n";
+        out << "# HELP find_sig_files_scanned_total Files whose header was checked.\n";
+        out << "# TYPE find_sig_files_scanned_total counter\n";
+        out << "find_sig_files_scanned_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::files_scanned)] << "\n";
+        out << "# HELP find_sig_files_skipped_non_elf_total Files skipped because they are not ELF.\n";
+        out << "# TYPE find_sig_files_skipped_non_elf_total counter\n";
+        out << "find_sig_files_skipped_non_elf_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::skipped_non_elf)] << "\n";
+        out << "# HELP find_sig_files_infected_total Files that contain the signature.\n";
+        out << "# TYPE find_sig_files_infected_total counter\n";
+        out << "find_sig_files_infected_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::infected)] << "\n";
+
+        out << "# HELP find_sig_regex_dfa_flushes_total Times a regex signature hit the dfa state limit and its states were rebuilt.\n";
+        out << "# TYPE find_sig_regex_dfa_flushes_total counter\n";
+        out << "find_sig_regex_dfa_flushes_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::regex_dfa_flushes)] << "\n";
+        out << "# HELP find_sig_entries_pruned_total Directory entries the walk skipped: excluded, not included, on another or a pseudo filesystem, symlink loops and special files. A directory counts once.\n";
+        out << "# TYPE find_sig_entries_pruned_total counter\n";
+        out << "find_sig_entries_pruned_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::entries_pruned)] << "\n";
+        out << "# HELP find_sig_files_unchanged_total Files not read because the directory summary vouched for them.\n";
+        out << "# TYPE find_sig_files_unchanged_total counter\n";
+        out << "find_sig_files_unchanged_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::files_unchanged)] << "\n";
+        out << "# HELP find_sig_dirs_unchanged_total Directories not listed because their times matched the directory summary.\n";
+        out << "# TYPE find_sig_dirs_unchanged_total counter\n";
+        out << "find_sig_dirs_unchanged_total " << snapshot.counters[static_cast<std::size_t>(scan_counter::dirs_unchanged)] << "\n";
+
+        huge_page_report huge = huge_page_coverage();
+        out << "# HELP find_sig_huge_page_capable_bytes Bytes of scan buffers and matcher tables allocated huge page capable.\n";
+        out << "# TYPE find_sig_huge_page_capable_bytes gauge\n";
+        out << "find_sig_huge_page_capable_bytes " << huge.bytes << "\n";
+        out << "# HELP find_sig_huge_page_backed_bytes Bytes of those actually backed by huge pages.\n";
+        out << "# TYPE find_sig_huge_page_backed_bytes gauge\n";
+        out << "find_sig_huge_page_backed_bytes{kind=\"hugetlb\"} " << huge.hugetlb_bytes << "\n";
+        out << "find_sig_huge_page_backed_bytes{kind=\"thp\"} " << huge.thp_bytes << "\n";
+
+        out << "# HELP find_sig_errors_total Scan errors by type.\n";
+        out << "# TYPE find_sig_errors_total counter\n";
+        for (std::size_t e = 0; e < error_count; ++e) {
+            out << "find_sig_errors_total{type=\"" << error_names[e] << "\"} " << snapshot.errors[e] << "\n";
+        }
+
+        if (!out) {
+            std::cerr << "could not write metrics file " << tmp.string() << "\n";
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::cerr << "could not move metrics file into place: " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+metrics_exporter::metrics_exporter(fs::path path, std::chrono::seconds interval)
+    : path(std::move(path)), interval(interval) {
+    enable_metrics(true);
+    if (interval.count() <= 0) return;
+    writer = std::thread([this]{
+        std::unique_lock<std::mutex> guard(lock);
+        while (!wake.wait_for(guard, this->interval, [this]{ return done; })) {
+            write_metrics_file(this->path);
+        }
+    });
+}
+
+metrics_exporter::~metrics_exporter(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+    }
+    wake.notify_all();
+    if (writer.joinable()) writer.join();
+    write_metrics_file(path);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// where the time of a scan goes, every phase gets a latency histogram
+enum class scan_phase { dir_read, stat, open, elf_check, read, search, decompress, throttle, count };
+
+enum class scan_counter { bytes_read, files_scanned, skipped_non_elf, infected, bytes_decompressed, regex_dfa_flushes,
+                          entries_pruned, files_unchanged, dirs_unchanged, count };
+
+// one per thrown error code (+ directory iteration failures, compressed files and archives given up on,
+// files that crashed an isolated scan worker or ran out of time)
+enum class scan_error { not_file, cant_open, cant_read, dir_iterate, decompression_bomb, corrupt_compressed,
+                        corrupt_archive, worker_crash, timed_out, count };
+
+// metrics are off unless a metrics file was asked for, every hook below is then a single branch
+void enable_metrics(bool on);
+bool metrics_enabled();
+
+void record_phase(scan_phase phase, std::uint64_t nanoseconds);
+void count_event(scan_counter counter, std::uint64_t amount = 1);
+void count_error(scan_error error);
+
+// times the enclosing block into the phase histogram
+class phase_timer {
+public:
+    explicit phase_timer(scan_phase phase) : phase(phase), active(metrics_enabled()) {
+        if (active) start = std::chrono::steady_clock::now();
+    }
+    ~phase_timer(){
+        if (!active) return;
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        record_phase(phase, static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+
+private:
+    scan_phase phase;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+// histogram upper bounds are 1us * 4^i, the last bucket is +Inf
+constexpr std::size_t metrics_bucket_count = 13;
+
+struct metrics_snapshot {
+    std::uint64_t phase_buckets[static_cast<std::size_t>(scan_phase::count)][metrics_bucket_count] = {};
+    std::uint64_t phase_nanoseconds[static_cast<std::size_t>(scan_phase::count)] = {};
+    std::uint64_t counters[static_cast<std::size_t>(scan_counter::count)] = {};
+    std::uint64_t errors[static_cast<std::size_t>(scan_error::count)] = {};
+};
+
+// sums the per thread blocks, never blocks the threads that are recording
+metrics_snapshot collect_metrics();
+
+// writes the prometheus text format next to path and renames it into place so the
+// node_exporter textfile collector never sees a half written file
+bool write_metrics_file(const fs::path& path);
+
+// rewrites the metrics file every interval (0 = only at the end) and once more when destroyed
+class metrics_exporter {
+public:
+    metrics_exporter(fs::path path, std::chrono::seconds interval);
+    ~metrics_exporter();
+    metrics_exporter(const metrics_exporter&) = delete;
+    metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+private:
+    fs::path path;
+    std::chrono::seconds interval;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool done = false;
+    std::thread writer;
+};
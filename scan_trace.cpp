@@ -0,0 +1,210 @@
+#include "scan_trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct trace_event {
+    std::uint64_t start;
+    std::uint64_t duration;
+    const char* name;
+    char detail[trace_detail_size];
+};
+
+// written only by its own thread, so recording a span is a copy into the next slot and
+// never takes a lock. when full the oldest spans are overwritten
+struct thread_ring {
+    std::vector<trace_event> events;
+    std::uint64_t written = 0;
+    unsigned tid = 0;
+    char name[32] = {};
+};
+
+std::atomic<bool> enabled{false};
+std::size_t ring_capacity = 1 << 16;
+std::chrono::steady_clock::time_point trace_start;
+
+std::mutex registry_lock;
+std::vector<std::unique_ptr<thread_ring>>& registry(){
+    static std::vector<std::unique_ptr<thread_ring>> rings;
+    return rings;
+}
+
+thread_ring& local_ring(){
+    thread_local thread_ring* local = nullptr;
+    if (!local) {
+        auto ring = std::make_unique<thread_ring>();
+        ring->events.resize(ring_capacity);
+        local = ring.get();
+        std::lock_guard<std::mutex> guard(registry_lock);
+        ring->tid = static_cast<unsigned>(registry().size() + 1);
+        std::snprintf(ring->name, sizeof(ring->name), "thread %u", ring->tid);
+        registry().push_back(std::move(ring));
+    }
+    return *local;
+}
+
+std::uint64_t now_ns(){
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_start).count());
+}
+
+// the length of the well formed utf-8 sequence at c, 0 when it is not one (overlong, surrogate,
+// past U+10FFFF, cut short)
+std::size_t utf8_length(const unsigned char* c){
+    std::size_t length;
+    unsigned char low = 0x80, high = 0xBF;
+    if (*c >= 0xC2 && *c <= 0xDF) length = 2;
+    else if (*c >= 0xE0 && *c <= 0xEF) {
+        length = 3;
+        if (*c == 0xE0) low = 0xA0;
+        if (*c == 0xED) high = 0x9F;
+    }
+    else if (*c >= 0xF0 && *c <= 0xF4) {
+        length = 4;
+        if (*c == 0xF0) low = 0x90;
+        if (*c == 0xF4) high = 0x8F;
+    }
+    else return 0;
+    if (c[1] < low || c[1] > high) return 0;
+    for (std::size_t i = 2; i < length; ++i) {
+        if (c[i] < 0x80 || c[i] > 0xBF) return 0;
+    }
+    return length;
+}
+
+// paths are arbitrary bytes: utf-8 goes through as it is, control characters and bytes that are
+// not utf-8 are escaped so the json stays valid
+void write_json_string(std::ostream& out, const char* text){
+    out << '"';
+    for (const unsigned char* c = reinterpret_cast<const unsigned char*>(text); *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            out << '\\' << *c;
+        }
+        else if (*c < 0x20 || *c == 0x7F) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out << escaped;
+        }
+        else if (*c < 0x80) {
+            out << *c;
+        }
+        else if (const std::size_t length = utf8_length(c)) {
+            out.write(reinterpret_cast<const char*>(c), static_cast<std::streamsize>(length));
+            c += length - 1;
+        }
+        else {
+            // a byte of its own, the closest json has is the code point of the same value
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            out << escaped;
+        }
+    }
+    out << '"';
+}
+
+// trace-event timestamps are microseconds, keep the nanoseconds as a fraction
+void write_micros(std::ostream& out, std::uint64_t ns){
+    char text[32];
+    std::snprintf(text, sizeof(text), "%llu.%03llu",
+                  static_cast<unsigned long long>(ns / 1000), static_cast<unsigned long long>(ns % 1000));
+    out << text;
+}
+
+} // namespace
+
+void enable_tracing(std::size_t events_per_thread){
+    ring_capacity = std::max<std::size_t>(events_per_thread, 1);
+    trace_start = std::chrono::steady_clock::now();
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+bool tracing_enabled(){
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void set_trace_thread_name(const char* name){
+    if (!tracing_enabled()) return;
+    thread_ring& ring = local_ring();
+    std::snprintf(ring.name, sizeof(ring.name), "%s", name);
+}
+
+trace_span::trace_span(const char* name, const char* detail)
+    : name(name), detail(detail), start(0) {
+    if (tracing_enabled()) start = now_ns() + 1; // 0 means "not recording"
+}
+
+trace_span::~trace_span(){
+    if (start == 0) return;
+    std::uint64_t end = now_ns();
+    thread_ring& ring = local_ring();
+    trace_event& event = ring.events[ring.written % ring.events.size()];
+    event.start = start - 1;
+    event.duration = end - event.start;
+    event.name = name;
+    if (detail) {
+        std::strncpy(event.detail, detail, trace_detail_size - 1);
+        event.detail[trace_detail_size - 1] = '\0';
+    }
+    else {
+        event.detail[0] = '\0';
+    }
+    ++ring.written;
+}
+
+bool write_trace_file(const fs::path& path){
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        std::cerr << "could not write trace file " << path.string() << "\n";
+        return false;
+    }
+
+    std::uint64_t dropped = 0;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"find_sig\"}}";
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (auto& ring : registry()) {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid << ",\"args\":{\"name\":";
+        write_json_string(out, ring->name);
+        out << "}}";
+
+        std::uint64_t capacity = ring->events.size();
+        std::uint64_t first = ring->written > capacity ? ring->written - capacity : 0;
+        dropped += first;
+        for (std::uint64_t i = first; i < ring->written; ++i) {
+            const trace_event& event = ring->events[i % capacity];
+            out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"scan\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+                << ",\"ts\":";
+            write_micros(out, event.start);
+            out << ",\"dur\":";
+            write_micros(out, event.duration);
+            if (event.detail[0]) {
+                out << ",\"args\":{\"detail\":";
+                write_json_string(out, event.detail);
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+
+    if (dropped) {
+        std::clog << "trace: " << dropped << " oldest spans were overwritten, raise the ring size to keep them" << "\n";
+    }
+    if (!out) {
+        std::cerr << "could not write trace file " << path.string() << "\n";
+        return false;
+    }
+    return true;
+}
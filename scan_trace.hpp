@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// records spans (directory listing, file, chunk, queue wait) into a ring buffer per thread
+// and writes them as chrome trace-event json (opens in perfetto / chrome://tracing).
+// the newest events_per_thread spans of every thread are kept
+void enable_tracing(std::size_t events_per_thread = 1 << 16);
+bool tracing_enabled();
+
+// name shown for the calling thread in the trace
+void set_trace_thread_name(const char* name);
+
+// name must be a string literal (only the pointer is stored), detail has to stay valid until
+// the span ends, it is then copied and cut at trace_detail_size - 1 bytes
+class trace_span {
+public:
+    trace_span(const char* name, const char* detail = nullptr);
+    ~trace_span();
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+private:
+    const char* name;
+    const char* detail;
+    std::uint64_t start;
+};
+
+constexpr std::size_t trace_detail_size = 112;
+
+// call once every recording thread is done (joined), returns false when the file can not be written
+bool write_trace_file(const fs::path& path);
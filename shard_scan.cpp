@@ -0,0 +1,627 @@
+#include "shard_scan.hpp"
+#include "file_stat.hpp"
+#include "path_filter.hpp"
+#include "scan_checkpoint.hpp"
+#include "tree_walk.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char shard_protocol[] = "find_sig shards 1";
+// a path or a hit name, and the paths of one piece
+constexpr std::size_t max_field = 1 << 20;
+constexpr std::size_t max_fields = 1 << 22;
+constexpr auto connect_patience = std::chrono::seconds(10);
+// a worker that had nothing to give is asked again after this
+constexpr auto split_retry = std::chrono::milliseconds(200);
+
+// messages are lists of strings, "<count>\n" and then each "<length>\n<bytes>\n" like the
+// checkpoint file. sends come from several threads, receives from one
+class shard_channel {
+public:
+    explicit shard_channel(int fd) : fd(fd) {}
+    ~shard_channel(){ ::close(fd); }
+    shard_channel(const shard_channel&) = delete;
+    shard_channel& operator=(const shard_channel&) = delete;
+
+    bool send(const std::vector<std::string>& message){
+        std::string out = std::to_string(message.size()) + "\n";
+        for (const auto& field : message) out += std::to_string(field.size()) + "\n" + field + "\n";
+        std::lock_guard<std::mutex> guard(sendLock);
+        for (std::size_t sent = 0; sent < out.size();) {
+            // MSG_NOSIGNAL: a peer that went away is an error here, not a SIGPIPE
+            ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    // blocks for the next message, false when the peer went away or sent something else
+    bool receive(std::vector<std::string>& message){
+        std::size_t count;
+        if (!read_count(count, max_fields) || count == 0) return false;
+        message.resize(count);
+        for (auto& field : message) {
+            std::size_t length;
+            if (!read_count(length, max_field)) return false;
+            field.clear();
+            while (field.size() < length) {
+                if (!fill()) return false;
+                const std::size_t take = std::min(length - field.size(), buffer.size() - begin);
+                field.append(buffer, begin, take);
+                begin += take;
+            }
+            char end;
+            if (!get(end) || end != '\n') return false;
+        }
+        return true;
+    }
+
+    // a receive blocked on another thread returns false
+    void shutdown(){
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+private:
+    bool fill(){
+        if (begin < buffer.size()) return true;
+        buffer.resize(64 * 1024);
+        ssize_t n;
+        do {
+            n = ::recv(fd, &buffer[0], buffer.size(), 0);
+        } while (n < 0 && errno == EINTR);
+        buffer.resize(n > 0 ? static_cast<std::size_t>(n) : 0);
+        begin = 0;
+        return n > 0;
+    }
+
+    bool get(char& c){
+        if (!fill()) return false;
+        c = buffer[begin++];
+        return true;
+    }
+
+    bool read_count(std::size_t& value, std::size_t limit){
+        value = 0;
+        std::size_t digits = 0;
+        for (char c; get(c);) {
+            if (c == '\n') return digits > 0 && value <= limit;
+            if (c < '0' || c > '9' || ++digits > 12) return false;
+            value = value * 10 + static_cast<std::size_t>(c - '0');
+        }
+        return false;
+    }
+
+    int fd;
+    std::mutex sendLock;
+    std::string buffer;
+    std::size_t begin = 0;
+};
+
+// unix:/path or host:port ([v6]:port, an empty host listens on all addresses). -1 on failure
+int open_socket(const std::string& address, bool listening){
+    if (address.compare(0, 5, "unix:") == 0) {
+        const std::string path = address.substr(5);
+        sockaddr_un socketAddress = {};
+        socketAddress.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(socketAddress.sun_path)) return -1;
+        path.copy(socketAddress.sun_path, path.size());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        const sockaddr* generic = reinterpret_cast<const sockaddr*>(&socketAddress);
+        if (listening) {
+            // left behind by an earlier coordinator
+            ::unlink(path.c_str());
+            if (::bind(fd, generic, sizeof(socketAddress)) == 0 && ::listen(fd, 64) == 0) return fd;
+        }
+        else if (::connect(fd, generic, sizeof(socketAddress)) == 0) {
+            return fd;
+        }
+        ::close(fd);
+        return -1;
+    }
+
+    const std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos) return -1;
+    std::string host = address.substr(0, colon);
+    const std::string port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* found = nullptr;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+    int fd = -1;
+    for (addrinfo* candidate = found; candidate && fd < 0; candidate = candidate->ai_next) {
+        fd = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+        if (fd < 0) continue;
+        int on = 1;
+        bool ok;
+        if (listening) {
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            ok = ::bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && ::listen(fd, 64) == 0;
+        }
+        else {
+            ok = ::connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0;
+            // requests and pieces are small and answered right away
+            if (ok) ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        if (!ok) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(found);
+    return fd;
+}
+
+struct shard {
+    std::vector<std::string> paths; // below the root, "" is the root itself
+    std::uint64_t estimate = 0;
+};
+
+// how much is below a directory, only to compare directories with each other: ext4 and xfs
+// directories grow with their entries and have 2 + subdirectories links
+std::uint64_t directory_estimate(const file_stat& info){
+    const std::uint64_t subdirectories = info.links > 2 ? info.links - 2 : 0;
+    return (info.size / 32 + 1) * (subdirectories + 1);
+}
+
+// biggest first, the ones handed out first
+void add_shard(std::deque<shard>& queue, shard&& piece){
+    auto at = std::find_if(queue.begin(), queue.end(),
+                           [&](const shard& queued) { return queued.estimate < piece.estimate; });
+    queue.insert(at, std::move(piece));
+}
+
+// lists the directories with the biggest estimate until there are about target pieces. excluded
+// entries are left out here already, whether to enter another filesystem the workers decide
+std::deque<shard> partition(const fs::path& root, const scan_options& options, std::size_t target){
+    std::deque<shard> shards;
+    file_stat info;
+    if (stat_path(root.c_str(), STATX_TYPE | STATX_SIZE | STATX_NLINK, stat_sync::cached, info) != 0
+        || !S_ISDIR(info.mode)) {
+        shards.push_back({{std::string()}, 1});
+        return shards;
+    }
+
+    struct candidate {
+        std::string relative;
+        std::uint64_t estimate;
+        dev_t device;
+        bool operator<(const candidate& other) const { return estimate < other.estimate; }
+    };
+    std::priority_queue<candidate> open;
+    open.push({std::string(), directory_estimate(info), info.device});
+    const path_filter filter(options.exclude, options.include);
+
+    while (!open.empty() && shards.size() + open.size() < target) {
+        const candidate directory = open.top();
+        open.pop();
+        const fs::path path = directory.relative.empty() ? root : root / directory.relative;
+        const std::string prefix = directory.relative.empty() ? directory.relative : directory.relative + "/";
+
+        std::vector<std::pair<std::string, bool>> entries; // name, a directory (not through a symlink)
+        std::error_code error;
+        for (fs::directory_iterator it(path, error), end; !error && it != end; it.increment(error)) {
+            std::error_code typeError;
+            entries.emplace_back(it->path().filename().string(), it->is_directory(typeError) && !it->is_symlink(typeError));
+        }
+        if (error) {
+            // the worker that gets it runs into the same error and reports it
+            shards.push_back({{directory.relative}, directory.estimate});
+            continue;
+        }
+        std::sort(entries.begin(), entries.end());
+
+        shard files;
+        for (const auto& [name, isDirectory] : entries) {
+            const std::string relative = prefix + name;
+            if (filter.excluded(relative, name)) continue;
+            file_stat child;
+            if (!isDirectory
+                || stat_path((path / name).c_str(), STATX_TYPE | STATX_SIZE | STATX_NLINK, stat_sync::cached, child) != 0) {
+                files.paths.push_back(relative);
+            }
+            else if (child.device != directory.device) {
+                shards.push_back({{relative}, directory_estimate(child)});
+            }
+            else {
+                open.push({relative, directory_estimate(child), child.device});
+            }
+        }
+        if (!files.paths.empty()) {
+            files.estimate = files.paths.size();
+            shards.push_back(std::move(files));
+        }
+    }
+    for (; !open.empty(); open.pop()) shards.push_back({{open.top().relative}, open.top().estimate});
+    std::stable_sort(shards.begin(), shards.end(),
+                     [](const shard& a, const shard& b) { return a.estimate > b.estimate; });
+    return shards;
+}
+
+// the paths of a piece without the ones below it that its worker gave away: a directory on the way
+// to a given path is listed and its other entries are taken instead
+void subtract_given(const fs::path& root, const std::string& relative, const std::vector<std::string>& given,
+                    std::vector<std::string>& rest){
+    if (std::find(given.begin(), given.end(), relative) != given.end()) return;
+    const std::string prefix = relative.empty() ? relative : relative + "/";
+    const bool givenBelow = std::any_of(given.begin(), given.end(), [&](const std::string& path) {
+        return path.size() > prefix.size() && path.compare(0, prefix.size(), prefix) == 0;
+    });
+    if (!givenBelow) {
+        rest.push_back(relative);
+        return;
+    }
+    const fs::path path = relative.empty() ? root : root / relative;
+    std::vector<std::string> names;
+    std::error_code error;
+    for (fs::directory_iterator it(path, error), end; !error && it != end; it.increment(error)) {
+        names.push_back(it->path().filename().string());
+    }
+    if (error) {
+        // whoever walks it runs into the same error and reports it
+        rest.push_back(relative);
+        return;
+    }
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) subtract_given(root, prefix + name, given, rest);
+}
+
+struct worker_slot {
+    std::shared_ptr<shard_channel> channel;
+    bool greeted = false;
+    // has a piece and has not asked for the next one
+    bool busy = false;
+    bool splitAsked = false;
+    bool saidBye = false;
+    std::chrono::steady_clock::time_point busySince;
+    std::chrono::steady_clock::time_point refusedAt;
+    // handed out and not confirmed by a bye yet, a worker may still be scanning files of a piece
+    // after it asked for the next
+    std::vector<shard> assigned;
+    // paths below the assigned pieces it split off for others
+    std::vector<std::string> donated;
+    // told done, it takes none of the pieces of a worker that goes away later
+    bool dismissed = false;
+};
+
+struct coordinator_state {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<shard> queue;
+    std::vector<std::shared_ptr<worker_slot>> workers;
+    bool failed = false;
+    std::string failure;
+
+    bool anyone_busy() const {
+        return std::any_of(workers.begin(), workers.end(), [](const auto& worker) { return worker->busy; });
+    }
+
+    bool finished() const {
+        return failed || (queue.empty() && std::none_of(workers.begin(), workers.end(), [](const auto& worker) {
+            return worker->busy || !worker->assigned.empty();
+        }));
+    }
+
+    // the worker that has been on its piece the longest gives part of it to the idle ones
+    void ask_split(){
+        const auto now = std::chrono::steady_clock::now();
+        std::shared_ptr<worker_slot> victim;
+        for (const auto& worker : workers) {
+            if (!worker->busy || worker->splitAsked || now - worker->refusedAt < split_retry) continue;
+            if (!victim || worker->busySince < victim->busySince) victim = worker;
+        }
+        if (victim && victim->channel->send({"split"})) victim->splitAsked = true;
+    }
+};
+
+void serve_worker(coordinator_state& state, const std::shared_ptr<worker_slot>& worker, const std::string& absoluteRoot,
+                  const fs::path& root, std::uint64_t signatureHash){
+    shard_channel& channel = *worker->channel;
+    std::vector<std::string> message;
+    if (!channel.receive(message) || message.size() != 3 || message[0] != "hello" || message[1] != shard_protocol) {
+        channel.shutdown();
+    }
+    else if (message[2] != std::to_string(signatureHash)) {
+        channel.send({"refused", "the worker has other signatures"});
+    }
+    else if (channel.send({"root", absoluteRoot})) {
+        {
+            std::lock_guard<std::mutex> guard(state.lock);
+            worker->greeted = true;
+        }
+        while (channel.receive(message)) {
+            const std::string& kind = message[0];
+            std::unique_lock<std::mutex> guard(state.lock);
+            if (kind == "hit" && message.size() == 2) {
+                // hits come under the absolute root, they are printed under the root as given
+                std::string name = message[1];
+                if (name.compare(0, absoluteRoot.size(), absoluteRoot) == 0) {
+                    const std::size_t start = name.find_first_not_of('/', absoluteRoot.size());
+                    name = start == std::string::npos ? root.string() : (root / name.substr(start)).string();
+                }
+                std::cout << name << " is infected!" << "\n";
+            }
+            else if (kind == "donated") {
+                worker->splitAsked = false;
+                if (message.size() == 1) {
+                    worker->refusedAt = std::chrono::steady_clock::now();
+                }
+                else {
+                    shard piece;
+                    piece.paths.assign(message.begin() + 1, message.end());
+                    worker->donated.insert(worker->donated.end(), piece.paths.begin(), piece.paths.end());
+                    piece.estimate = piece.paths.size();
+                    add_shard(state.queue, std::move(piece));
+                }
+                state.changed.notify_all();
+            }
+            else if (kind == "next") {
+                worker->busy = false;
+                state.changed.notify_all();
+                for (;;) {
+                    if (!state.queue.empty() && !state.failed) {
+                        shard piece = std::move(state.queue.front());
+                        state.queue.pop_front();
+                        std::vector<std::string> reply = {"shard"};
+                        reply.insert(reply.end(), piece.paths.begin(), piece.paths.end());
+                        worker->busy = true;
+                        worker->busySince = std::chrono::steady_clock::now();
+                        worker->assigned.push_back(std::move(piece));
+                        channel.send(reply);
+                        break;
+                    }
+                    if (state.failed || !state.anyone_busy()) {
+                        worker->dismissed = true;
+                        channel.send({"done"});
+                        break;
+                    }
+                    state.ask_split();
+                    state.changed.wait_for(guard, split_retry);
+                }
+            }
+            else if (kind == "failed" && message.size() == 2) {
+                state.failed = true;
+                state.failure = message[1];
+                state.changed.notify_all();
+            }
+            else if (kind == "bye") {
+                worker->assigned.clear();
+                worker->donated.clear();
+                worker->saidBye = true;
+                break;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(state.lock);
+    if (!worker->saidBye && !worker->assigned.empty()) {
+        // what it gave away is someone else's now
+        for (const auto& piece : worker->assigned) {
+            shard rest;
+            for (const auto& path : piece.paths) subtract_given(root, path, worker->donated, rest.paths);
+            rest.estimate = rest.paths.size();
+            if (!rest.paths.empty()) add_shard(state.queue, std::move(rest));
+        }
+        std::cerr << "lost a worker, its pieces are scanned again" << "\n";
+        // the others were told done and will not ask again
+        const bool taker = std::any_of(state.workers.begin(), state.workers.end(), [&](const auto& other) {
+            return other != worker && !other->dismissed;
+        });
+        if (!taker && !state.failed) {
+            state.failed = true;
+            state.failure = "lost a worker and nobody is left to scan its pieces";
+        }
+    }
+    state.workers.erase(std::find(state.workers.begin(), state.workers.end(), worker));
+    state.changed.notify_all();
+}
+
+} // namespace
+
+void shard_coordinator(const fs::path& root, const std::string& address, const signature_list& signatures,
+                       const scan_options& options, std::size_t shards){
+    const int listening = open_socket(address, true);
+    if (listening < 0) {
+        std::cerr << "could not listen on " << address << "\n";
+        throw CANT_OPEN;
+    }
+    const std::uint64_t signatureHash = hash_signatures(signatures.literals, signatures.regexes);
+    const std::string absoluteRoot = fs::absolute(root).lexically_normal().string();
+
+    coordinator_state state;
+    state.queue = partition(root, options, std::max<std::size_t>(shards, 1));
+
+    std::vector<std::thread> serving;
+    std::thread accepting([&] {
+        for (;;) {
+            int fd = ::accept4(listening, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            auto worker = std::make_shared<worker_slot>();
+            worker->channel = std::make_shared<shard_channel>(fd);
+            std::lock_guard<std::mutex> guard(state.lock);
+            state.workers.push_back(worker);
+            serving.emplace_back(serve_worker, std::ref(state), worker, std::cref(absoluteRoot), std::cref(root),
+                                 signatureHash);
+        }
+    });
+
+    {
+        std::unique_lock<std::mutex> guard(state.lock);
+        state.changed.wait(guard, [&] { return state.finished(); });
+        // idle workers are told done by their own thread, workers that never said hello and, after
+        // a failure, the busy ones are cut off
+        for (const auto& worker : state.workers) {
+            if (!worker->greeted || state.failed) worker->channel->shutdown();
+        }
+    }
+    ::shutdown(listening, SHUT_RDWR);
+    accepting.join();
+    ::close(listening);
+    for (auto& thread : serving) thread.join();
+    if (address.compare(0, 5, "unix:") == 0) ::unlink(address.c_str() + 5);
+
+    if (state.failed) {
+        std::cerr << "a worker failed: " << state.failure << "\n";
+        throw CANT_READ;
+    }
+}
+
+void shard_worker(const std::string& address, const signature_list& signatures, const scan_options& options){
+    const auto deadline = std::chrono::steady_clock::now() + connect_patience;
+    int fd;
+    while ((fd = open_socket(address, false)) < 0) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            std::cerr << "could not connect to " << address << "\n";
+            throw CANT_OPEN;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    shard_channel channel(fd);
+    const std::uint64_t signatureHash = hash_signatures(signatures.literals, signatures.regexes);
+    std::vector<std::string> message;
+    const bool answered = channel.send({"hello", shard_protocol, std::to_string(signatureHash)})
+                          && channel.receive(message);
+    if (!answered || message.size() != 2 || message[0] != "root") {
+        // a coordinator that is done or shutting down just hangs up
+        if (answered && message.size() == 2 && message[0] == "refused") {
+            std::cerr << "the coordinator at " << address << " refused this worker: " << message[1] << "\n";
+        }
+        else if (answered) {
+            std::cerr << "the coordinator at " << address << " sent something else than a root" << "\n";
+        }
+        else {
+            std::cerr << "the coordinator at " << address << " closed the connection" << "\n";
+        }
+        throw CANT_READ;
+    }
+    tree_walk walk(message[1], signatures, options);
+
+    // the reader thread takes the coordinator's messages, the walk takes paths from the piece
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::string> paths;
+    bool asked = false;
+    bool done = false;
+    bool lost = false;
+    std::atomic<bool> splitWanted{false};
+
+    // the paths of the piece not started yet are the cheapest to give away
+    auto give_paths = [&] {
+        std::vector<std::string> reply = {"donated"};
+        const std::size_t count = (paths.size() + 1) / 2;
+        reply.insert(reply.end(), std::make_move_iterator(paths.end() - count), std::make_move_iterator(paths.end()));
+        paths.erase(paths.end() - count, paths.end());
+        channel.send(reply);
+    };
+
+    std::thread reader([&] {
+        std::vector<std::string> incoming;
+        while (channel.receive(incoming)) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (incoming[0] == "shard") {
+                paths.assign(incoming.begin() + 1, incoming.end());
+                asked = false;
+            }
+            else if (incoming[0] == "split") {
+                if (!paths.empty()) give_paths();
+                else splitWanted = true;
+            }
+            else if (incoming[0] == "done") {
+                done = true;
+                changed.notify_all();
+                return;
+            }
+            changed.notify_all();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        lost = true;
+        changed.notify_all();
+    });
+
+    walk.set_source([&](std::string& path) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            // asked while between pieces
+            if (splitWanted.exchange(false)) give_paths();
+            if (!paths.empty()) {
+                path = std::move(paths.front());
+                paths.pop_front();
+                return true;
+            }
+            if (done || lost) return false;
+            if (!asked) {
+                asked = true;
+                channel.send({"next"});
+            }
+            changed.wait(guard);
+        }
+    });
+    walk.set_hit_sink([&](const std::string& name) { channel.send({"hit", name}); });
+    walk.set_splitter(splitWanted, [&](std::vector<std::string>&& given) {
+        std::vector<std::string> reply = {"donated"};
+        reply.insert(reply.end(), std::make_move_iterator(given.begin()), std::make_move_iterator(given.end()));
+        channel.send(reply);
+    });
+
+    auto fail = [&](const std::string& what) {
+        channel.send({"failed", what});
+        channel.shutdown();
+        reader.join();
+    };
+    try {
+        scan_walk(walk, signatures, options);
+    }
+    catch (const fs::filesystem_error& error) {
+        // a directory that cannot be listed, thrown on as the int codes the callers catch
+        std::cerr << error.what() << "\n";
+        fail(error.what());
+        throw CANT_READ;
+    }
+    catch (int code) {
+        fail("error " + std::to_string(code));
+        throw;
+    }
+
+    bool coordinatorLost;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        coordinatorLost = lost;
+    }
+    if (!coordinatorLost) channel.send({"bye"});
+    channel.shutdown();
+    reader.join();
+    if (coordinatorLost) {
+        std::cerr << "lost the coordinator at " << address << "\n";
+        throw CANT_READ;
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#include "file_scanner.hpp"
+
+// pieces the coordinator cuts the tree into up front, more are split off the workers at the end
+constexpr std::size_t default_shards = 256;
+
+// a scan spread over processes and hosts that all see the tree under the same path. address is
+// unix:/path/of/socket or host:port (tcp, without authentication: for a trusted network).
+//
+// the coordinator lists the top of the tree until it has about shards pieces, always expanding
+// the directory with the biggest estimate (from its size and link count): the files of a listed
+// directory make one piece, each subdirectory another. workers get the biggest piece left first.
+// once none are left and a worker asks for more, the coordinator asks a busy worker to split:
+// it gives back the later half of the entries it has not started in its shallowest directory.
+// hits are printed as they come in, "<path> is infected!" with the coordinator's root. the pieces
+// of a worker that goes away before it is done are handed out again without what it split off
+// for others (the hits it had found in them are reported again). when the other workers were all
+// told done already, or a worker fails (an unreadable file, like the plain scan), the scan ends.
+// returns when everything is scanned, throws CANT_OPEN when it cannot listen on address and
+// CANT_READ when a worker failed or was lost that way
+void shard_coordinator(const fs::path& root, const std::string& address, const signature_list& signatures,
+                       const scan_options& options, std::size_t shards = default_shards);
+
+// a worker: connects to the coordinator (retrying for a while, so both can be started together)
+// and scans what it is given with options (threads, io_uring, filters, ...), which should be the
+// coordinator's. throws CANT_OPEN when it cannot connect, CANT_READ when the coordinator refuses
+// it (other signatures), hangs up or goes away, or a directory cannot be listed, and whatever else
+// the scan throws
+void shard_worker(const std::string& address, const signature_list& signatures, const scan_options& options);
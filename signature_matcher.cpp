@@ -0,0 +1,198 @@
+#include "signature_matcher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+template <typename Word>
+inline Word load(const std::uint8_t* p){
+    Word w;
+    std::memcpy(&w, p, sizeof(Word)); // a single unaligned load after inlining
+    return w;
+}
+
+// the pattern as a handful of machine words. N bytes are covered by overlapping words of
+// the widest size that fits (e.g. 13 bytes = 8 at offset 0 + 8 at offset 5), so comparing a
+// candidate is a fixed number of loads and compares with no loop over bytes
+template <std::size_t N>
+struct fixed_pattern {
+    using word = std::conditional_t<(N >= 8), std::uint64_t,
+                 std::conditional_t<(N >= 4), std::uint32_t,
+                 std::conditional_t<(N >= 2), std::uint16_t, std::uint8_t>>>;
+    static constexpr std::size_t width = sizeof(word);
+    static constexpr std::size_t count = (N + width - 1) / width;
+
+    static constexpr std::size_t offset(std::size_t k){
+        return std::min(k * width, N - width);
+    }
+
+    std::array<word, count> words;
+
+    explicit fixed_pattern(const std::uint8_t* pattern){
+        for (std::size_t k = 0; k < count; ++k) words[k] = load<word>(pattern + offset(k));
+    }
+
+    template <std::size_t... K>
+    bool equal(const std::uint8_t* p, std::index_sequence<K...>) const {
+        return ((load<word>(p + offset(K)) == words[K]) && ...);
+    }
+
+    bool equal(const std::uint8_t* p) const {
+        return equal(p, std::make_index_sequence<count>{});
+    }
+};
+
+// memchr (vectorized in libc) jumps to the next occurrence of the anchor byte, then the
+// whole candidate is checked with the fixed width compare
+template <std::size_t N>
+const std::uint8_t* find_fixed(const std::uint8_t* first, const std::uint8_t* last,
+                               const std::uint8_t* pattern, std::size_t anchor){
+    if (static_cast<std::size_t>(last - first) < N) return last;
+    const fixed_pattern<N> words(pattern);
+    const std::uint8_t anchor_byte = pattern[anchor];
+    const std::uint8_t* final_start = last - N; // last position a match can start at
+
+    const std::uint8_t* scan = first + anchor;
+    const std::uint8_t* scan_end = final_start + anchor + 1;
+    while (scan < scan_end) {
+        auto* hit = static_cast<const std::uint8_t*>(std::memchr(scan, anchor_byte, scan_end - scan));
+        if (!hit) return last;
+        const std::uint8_t* candidate = hit - anchor;
+        if (words.equal(candidate)) return candidate;
+        scan = hit + 1;
+    }
+    return last;
+}
+
+template <std::size_t... I>
+constexpr std::array<signature_matcher::fixed_finder, sizeof...(I)> make_finders(std::index_sequence<I...>){
+    return {&find_fixed<I + 1>...};
+}
+
+constexpr auto fixed_finders = make_finders(std::make_index_sequence<max_fixed_signature>{});
+
+// rough rank of how common a byte is in x86-64 code and data, lower is more common
+// (padding, 0xff fill, rex prefixes, mov/lea/call opcodes, ascii)
+int byte_commonness(std::uint8_t b){
+    switch (b) {
+        case 0x00: return 0;
+        case 0xFF: return 1;
+        case 0x48: case 0x8B: case 0x89: case 0x0F: return 2;
+        case 0x24: case 0x44: case 0x4C: case 0xE8: case 0x8D: case 0x01: return 3;
+        default: break;
+    }
+    if (b >= 0x20 && b < 0x7F) return 4;
+    return 5;
+}
+
+} // namespace
+
+signature_matcher::signature_matcher(const std::vector<std::uint8_t>& signature)
+    : pattern(signature), longest(signature.size()) {
+    if (pattern.empty()) return;
+    if (pattern.size() <= max_fixed_signature) {
+        fixed = fixed_finders[pattern.size() - 1];
+        for (std::size_t i = 1; i < pattern.size(); ++i) {
+            if (byte_commonness(pattern[i]) > byte_commonness(pattern[anchor])) anchor = i;
+        }
+        return;
+    }
+    searcher = std::make_unique<long_searcher>(pattern.begin(), pattern.end());
+}
+
+signature_matcher::signature_matcher(const signature_set& signatures)
+    : signature_matcher(signatures.size() == 1 ? signatures.front() : std::vector<std::uint8_t>()) {
+    if (signatures.size() == 1) return;
+    multiple = true;
+
+    std::size_t total = 0;
+    for (const auto& signature : signatures) {
+        total += signature.size();
+        longest = std::max(longest, signature.size());
+    }
+    if (signatures.size() < prefilter_min_signatures && total < prefilter_min_bytes) {
+        for (const auto& signature : signatures) each.emplace_back(signature);
+        return;
+    }
+
+    const std::size_t gram = signature_prefilter::gram_for(signatures);
+    signature_set longer;
+    for (const auto& signature : signatures) {
+        if (signature.size() < gram) each.emplace_back(signature);
+        else longer.push_back(signature);
+    }
+    prefilter = std::make_unique<signature_prefilter>(longer);
+}
+
+signature_matcher::signature_matcher(const signature_list& signatures)
+    : signature_matcher(signatures.literals) {
+    for (const auto& regex : signatures.regexes) compiled.emplace_back(regex);
+}
+
+const std::uint8_t* signature_matcher::find(const std::uint8_t* first, const std::uint8_t* last) const {
+    if (multiple) {
+        const std::uint8_t* best = prefilter ? prefilter->find(first, last) : last;
+        for (const auto& matcher : each) {
+            // only an earlier match matters, it may still end past best
+            const std::uint8_t* end = last;
+            if (best != last && matcher.size() > 0) {
+                end = best + std::min<std::size_t>(matcher.size() - 1, last - best);
+            }
+            const std::uint8_t* hit = matcher.find(first, end);
+            if (hit != end) best = hit;
+        }
+        return best;
+    }
+    if (pattern.empty()) return first;
+    if (fixed) return fixed(first, last, pattern.data(), anchor);
+
+    return (*searcher)(first, last).first;
+}
+
+stream_matcher::stream_matcher(const signature_matcher& matcher)
+    : matcher(matcher), regexes(matcher.regexes().begin(), matcher.regexes().end()) {
+    hit = matcher.matches_everything();
+    for (const auto& regex : regexes) hit |= regex.found();
+}
+
+void stream_matcher::reset(){
+    tail.clear();
+    hit = matcher.matches_everything();
+    for (auto& regex : regexes) {
+        regex.reset();
+        hit |= regex.found();
+    }
+}
+
+bool stream_matcher::feed(const std::uint8_t* data, std::size_t length){
+    if (hit || length == 0) return hit;
+    for (auto& regex : regexes) {
+        if (regex.feed(data, length)) return hit = true;
+    }
+    if (matcher.size() == 0) return false;
+    const std::size_t keep = matcher.size() - 1;
+
+    // matches that start in the kept tail and end in the new data
+    if (!tail.empty()) {
+        joint.assign(tail.begin(), tail.end());
+        joint.insert(joint.end(), data, data + std::min(length, keep));
+        if (matcher.find(joint.data(), joint.data() + joint.size()) != joint.data() + joint.size()) {
+            return hit = true;
+        }
+    }
+    if (matcher.find(data, data + length) != data + length) {
+        return hit = true;
+    }
+
+    if (length >= keep) {
+        tail.assign(data + length - keep, data + length);
+    }
+    else {
+        tail.insert(tail.end(), data, data + length);
+        if (tail.size() > keep) tail.erase(tail.begin(), tail.end() - keep);
+    }
+    return false;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "byte_regex.hpp"
+#include "signature_prefilter.hpp"
+
+// longest signature that gets a length specialized matcher, longer ones use boyer-moore
+constexpr std::size_t max_fixed_signature = 32;
+
+// several signatures searched at once (find_sig --sigs)
+using signature_set = std::vector<std::vector<std::uint8_t>>;
+
+// what a --sigs list holds: byte signatures and /regex/ lines (byte_regex.hpp syntax)
+struct signature_list {
+    signature_set literals;
+    std::vector<std::string> regexes;
+};
+
+// a set with at least this many signatures, or this many bytes of them, is searched through
+// signature_prefilter. smaller sets are searched signature by signature
+constexpr std::size_t prefilter_min_signatures = 16;
+constexpr std::size_t prefilter_min_bytes = 4096;
+
+// finds one signature in memory. built once per scan: for 1-32 byte signatures it picks a
+// matcher instantiated for that exact length (pattern kept in a few 64 bit words, candidates
+// compared with fixed width loads), for longer ones the boyer-moore tables are built once
+// instead of for every file
+class signature_matcher {
+public:
+    explicit signature_matcher(const std::vector<std::uint8_t>& signature);
+    // any of the signatures, a set of one is the same as the constructor above
+    explicit signature_matcher(const signature_set& signatures);
+    // the literals as above, the regexes are compiled here (throws std::invalid_argument) and
+    // only searched by stream_matcher and contains_signature, not by find()
+    explicit signature_matcher(const signature_list& signatures);
+
+    // first occurrence in [first, last), last when there is none
+    const std::uint8_t* find(const std::uint8_t* first, const std::uint8_t* last) const;
+
+    // the longest signature, a match can span that many bytes
+    std::size_t size() const { return longest; }
+    const std::vector<std::uint8_t>& bytes() const { return pattern; }
+    // the lone empty signature, found everywhere
+    bool matches_everything() const { return !multiple && pattern.empty(); }
+    const std::vector<byte_regex>& regexes() const { return compiled; }
+
+    using fixed_finder = const std::uint8_t* (*)(const std::uint8_t* first, const std::uint8_t* last,
+                                                 const std::uint8_t* pattern, std::size_t anchor);
+
+private:
+    using long_searcher = std::boyer_moore_searcher<std::vector<std::uint8_t>::const_iterator>;
+
+    std::vector<std::uint8_t> pattern;
+    fixed_finder fixed = nullptr;
+    // position of the byte handed to memchr, the least common one in typical binaries
+    std::size_t anchor = 0;
+    std::unique_ptr<long_searcher> searcher;
+
+    // a set: the signatures searched one by one (all of them, or the ones too short for the
+    // prefilter's grams) and the prefilter for the rest
+    bool multiple = false;
+    std::size_t longest = 0;
+    std::vector<signature_matcher> each;
+    std::unique_ptr<signature_prefilter> prefilter;
+    std::vector<byte_regex> compiled;
+};
+
+// searches a stream that arrives in pieces of any size (decompressed output, archive members).
+// the last size()-1 bytes are kept so a match split between two pieces is still found, the
+// regexes carry their dfa state from piece to piece
+class stream_matcher {
+public:
+    explicit stream_matcher(const signature_matcher& matcher);
+
+    // returns true once the signature was seen, later calls do nothing
+    bool feed(const std::uint8_t* data, std::size_t length);
+    bool found() const { return hit; }
+    void reset();
+
+private:
+    const signature_matcher& matcher;
+    std::vector<std::uint8_t> tail;
+    std::vector<std::uint8_t> joint;
+    std::vector<byte_regex_stream> regexes;
+    bool hit = false;
+};
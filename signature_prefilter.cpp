@@ -0,0 +1,118 @@
+#include "signature_prefilter.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace {
+
+// shifts are kept in a byte, a longer window would not shift further anyway on real data
+constexpr std::size_t max_window = 255;
+// past this many signatures the 2 byte grams run out (65536 of them)
+constexpr std::size_t big_set = 2048;
+constexpr unsigned bloom_bits_per_signature = 16;
+
+} // namespace
+
+std::size_t signature_prefilter::gram_for(const std::vector<std::vector<std::uint8_t>>& signatures){
+    return signatures.size() > big_set ? 3 : 2;
+}
+
+signature_prefilter::signature_prefilter(const std::vector<std::vector<std::uint8_t>>& signatures)
+    : gram(gram_for(signatures)) {
+    window = max_window;
+    for (const auto& signature : signatures) window = std::min(window, signature.size());
+    if (signatures.empty() || window < gram) {
+        window = 0; // nothing to find, or a caller that did not split off the short ones
+        return;
+    }
+    prefix = std::min<std::size_t>(window, 8);
+
+    // shift for a gram = how far its rightmost occurrence in any window sized prefix is from the
+    // window's end, grams in no prefix let the window jump past them
+    shiftBits = gram == 2 ? 16 : 20;
+    shift.assign(std::size_t(1) << shiftBits, static_cast<std::uint8_t>(window - gram + 1));
+    for (const auto& signature : signatures) {
+        for (std::size_t end = gram - 1; end < window; ++end) {
+            std::uint8_t& entry = shift[hash_gram(signature.data() + end + 1 - gram)];
+            entry = std::min<std::uint8_t>(entry, static_cast<std::uint8_t>(window - 1 - end));
+        }
+    }
+
+    while ((std::uint64_t(1) << candidateBits) < signatures.size() * bloom_bits_per_signature && candidateBits < 32) {
+        ++candidateBits;
+    }
+    candidates.assign((std::size_t(1) << candidateBits) / 64, 0);
+
+    std::vector<std::uint32_t> order(signatures.size());
+    std::vector<std::uint64_t> unsorted(signatures.size());
+    for (std::size_t i = 0; i < signatures.size(); ++i) {
+        unsorted[i] = prefix_key(signatures[i].data());
+        const std::uint64_t mixed[2] = {unsorted[i] * 0x9E3779B97F4A7C15ULL, unsorted[i] * 0xC2B2AE3D27D4EB4FULL};
+        for (std::uint64_t bit : mixed) {
+            bit >>= 64 - candidateBits;
+            candidates[bit / 64] |= std::uint64_t(1) << (bit % 64);
+        }
+    }
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) { return unsorted[a] < unsorted[b]; });
+
+    std::size_t total = 0;
+    for (const auto& signature : signatures) total += signature.size();
+    keys.reserve(signatures.size());
+    offsets.reserve(signatures.size() + 1);
+    bytes.reserve(total);
+    for (std::uint32_t i : order) {
+        keys.push_back(unsorted[i]);
+        offsets.push_back(static_cast<std::uint32_t>(bytes.size()));
+        bytes.insert(bytes.end(), signatures[i].begin(), signatures[i].end());
+    }
+    offsets.push_back(static_cast<std::uint32_t>(bytes.size()));
+}
+
+std::size_t signature_prefilter::hash_gram(const std::uint8_t* p) const {
+    if (gram == 2) return p[0] | (std::size_t(p[1]) << 8);
+    std::uint32_t value = p[0] | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16);
+    return (value * 2654435761u) >> (32 - shiftBits);
+}
+
+std::uint64_t signature_prefilter::prefix_key(const std::uint8_t* p) const {
+    std::uint64_t key = 0;
+    std::memcpy(&key, p, prefix);
+    return key;
+}
+
+bool signature_prefilter::maybe_candidate(std::uint64_t key) const {
+    const std::uint64_t first = (key * 0x9E3779B97F4A7C15ULL) >> (64 - candidateBits);
+    const std::uint64_t second = (key * 0xC2B2AE3D27D4EB4FULL) >> (64 - candidateBits);
+    return (candidates[first / 64] >> (first % 64) & 1) && (candidates[second / 64] >> (second % 64) & 1);
+}
+
+const std::uint8_t* signature_prefilter::find(const std::uint8_t* first, const std::uint8_t* last) const {
+    if (window == 0 || static_cast<std::size_t>(last - first) < window) return last;
+    const std::uint8_t* final_start = last - window;
+
+    const std::uint8_t* pos = first;
+    while (pos <= final_start) {
+        const std::size_t step = shift[hash_gram(pos + window - gram)];
+        if (step != 0) {
+            pos += step;
+            continue;
+        }
+        // the exact compare only runs for windows whose prefix passes the bitmap
+        const std::uint64_t key = prefix_key(pos);
+        if (maybe_candidate(key)) {
+            auto range = std::equal_range(keys.begin(), keys.end(), key);
+            for (auto it = range.first; it != range.second; ++it) {
+                const std::size_t i = it - keys.begin();
+                const std::size_t length = offsets[i + 1] - offsets[i];
+                if (length <= static_cast<std::size_t>(last - pos) &&
+                    std::memcmp(pos + prefix, bytes.data() + offsets[i] + prefix, length - prefix) == 0) {
+                    return pos;
+                }
+            }
+        }
+        ++pos;
+    }
+    return last;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "huge_pages.hpp"
+
+// many signatures at once in the style of wu-manber. a window of `window` bytes (the shortest
+// signature) slides over the data, its last q-gram is hashed into a table of safe shifts. where the
+// shift is 0 some signature may end there: the first bytes of the window are checked against a
+// bloom style bitmap and only then the signatures with that prefix are compared in full.
+// every signature has to be at least gram_for() bytes long
+class signature_prefilter {
+public:
+    explicit signature_prefilter(const std::vector<std::vector<std::uint8_t>>& signatures);
+
+    // q-gram length for this set: 3 bytes for big sets (a 2 byte gram is in the prefix of too
+    // many signatures and the shifts collapse to 0), 2 otherwise
+    static std::size_t gram_for(const std::vector<std::vector<std::uint8_t>>& signatures);
+
+    // leftmost occurrence of any signature in [first, last), last when there is none
+    const std::uint8_t* find(const std::uint8_t* first, const std::uint8_t* last) const;
+
+private:
+    template <typename T>
+    using table = std::vector<T, huge_page_allocator<T>>;
+
+    std::size_t hash_gram(const std::uint8_t* p) const;
+    std::uint64_t prefix_key(const std::uint8_t* p) const;
+    bool maybe_candidate(std::uint64_t key) const;
+
+    std::size_t gram;
+    std::size_t window = 0;
+    std::size_t prefix = 0;  // bytes in a prefix key, min(window, 8)
+    unsigned shiftBits = 16;
+    table<std::uint8_t> shift;
+    table<std::uint64_t> candidates; // bloom bitmap of the prefix keys, two bits per signature
+    unsigned candidateBits = 12;
+    // signatures sorted by prefix key, signature i is bytes[offsets[i], offsets[i + 1])
+    table<std::uint64_t> keys;
+    table<std::uint32_t> offsets;
+    table<std::uint8_t> bytes;
+};
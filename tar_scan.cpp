@@ -0,0 +1,474 @@
+#include "tar_scan.hpp"
+#include "io_throttle.hpp"
+#include "scan_budget.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::size_t block_size = 512;
+constexpr std::size_t plain_chunk = 1024 * 1024;
+// long names and pax records are held in memory, more than this is not a real header
+constexpr std::uint64_t max_meta_size = 1024 * 1024;
+constexpr char opaque_whiteout[] = ".wh..wh..opq";
+constexpr char whiteout_prefix[] = ".wh.";
+
+void malformed(const char* why){
+    std::cerr << "malformed tar stream: " << why << "\n";
+    count_error(scan_error::corrupt_archive);
+}
+
+// octal ascii padded with spaces/NULs, or base-256 (GNU) when the top bit of the first byte is set
+bool parse_number(const std::uint8_t* field, std::size_t length, std::uint64_t& value){
+    value = 0;
+    if (field[0] & 0x80) {
+        if (field[0] != 0x80) return false; // negative or too big
+        for (std::size_t i = 1; i < length; ++i) {
+            if (value >> 56) return false;
+            value = (value << 8) | field[i];
+        }
+        return true;
+    }
+    std::size_t i = 0;
+    while (i < length && (field[i] == ' ' || field[i] == '\0')) ++i;
+    for (; i < length && field[i] != ' ' && field[i] != '\0'; ++i) {
+        if (field[i] < '0' || field[i] > '7' || (value >> 60)) return false;
+        value = value * 8 + (field[i] - '0');
+    }
+    return true;
+}
+
+bool checksum_ok(const std::uint8_t* header){
+    std::uint64_t stored;
+    if (!parse_number(header + 148, 8, stored)) return false;
+    std::uint64_t unsignedSum = 0;
+    std::int64_t signedSum = 0;
+    for (std::size_t i = 0; i < block_size; ++i) {
+        std::uint8_t c = (i >= 148 && i < 156) ? ' ' : header[i];
+        unsignedSum += c;
+        signedSum += static_cast<signed char>(c);
+    }
+    // some old writers summed signed chars
+    return stored == unsignedSum || static_cast<std::int64_t>(stored) == signedSum;
+}
+
+std::string field_string(const std::uint8_t* field, std::size_t length){
+    const char* text = reinterpret_cast<const char*>(field);
+    return std::string(text, std::find(text, text + length, '\0'));
+}
+
+// "./usr/bin/" and "/usr/bin" both become "usr/bin"
+std::string normalize_path(std::string path){
+    while (true) {
+        if (path.compare(0, 2, "./") == 0) path.erase(0, 2);
+        else if (!path.empty() && path[0] == '/') path.erase(0, 1);
+        else break;
+    }
+    while (!path.empty() && path.back() == '/') path.pop_back();
+    if (path == ".") path.clear();
+    return path;
+}
+
+bool is_regular_type(char type){
+    // '7' is contiguous, 'S' GNU sparse (the stored data, holes left out)
+    return type == '0' || type == '\0' || type == '7' || type == 'S';
+}
+
+// runs the tar parser over a source, compressed sources go through decompress_stream first
+bool scan_tar_source(const byte_source& source, tar_stream_scanner& parser, const scan_options& options){
+    // enough of the stream to tell the format
+    std::vector<std::uint8_t> head(block_size);
+    std::size_t headLength = 0;
+    while (headLength < head.size()) {
+        ssize_t n;
+        {
+            phase_timer timer(scan_phase::read);
+            n = source(head.data() + headLength, head.size() - headLength);
+        }
+        if (n < 0) {
+            std::cerr << "could not read" << "\n";
+            count_error(scan_error::cant_read);
+            throw CANT_READ;
+        }
+        if (n == 0) break;
+        headLength += static_cast<std::size_t>(n);
+    }
+
+    compression format = options.decompress ? detect_compression(head.data(), headLength) : compression::none;
+    if (format != compression::none) {
+        if (!compression_supported(format)) {
+            std::cerr << "tar stream is compressed with a format this build can not read" << "\n";
+            count_error(scan_error::corrupt_compressed);
+            return false;
+        }
+        std::size_t served = 0;
+        byte_source replay = [&](std::uint8_t* buf, std::size_t capacity) -> ssize_t {
+            if (served < headLength) {
+                std::size_t take = std::min(capacity, headLength - served);
+                std::memcpy(buf, head.data() + served, take);
+                served += take;
+                return static_cast<ssize_t>(take);
+            }
+            return source(buf, capacity);
+        };
+        byte_sink sink = [&](const std::uint8_t* data, std::size_t length) {
+            return parser.feed(data, length);
+        };
+        inflate_result result = decompress_stream(format, replay, sink, options);
+        if (result == inflate_result::bomb) {
+            std::cerr << "stopped decompressing, output is over the size/ratio limit" << "\n";
+            count_error(scan_error::decompression_bomb);
+            return false;
+        }
+        if (result == inflate_result::corrupt) {
+            std::cerr << "compressed data is corrupt or truncated" << "\n";
+            count_error(scan_error::corrupt_compressed);
+            return false;
+        }
+        if (result == inflate_result::read_error) {
+            std::cerr << "could not read" << "\n";
+            count_error(scan_error::cant_read);
+            throw CANT_READ;
+        }
+        if (result == inflate_result::timed_out) throw TIMED_OUT;
+    }
+    else {
+        count_event(scan_counter::bytes_read, headLength);
+        parser.feed(head.data(), headLength);
+        std::vector<std::uint8_t> buffer(std::min(plain_chunk, io_burst_size()));
+        while (true) {
+            check_budget();
+            throttle_io(buffer.size());
+            ssize_t n;
+            {
+                phase_timer timer(scan_phase::read);
+                n = source(buffer.data(), buffer.size());
+            }
+            if (n < 0) {
+                std::cerr << "could not read" << "\n";
+                count_error(scan_error::cant_read);
+                throw CANT_READ;
+            }
+            if (n == 0) break;
+            count_event(scan_counter::bytes_read, static_cast<std::uint64_t>(n));
+            charge_budget(static_cast<std::size_t>(n));
+            if (!parser.feed(buffer.data(), static_cast<std::size_t>(n))) break;
+        }
+    }
+
+    // already reported when it went corrupt
+    if (parser.corrupt()) return false;
+    if (!parser.complete()) {
+        malformed("truncated");
+        return false;
+    }
+    return true;
+}
+
+// drops the hits of layers below `layer` at path (exact) and/or below it (subtree)
+using finding_map = std::map<std::string, std::pair<std::size_t, std::string>>;
+
+void hide_lower(finding_map& findings, const std::string& path, std::size_t layer, bool exact, bool subtree){
+    if (exact) {
+        auto it = findings.find(path);
+        if (it != findings.end() && it->second.first < layer) findings.erase(it);
+    }
+    if (!subtree) return;
+    const std::string prefix = path.empty() ? std::string() : path + "/";
+    for (auto it = findings.lower_bound(prefix); it != findings.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+        if (it->second.first < layer) it = findings.erase(it);
+        else ++it;
+    }
+}
+
+} // namespace
+
+tar_stream_scanner::tar_stream_scanner(const signature_matcher& matcher, entry_fn entry, hit_fn hit)
+    : matcher(matcher), on_entry(std::move(entry)), on_hit(std::move(hit)), stream(matcher) {}
+
+bool tar_stream_scanner::complete() const {
+    return current == state::done || (current == state::header && blockFill == 0);
+}
+
+bool tar_stream_scanner::feed(const std::uint8_t* data, std::size_t length){
+    while (length > 0) {
+        switch (current) {
+        case state::done:
+            return true; // anything after the end marker is padding
+        case state::corrupt:
+            return false;
+        case state::header: {
+            std::size_t take = std::min(length, block_size - blockFill);
+            std::memcpy(block + blockFill, data, take);
+            blockFill += take;
+            data += take;
+            length -= take;
+            if (blockFill == block_size) {
+                blockFill = 0;
+                parse_header();
+            }
+            break;
+        }
+        case state::data: {
+            std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(length, remaining));
+            entry_data(data, take);
+            data += take;
+            length -= take;
+            remaining -= take;
+            if (remaining == 0) {
+                finish_entry();
+                current = padding ? state::padding : state::header;
+            }
+            break;
+        }
+        case state::padding: {
+            std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(length, padding));
+            data += take;
+            length -= take;
+            padding -= take;
+            if (padding == 0) current = state::header;
+            break;
+        }
+        }
+    }
+    return current != state::corrupt;
+}
+
+void tar_stream_scanner::parse_header(){
+    if (std::all_of(block, block + block_size, [](std::uint8_t c) { return c == 0; })) {
+        // the archive ends with two zero blocks
+        if (++zeroBlocks == 2) current = state::done;
+        return;
+    }
+    zeroBlocks = 0;
+
+    std::uint64_t size;
+    if (!checksum_ok(block)) {
+        malformed("bad header checksum");
+        current = state::corrupt;
+        return;
+    }
+    if (!parse_number(block + 124, 12, size)) {
+        malformed("bad entry size");
+        current = state::corrupt;
+        return;
+    }
+
+    entryType = static_cast<char>(block[156]);
+    metaData.clear();
+    regular = false;
+
+    if (entryType == 'L' || entryType == 'x') {
+        if (size > max_meta_size) {
+            malformed("extended header too big");
+            current = state::corrupt;
+            return;
+        }
+    }
+    else if (entryType != 'K' && entryType != 'g') {
+        if (!paxPath.empty()) entryPath = paxPath;
+        else if (!longName.empty()) entryPath = longName;
+        else {
+            entryPath = field_string(block, 100);
+            // ustar splits long paths into prefix and name
+            if (std::memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0') {
+                entryPath = field_string(block + 345, 155) + "/" + entryPath;
+            }
+        }
+        entryPath = normalize_path(entryPath);
+        if (paxSize) size = paxSizeValue;
+        paxPath.clear();
+        longName.clear();
+        paxSize = false;
+
+        on_entry(entryPath, entryType);
+        if (is_regular_type(entryType)) {
+            regular = true;
+            magicLength = 0;
+            elf = false;
+            stream.reset();
+            count_event(scan_counter::files_scanned);
+        }
+    }
+
+    remaining = size;
+    padding = (block_size - size % block_size) % block_size;
+    if (remaining == 0) {
+        finish_entry();
+        current = padding ? state::padding : state::header;
+    }
+    else {
+        current = state::data;
+    }
+}
+
+void tar_stream_scanner::entry_data(const std::uint8_t* data, std::size_t length){
+    if (entryType == 'L' || entryType == 'x') {
+        metaData.append(reinterpret_cast<const char*>(data), length);
+        return;
+    }
+    if (!regular) return;
+    if (magicLength < 4) {
+        std::size_t take = std::min(length, 4 - magicLength);
+        std::memcpy(magic + magicLength, data, take);
+        magicLength += take;
+        if (magicLength < 4) return;
+        elf = is_elf(std::vector<std::uint8_t>(magic, magic + 4));
+    }
+    if (!elf || stream.found()) return;
+    phase_timer timer(scan_phase::search);
+    stream.feed(data, length);
+}
+
+void tar_stream_scanner::finish_entry(){
+    if (entryType == 'L') {
+        longName = metaData.substr(0, metaData.find('\0'));
+        return;
+    }
+    if (entryType == 'x') {
+        // records are "<length> <key>=<value>\n"
+        std::size_t pos = 0;
+        while (pos < metaData.size()) {
+            std::size_t space = metaData.find(' ', pos);
+            if (space == std::string::npos) break;
+            std::size_t recordLength = 0;
+            for (std::size_t i = pos; i < space; ++i) {
+                if (metaData[i] < '0' || metaData[i] > '9') return;
+                recordLength = recordLength * 10 + static_cast<std::size_t>(metaData[i] - '0');
+            }
+            if (recordLength <= space - pos || pos + recordLength > metaData.size()) return;
+            std::string record = metaData.substr(space + 1, pos + recordLength - space - 1);
+            if (!record.empty() && record.back() == '\n') record.pop_back();
+            std::size_t equals = record.find('=');
+            if (equals != std::string::npos) {
+                std::string key = record.substr(0, equals);
+                std::string value = record.substr(equals + 1);
+                if (key == "path") paxPath = value;
+                else if (key == "size") {
+                    try {
+                        paxSizeValue = std::stoull(value);
+                        paxSize = true;
+                    }
+                    catch (const std::exception&) {}
+                }
+            }
+            pos += recordLength;
+        }
+        return;
+    }
+    if (!regular) return;
+    regular = false;
+    if (!elf) {
+        count_event(scan_counter::skipped_non_elf);
+        return;
+    }
+    if (stream.found()) on_hit(entryPath);
+}
+
+std::size_t scan_tar_layers(const std::vector<std::string>& layers, const signature_matcher& matcher,
+                            const scan_options& options, bool whiteouts,
+                            const std::function<void(const std::string& name)>& report){
+    std::size_t hits = 0;
+    finding_map findings; // path -> (layer, name to report), only with whiteouts
+
+    for (std::size_t layer = 0; layer < layers.size(); ++layer) {
+        const std::string& name = layers[layer];
+        trace_span span("layer", name.c_str());
+
+        int fd = 0;
+        if (name != "-") {
+            phase_timer timer(scan_phase::open);
+            fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                std::cerr << "could not open " << name << "\n";
+                count_error(scan_error::cant_open);
+                throw CANT_OPEN;
+            }
+        }
+        byte_source source = [fd](std::uint8_t* buf, std::size_t capacity) -> ssize_t {
+            ssize_t n;
+            do {
+                n = ::read(fd, buf, capacity);
+            } while (n < 0 && errno == EINTR);
+            return n;
+        };
+
+        tar_stream_scanner::entry_fn entry = [&](const std::string& path, char type) {
+            if (!whiteouts) return;
+            std::size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? std::string() : path.substr(0, slash);
+            std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+            if (base == opaque_whiteout) {
+                hide_lower(findings, dir, layer, false, true);
+            }
+            else if (base.compare(0, sizeof(whiteout_prefix) - 1, whiteout_prefix) == 0) {
+                std::string target = base.substr(sizeof(whiteout_prefix) - 1);
+                hide_lower(findings, dir.empty() ? target : dir + "/" + target, layer, true, true);
+            }
+            else {
+                // an upper file replaces whatever was there, an upper directory only a lower file
+                hide_lower(findings, path, layer, true, type != '5');
+            }
+        };
+        tar_stream_scanner::hit_fn hit = [&](const std::string& path) {
+            std::string display = name + "(" + path + ")";
+            if (whiteouts) {
+                findings[path] = std::make_pair(layer, display);
+                return;
+            }
+            ++hits;
+            count_event(scan_counter::infected);
+            report(display);
+        };
+
+        tar_stream_scanner parser(matcher, entry, hit);
+        try {
+            scan_tar_source(source, parser, options);
+        }
+        catch (...) {
+            if (fd != 0) ::close(fd);
+            throw;
+        }
+        if (fd != 0) ::close(fd);
+    }
+
+    for (const auto& finding : findings) {
+        ++hits;
+        count_event(scan_counter::infected);
+        report(finding.second.second);
+    }
+    return hits;
+}
+
+std::size_t scan_tar_range(int fd, off_t offset, off_t length, const signature_matcher& matcher,
+                           const scan_options& options, const std::function<void(const std::string& path)>& report){
+    const off_t end = offset + length;
+    byte_source source = [&](std::uint8_t* buf, std::size_t capacity) -> ssize_t {
+        capacity = static_cast<std::size_t>(std::min<off_t>(capacity, end - offset));
+        if (capacity == 0) return 0;
+        ssize_t n;
+        do {
+            n = ::pread(fd, buf, capacity, offset);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) offset += n;
+        return n;
+    };
+
+    std::size_t hits = 0;
+    tar_stream_scanner parser(matcher, [](const std::string&, char) {}, [&](const std::string& path) {
+        ++hits;
+        report(path);
+    });
+    scan_tar_source(source, parser, options);
+    return hits;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "compressed_scan.hpp"
+#include "file_scanner.hpp"
+
+// parses a tar stream handed over in pieces of any size (a pipe, decompressor output) and runs
+// the ELF check and the matcher over every regular entry as its data goes by, nothing is
+// extracted. ustar, GNU long names (L) and pax path/size records are understood
+class tar_stream_scanner {
+public:
+    using entry_fn = std::function<void(const std::string& path, char type)>;
+    using hit_fn = std::function<void(const std::string& path)>;
+
+    // entry is called for every header (after long name / pax resolution), hit for every
+    // regular entry that contains the signature
+    tar_stream_scanner(const signature_matcher& matcher, entry_fn entry, hit_fn hit);
+
+    // false once the stream is corrupt, everything after that is ignored
+    bool feed(const std::uint8_t* data, std::size_t length);
+    // true when the stream ended on an entry boundary
+    bool complete() const;
+    // a header failed its checks and the rest of the stream was given up on
+    bool corrupt() const { return current == state::corrupt; }
+
+private:
+    enum class state { header, data, padding, done, corrupt };
+
+    void parse_header();
+    void finish_entry();
+    void entry_data(const std::uint8_t* data, std::size_t length);
+
+    const signature_matcher& matcher;
+    entry_fn on_entry;
+    hit_fn on_hit;
+
+    state current = state::header;
+    std::uint8_t block[512];
+    std::size_t blockFill = 0;
+    int zeroBlocks = 0;
+
+    char entryType = 0;
+    std::string entryPath;
+    std::uint64_t remaining = 0;
+    std::uint64_t padding = 0;
+    // data of L / x entries is collected instead of scanned
+    std::string metaData;
+    std::string longName;
+    std::string paxPath;
+    bool paxSize = false;
+    std::uint64_t paxSizeValue = 0;
+
+    bool regular = false;
+    std::uint8_t magic[4];
+    std::size_t magicLength = 0;
+    bool elf = false;
+    stream_matcher stream;
+};
+
+// scans each layer (a path, "-" for stdin) as a tar stream, plain or gzip/xz/zstd compressed.
+// layers are read in order, lowest first. hits are reported as layer(path/in/layer). with
+// whiteouts the layers are treated as one image: an OCI/AUFS whiteout (.wh.name, .wh..wh..opq)
+// or a replacing entry in an upper layer hides the hits of the layers below, and hits are only
+// reported once all layers are read. returns the number of reported hits
+std::size_t scan_tar_layers(const std::vector<std::string>& layers, const signature_matcher& matcher,
+                            const scan_options& options, bool whiteouts,
+                            const std::function<void(const std::string& name)>& report);
+
+// the same for a tar (possibly compressed) stored at offset in fd, used for the data.tar.* of .deb packages
+std::size_t scan_tar_range(int fd, off_t offset, off_t length, const signature_matcher& matcher,
+                           const scan_options& options, const std::function<void(const std::string& path)>& report);
@@ -1,12 +1,49 @@
 #define CATCH_CONFIG_MAIN
 #include "catch_amalgamated.hpp"
 #include "file_scanner.hpp"
+#include "verdict_cache.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+#include "compressed_scan.hpp"
+#include "tar_scan.hpp"
+#include "io_throttle.hpp"
+#include "scan_checkpoint.hpp"
+#include "cache_neutral.hpp"
+#include "read_tuning.hpp"
+#include "numa_topology.hpp"
+#include "huge_pages.hpp"
+#include "extent_order.hpp"
+#include "path_filter.hpp"
+#include "file_stat.hpp"
+#include "uring_scan.hpp"
+#include "dir_summary.hpp"
+#include "shard_scan.hpp"
+#include "isolated_scan.hpp"
+#include "scan_budget.hpp"
+#include <zlib.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <vector>
 #include <filesystem>
 #include <fstream>
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <regex>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 namespace fs = std::filesystem;
 
@@ -155,6 +192,1418 @@ TEST_CASE("contains_signature when the file does not have the signature", "[file
     fs::remove(cpp_file);
 }
 
+TEST_CASE("contains_signature_fd scans an open descriptor without moving its offset", "[file_scanner]") {
+    fs::path test_path = "test_files/fd_scan";
+    {
+        std::ofstream ofs(test_path, std::ios::binary);
+        REQUIRE(ofs.good());
+        std::vector<std::uint8_t> data = {
+            0x7F, 'E', 'L', 'F', // ELF header
+            0x01, 0x02,
+            0xDE, 0xAD, 0xBE, 0xEF, // Signature embedded
+            0x03
+        };
+        ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    int fd = open(test_path.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+    REQUIRE(contains_signature_fd(fd, {0xDE, 0xAD, 0xBE, 0xEF}));
+    REQUIRE(!contains_signature_fd(fd, {0xCA, 0xFE}));
+    REQUIRE(lseek(fd, 0, SEEK_CUR) == 0);
+    close(fd);
+
+    fs::remove(test_path);
+}
+
+TEST_CASE("verdict_cache forgets a file once it is modified", "[verdict_cache]") {
+    fs::path test_path = "test_files/cached";
+    {
+        std::ofstream ofs(test_path, std::ios::binary);
+        REQUIRE(ofs.good());
+        ofs << "first";
+    }
+
+    struct stat st;
+    REQUIRE(stat(test_path.c_str(), &st) == 0);
+
+    verdict_cache cache;
+    bool infected = false;
+    REQUIRE(!cache.lookup(make_file_key(st), infected));
+    cache.store(make_file_key(st), true);
+    REQUIRE(cache.lookup(make_file_key(st), infected));
+    REQUIRE(infected);
+
+    {
+        std::ofstream ofs(test_path, std::ios::binary | std::ios::app);
+        ofs << "second";
+    }
+    REQUIRE(stat(test_path.c_str(), &st) == 0);
+    REQUIRE(!cache.lookup(make_file_key(st), infected));
+
+    fs::remove(test_path);
+}
+
+TEST_CASE("signature_matcher agrees with std::search for every length", "[signature_matcher]") {
+    std::mt19937 rng(1234);
+    // a 3 letter alphabet makes lots of near misses for the fixed width compare
+    std::uniform_int_distribution<int> byte(0, 2);
+
+    for (std::size_t len = 1; len <= max_fixed_signature + 8; ++len) {
+        for (int round = 0; round < 20; ++round) {
+            std::vector<std::uint8_t> sig(len), hay(len + static_cast<std::size_t>(round) * 7);
+            for (auto& b : sig) b = static_cast<std::uint8_t>(byte(rng));
+            for (auto& b : hay) b = static_cast<std::uint8_t>(byte(rng));
+            if (round % 3 == 0) std::copy(sig.begin(), sig.end(), hay.end() - len); // at the very end
+            if (round % 3 == 1) std::copy(sig.begin(), sig.end(), hay.begin());     // at the start
+
+            signature_matcher matcher(sig);
+            const std::uint8_t* expected = std::search(hay.data(), hay.data() + hay.size(), sig.begin(), sig.end());
+            INFO("length " << len << " round " << round);
+            REQUIRE(matcher.find(hay.data(), hay.data() + hay.size()) == expected);
+        }
+        // shorter than the signature never matches
+        std::vector<std::uint8_t> sig(len, 1);
+        signature_matcher matcher(sig);
+        REQUIRE(matcher.find(sig.data(), sig.data() + len - 1) == sig.data() + len - 1);
+    }
+}
+
+static void write_gzip(const fs::path& path, const std::vector<std::uint8_t>& data) {
+    gzFile gz = gzopen(path.c_str(), "wb");
+    REQUIRE(gz != nullptr);
+    REQUIRE(gzwrite(gz, data.data(), static_cast<unsigned>(data.size())) == static_cast<int>(data.size()));
+    gzclose(gz);
+}
+
+static void write_xz(const fs::path& path, const std::vector<std::uint8_t>& data) {
+    std::vector<std::uint8_t> out(lzma_stream_buffer_bound(data.size()));
+    std::size_t out_pos = 0;
+    REQUIRE(lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(),
+                                    out.data(), &out_pos, out.size()) == LZMA_OK);
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(out.data()), out_pos);
+}
+
+#ifdef HAVE_ZSTD
+static void write_zstd(const fs::path& path, const std::vector<std::uint8_t>& data) {
+    std::vector<std::uint8_t> out(ZSTD_compressBound(data.size()));
+    std::size_t written = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 3);
+    REQUIRE(!ZSTD_isError(written));
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(written));
+}
+#endif
+
+// what scanner() printed while stdout was captured: as is, as sorted lines, and the sorted names it
+// reported infected. counted is how far the counter given to capture_scan moved
+struct scan_capture {
+    std::string output;
+    std::vector<std::string> lines;
+    std::vector<std::string> hits;
+    bool completed = false;
+    std::uint64_t counted = 0;
+};
+
+// with only_hits the output is taken to be hit lines and nothing else, split on the hit line's end,
+// so a name may hold a newline. metrics are on for the scan when a counter is given
+static scan_capture capture_scan(const fs::path& root, const signature_list& signatures, const scan_options& options,
+                                 bool only_hits = false, scan_counter counter = scan_counter::count) {
+    scan_capture result;
+    const bool counting = counter != scan_counter::count;
+    const std::size_t index = static_cast<std::size_t>(counter);
+    if (counting) {
+        enable_metrics(true);
+        result.counted = collect_metrics().counters[index];
+    }
+    std::ostringstream captured;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+    result.completed = scanner(root, signatures, options);
+    std::cout.rdbuf(oldCoutBuf);
+    if (counting) {
+        result.counted = collect_metrics().counters[index] - result.counted;
+        enable_metrics(false);
+    }
+    result.output = captured.str();
+    std::istringstream in(result.output);
+    const std::string hit = " is infected!";
+    for (std::string line; std::getline(in, line);) {
+        result.lines.push_back(line);
+        if (!only_hits && line.size() > hit.size() && line.compare(line.size() - hit.size(), hit.size(), hit) == 0) {
+            result.hits.push_back(line.substr(0, line.size() - hit.size()));
+        }
+    }
+    std::size_t start = 0;
+    for (std::size_t end; only_hits && (end = result.output.find(hit + "\n", start)) != std::string::npos;
+         start = end + hit.size() + 1) {
+        result.hits.push_back(result.output.substr(start, end - start));
+    }
+    std::sort(result.lines.begin(), result.lines.end());
+    std::sort(result.hits.begin(), result.hits.end());
+    return result;
+}
+
+static scan_capture capture_scan(const fs::path& root, const std::vector<std::uint8_t>& signature,
+                                 const scan_options& options = scan_options(), bool only_hits = false,
+                                 scan_counter counter = scan_counter::count) {
+    return capture_scan(root, signature_list{{signature}, {}}, options, only_hits, counter);
+}
+
+// runs ./find_sig with arguments through the shell, returns its exit status and what it printed
+static int run_find_sig(const std::string& arguments, std::string& output) {
+    FILE* pipe = popen(("./find_sig " + arguments).c_str(), "r");
+    REQUIRE(pipe != nullptr);
+    char buffer[256];
+    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) output += buffer;
+    const int status = pclose(pipe);
+    REQUIRE(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+TEST_CASE("compressed ELF files are scanned without unpacking them", "[compressed_scan]") {
+    std::vector<std::uint8_t> sig = {0xDE, 0xAD, 0xBE, 0xEF};
+
+    // 3 MiB ELF with the signature straddling the 1 MiB decompression chunk boundary
+    std::vector<std::uint8_t> elf(3 * 1024 * 1024, 0xAA);
+    elf[0] = 0x7F; elf[1] = 'E'; elf[2] = 'L'; elf[3] = 'F';
+    std::copy(sig.begin(), sig.end(), elf.begin() + 1024 * 1024 - 2);
+
+    std::vector<std::uint8_t> text(3 * 1024 * 1024, 'a');
+    std::copy(sig.begin(), sig.end(), text.begin() + 100);
+
+    write_gzip("test_files/infected.gz", elf);
+    write_xz("test_files/infected.xz", elf);
+    write_gzip("test_files/text.gz", text);
+
+    REQUIRE(contains_signature("test_files/infected.gz", sig));
+    REQUIRE(contains_signature("test_files/infected.xz", sig));
+#ifdef HAVE_ZSTD
+    write_zstd("test_files/infected.zst", elf);
+    write_zstd("test_files/text.zst", text);
+    REQUIRE(contains_signature("test_files/infected.zst", sig));
+    REQUIRE(!contains_signature("test_files/text.zst", sig));
+    fs::remove("test_files/infected.zst");
+    fs::remove("test_files/text.zst");
+#endif
+    // the signature is there but the inner file is not an ELF
+    REQUIRE(!contains_signature("test_files/text.gz", sig));
+
+    scan_options no_decompress;
+    no_decompress.decompress = false;
+    REQUIRE(!contains_signature("test_files/infected.gz", signature_matcher(sig), no_decompress));
+
+    // the signature sits after the output limit, the guard stops before it
+    std::vector<std::uint8_t> bomb(8 * 1024 * 1024, 0);
+    bomb[0] = 0x7F; bomb[1] = 'E'; bomb[2] = 'L'; bomb[3] = 'F';
+    std::copy(sig.begin(), sig.end(), bomb.end() - 4);
+    write_gzip("test_files/bomb.gz", bomb);
+    scan_options guarded;
+    guarded.max_decompressed = 2 * 1024 * 1024;
+    REQUIRE(!contains_signature("test_files/bomb.gz", signature_matcher(sig), guarded));
+    REQUIRE(contains_signature("test_files/bomb.gz", sig));
+
+    fs::remove("test_files/infected.gz");
+    fs::remove("test_files/infected.xz");
+    fs::remove("test_files/text.gz");
+    fs::remove("test_files/bomb.gz");
+}
+
+TEST_CASE("scanner reports infected members of an ar archive", "[archive_scan]") {
+    fs::path root_dir = "test_archive_root";
+    fs::create_directories(root_dir);
+
+    // one object carries the signature in its data, the long name goes through the // table
+    {
+        std::ofstream ofs(root_dir / "bad.cpp");
+        ofs << "extern const unsigned char blob[] = {0xDE, 0xAD, 0xBE, 0xEF, 0x42};";
+    }
+    {
+        std::ofstream ofs(root_dir / "clean.cpp");
+        ofs << "int clean() { return 1; }";
+    }
+    std::string dir = root_dir.string();
+    REQUIRE(system(("g++ -c " + dir + "/bad.cpp -o " + dir + "/a_rather_long_member_name.o").c_str()) == 0);
+    REQUIRE(system(("g++ -c " + dir + "/clean.cpp -o " + dir + "/clean.o").c_str()) == 0);
+    REQUIRE(system(("ar rcs " + dir + "/libmixed.a " + dir + "/clean.o " + dir + "/a_rather_long_member_name.o").c_str()) == 0);
+    fs::remove(root_dir / "bad.cpp");
+    fs::remove(root_dir / "clean.cpp");
+    fs::remove(root_dir / "a_rather_long_member_name.o");
+    fs::remove(root_dir / "clean.o");
+
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    std::ostringstream captured;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+    struct CoutRestore {
+        std::streambuf* buf;
+        ~CoutRestore(){ std::cout.rdbuf(buf); }
+    } restore{oldCoutBuf};
+
+    scanner(root_dir, signature);
+
+    std::string out = captured.str();
+    std::string archive = (root_dir / "libmixed.a").string();
+    INFO("Captured output:\n" << out);
+    REQUIRE(out.find(archive + "(a_rather_long_member_name.o) is infected!") != std::string::npos);
+    REQUIRE(out.find(archive + "(clean.o) is infected!") == std::string::npos);
+    REQUIRE(contains_signature(root_dir / "libmixed.a", signature));
+
+    scan_options no_archives;
+    no_archives.scan_archives = false;
+    REQUIRE(!contains_signature(root_dir / "libmixed.a", signature_matcher(signature), no_archives));
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("tar layers are scanned as streams and whiteouts hide lower files", "[tar_scan]") {
+    fs::path root_dir = "test_tar_root";
+    fs::create_directories(root_dir / "lower/usr/bin");
+    fs::create_directories(root_dir / "lower/opt/tool");
+    fs::create_directories(root_dir / "upper/usr/bin");
+    fs::create_directories(root_dir / "upper/opt/tool");
+
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    auto write_elf = [&](const fs::path& path) {
+        std::ofstream ofs(path, std::ios::binary);
+        ofs << "\x7f" "ELF" << std::string(700, 'x');
+        ofs.write(reinterpret_cast<const char*>(signature.data()), signature.size());
+    };
+    write_elf(root_dir / "lower/usr/bin/removed");
+    write_elf(root_dir / "lower/usr/bin/kept");
+    write_elf(root_dir / "lower/opt/tool/hidden");
+    {
+        std::ofstream ofs(root_dir / "lower/usr/bin/script");
+        ofs << "#!/bin/sh\n" << "\xDE\xAD\xBE\xEF";
+    }
+    std::ofstream(root_dir / "upper/usr/bin/.wh.removed").close();
+    std::ofstream(root_dir / "upper/opt/tool/.wh..wh..opq").close();
+
+    std::string dir = root_dir.string();
+    REQUIRE(system(("tar -C " + dir + "/lower -czf " + dir + "/lower.tar.gz .").c_str()) == 0);
+    REQUIRE(system(("tar -C " + dir + "/upper -cf " + dir + "/upper.tar .").c_str()) == 0);
+    std::vector<std::string> layers = {dir + "/lower.tar.gz", dir + "/upper.tar"};
+    signature_matcher matcher(signature);
+
+    std::vector<std::string> found;
+    auto collect = [&](const std::string& name) { found.push_back(name); };
+    REQUIRE(scan_tar_layers({layers[0]}, matcher, scan_options(), false, collect) == 3);
+    std::sort(found.begin(), found.end());
+    REQUIRE(found[0] == layers[0] + "(opt/tool/hidden)");
+    REQUIRE(found[1] == layers[0] + "(usr/bin/kept)");
+    REQUIRE(found[2] == layers[0] + "(usr/bin/removed)");
+
+    found.clear();
+    REQUIRE(scan_tar_layers(layers, matcher, scan_options(), true, collect) == 1);
+    REQUIRE(found[0] == layers[0] + "(usr/bin/kept)");
+
+    // the parser does not care how the stream is cut up
+    found.clear();
+    REQUIRE(system(("tar -C " + dir + "/lower -cf " + dir + "/lower.tar .").c_str()) == 0);
+    std::ifstream ifs(dir + "/lower.tar", std::ios::binary);
+    std::vector<std::uint8_t> tarball((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    tar_stream_scanner parser(matcher, [](const std::string&, char) {}, collect);
+    for (std::size_t i = 0; i < tarball.size(); i += 7) {
+        REQUIRE(parser.feed(tarball.data() + i, std::min<std::size_t>(7, tarball.size() - i)));
+    }
+    REQUIRE(parser.complete());
+    REQUIRE(found.size() == 3);
+
+    // a broken header is reported once, not a second time as a truncated stream
+    tarball[148] ^= 1;
+    {
+        std::ofstream ofs(dir + "/broken.tar", std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(tarball.data()), static_cast<std::streamsize>(tarball.size()));
+    }
+    std::stringstream errors;
+    std::streambuf* oldCerrBuf = std::cerr.rdbuf(errors.rdbuf());
+    found.clear();
+    std::size_t hits = scan_tar_layers({dir + "/broken.tar"}, matcher, scan_options(), false, collect);
+    std::cerr.rdbuf(oldCerrBuf);
+    INFO("Errors:\n" << errors.str());
+    REQUIRE(hits == 0);
+    REQUIRE(errors.str() == "malformed tar stream: bad header checksum\n");
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("max io rate slows reads down to the token bucket rate", "[io_throttle]") {
+    fs::path file = "test_files/throttled.elf";
+    {
+        std::ofstream ofs(file, std::ios::binary);
+        ofs << "\x7f" "ELF" << std::string(4 * 1024 * 1024, 'x');
+    }
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+
+    set_io_rate_limit(8 * 1024 * 1024);
+    REQUIRE(io_burst_size() < 8 * 1024 * 1024);
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(!contains_signature(file, signature));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    set_io_rate_limit(0);
+
+    // 4MB at 8MB/s with a 100ms bucket
+    REQUIRE(elapsed >= std::chrono::milliseconds(350));
+    REQUIRE(io_burst_size() == SIZE_MAX);
+    fs::remove(file);
+}
+
+TEST_CASE("scanner resumes after the entry saved in the checkpoint", "[scan_checkpoint]") {
+    fs::path root_dir = "test_checkpoint_root";
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    for (const char* dir : {"a", "b", "c"}) {
+        fs::create_directories(root_dir / dir);
+        std::ofstream ofs(root_dir / dir / "infected", std::ios::binary);
+        ofs << "\x7f" "ELF" << "\xDE\xAD\xBE\xEF";
+    }
+
+    scan_checkpoint saved;
+    saved.root = fs::absolute(root_dir).lexically_normal().string();
+    saved.signature_hash = hash_signature(signature);
+    saved.done = {"b"};
+    saved.hits = {"earlier/hit"};
+    fs::path checkpoint_file = "test_files/scan.ckpt";
+    REQUIRE(save_checkpoint(checkpoint_file, saved));
+    scan_checkpoint loaded;
+    REQUIRE(load_checkpoint(checkpoint_file, loaded));
+    REQUIRE(loaded.done == saved.done);
+    REQUIRE(loaded.hits == saved.hits);
+
+    std::ostringstream captured;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+    struct CoutRestore {
+        std::streambuf* buf;
+        ~CoutRestore(){ std::cout.rdbuf(buf); }
+    } restore{oldCoutBuf};
+
+    scan_options options;
+    options.checkpoint_file = checkpoint_file;
+    options.resume = true;
+    scanner(root_dir, signature, options);
+
+    std::string out = captured.str();
+    INFO("Captured output:\n" << out);
+    REQUIRE(out.find("earlier/hit is infected!") != std::string::npos);
+    REQUIRE(out.find((root_dir / "a" / "infected").string()) == std::string::npos);
+    REQUIRE(out.find((root_dir / "b" / "infected").string()) == std::string::npos);
+    REQUIRE(out.find((root_dir / "c" / "infected").string() + " is infected!") != std::string::npos);
+    // a finished scan leaves nothing to resume
+    REQUIRE(!fs::exists(checkpoint_file));
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("cache neutral scans leave only the pages that were cached before", "[cache_neutral]") {
+    const std::size_t size = 1024 * 1024;
+    fs::path file = "test_files/cache_neutral.elf";
+    {
+        std::ofstream ofs(file, std::ios::binary);
+        std::string data = "\x7f" "ELF" + std::string(size - 4, 'x');
+        // crosses a 4096 boundary so the unaligned O_DIRECT path has to get it right
+        data.replace(3 * 4096 - 2, 4, "\xDE\xAD\xBE\xEF");
+        ofs << data;
+    }
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    scan_options options;
+    options.cache_neutral = true;
+    REQUIRE(contains_signature(file, signature_matcher(signature), options));
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+    ::fsync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    auto resident_pages = [&](std::size_t from, std::size_t to) {
+        void* map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        std::vector<unsigned char> pages(size / 4096);
+        ::mincore(map, size, pages.data());
+        ::munmap(map, size);
+        return std::count_if(pages.begin() + from, pages.begin() + to, [](unsigned char p) { return p & 1; });
+    };
+
+    // someone else's working set
+    std::vector<std::uint8_t> buffer(size);
+    REQUIRE(::pread(fd, buffer.data(), 64 * 4096, 0) == 64 * 4096);
+    {
+        page_cache_guard guard(fd, 0, size);
+        REQUIRE(::pread(fd, buffer.data(), size, 0) == static_cast<ssize_t>(size));
+    }
+    REQUIRE(resident_pages(0, 64) == 64);
+    REQUIRE(resident_pages(64, size / 4096) == 0);
+
+    ::close(fd);
+    fs::remove(file);
+}
+
+TEST_CASE("read plans follow the storage and the chunk size option", "[read_tuning]") {
+    fs::path file = "test_files/read_plan.elf";
+    {
+        std::ofstream ofs(file, std::ios::binary);
+        std::string data = "\x7f" "ELF" + std::string(64 * 1024, 'x');
+        data.replace(4096 - 2, 4, "\xDE\xAD\xBE\xEF");
+        ofs << data;
+    }
+    int fd = ::open(file.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+    read_plan plan = plan_reads(fd);
+    ::close(fd);
+    REQUIRE(plan.storage != storage_class::memory);
+    REQUIRE(plan.chunk >= min_read_chunk);
+    REQUIRE(plan.chunk <= max_read_chunk);
+
+    if (fs::is_directory("/dev/shm")) {
+        fs::path shm = "/dev/shm/find_sig_read_plan";
+        std::ofstream(shm) << "x";
+        fd = ::open(shm.c_str(), O_RDONLY);
+        REQUIRE(fd >= 0);
+        read_plan memory = plan_reads(fd);
+        ::close(fd);
+        fs::remove(shm);
+        REQUIRE(memory.storage == storage_class::memory);
+        REQUIRE(memory.readahead_chunks == 0);
+    }
+
+    // a signature across the boundary of two small fixed chunks
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    scan_options options;
+    options.chunk_size = 4096;
+    REQUIRE(contains_signature(file, signature_matcher(signature), options));
+    fs::remove(file);
+}
+
+TEST_CASE("parallel scanner reports the same hits as the single threaded one", "[parallel_scan]") {
+    fs::path root_dir = "test_parallel_root";
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    for (int d = 0; d < 6; ++d) {
+        fs::path dir = root_dir / ("dir" + std::to_string(d));
+        fs::create_directories(dir);
+        for (int f = 0; f < 20; ++f) {
+            std::ofstream ofs(dir / ("file" + std::to_string(f)), std::ios::binary);
+            ofs << "\x7f" "ELF" << std::string(1000 + f, 'x');
+            if ((d + f) % 7 == 0) ofs << "\xDE\xAD\xBE\xEF";
+        }
+    }
+
+    std::vector<std::string> single = capture_scan(root_dir, signature).lines;
+    REQUIRE(single.size() == 17);
+    scan_options parallel;
+    parallel.threads = 4;
+    REQUIRE(capture_scan(root_dir, signature, parallel).lines == single);
+    parallel.numa = true;
+    REQUIRE(capture_scan(root_dir, signature, parallel).lines == single);
+
+    REQUIRE(parse_cpu_list("0-3,8,10-11") == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+    REQUIRE(!numa_nodes().empty());
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("extent ordered batches scan every file once, in physical order", "[extent_order]") {
+    fs::path root_dir = "test_extent_root";
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    std::vector<fs::path> paths;
+    for (int d = 0; d < 4; ++d) {
+        fs::path dir = root_dir / ("dir" + std::to_string(d));
+        fs::create_directories(dir);
+        for (int f = 0; f < 10; ++f) {
+            paths.push_back(dir / ("file" + std::to_string(f)));
+            std::ofstream ofs(paths.back(), std::ios::binary);
+            ofs << "\x7f" "ELF" << std::string(8192 * (1 + (d * 7 + f) % 5), 'x');
+            if ((d + f) % 3 == 0) ofs << "\xDE\xAD\xBE\xEF";
+        }
+    }
+    paths.push_back(root_dir / "empty");
+    std::ofstream(paths.back()).close();
+    ::sync();
+
+    std::vector<std::size_t> order = extent_order(paths);
+    std::vector<std::size_t> sorted = order;
+    std::sort(sorted.begin(), sorted.end());
+    for (std::size_t i = 0; i < sorted.size(); ++i) REQUIRE(sorted[i] == i);
+    // an empty file has no extent and goes last
+    REQUIRE(order.back() == paths.size() - 1);
+    REQUIRE(locate_extent(paths.back()).offset == no_physical_offset);
+    for (std::size_t i = 1; i < order.size(); ++i) {
+        physical_location before = locate_extent(paths[order[i - 1]]);
+        physical_location after = locate_extent(paths[order[i]]);
+        if (after.offset == no_physical_offset) continue;
+        REQUIRE(before.offset != no_physical_offset);
+        REQUIRE((before.device < after.device || (before.device == after.device && before.offset <= after.offset)));
+    }
+
+    std::vector<std::string> plain = capture_scan(root_dir, signature).lines;
+    REQUIRE(plain.size() == 14);
+    scan_options batched;
+    batched.extent_batch = 7;
+    batched.checkpoint_file = "test_files/extent.ckpt";
+    REQUIRE(capture_scan(root_dir, signature, batched).lines == plain);
+    REQUIRE(!fs::exists(batched.checkpoint_file));
+    batched.threads = 3;
+    REQUIRE(capture_scan(root_dir, signature, batched).lines == plain);
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("exclude and include globs prune the walk, pseudo filesystems are not entered", "[path_filter]") {
+    path_filter filter({"*.tmp", "cache", "src/**/generated", "/build/obj[0-9]?"}, {"*.so", "bin/*"});
+    REQUIRE(filter.excluded("a/b/x.tmp", "x.tmp"));
+    REQUIRE(!filter.excluded("a/b/x.tmpl", "x.tmpl"));
+    REQUIRE(filter.excluded("deep/er/cache", "cache"));
+    REQUIRE(filter.excluded("src/generated", "generated"));
+    REQUIRE(filter.excluded("src/a/b/generated", "generated"));
+    REQUIRE(!filter.excluded("lib/generated", "generated"));
+    REQUIRE(filter.excluded("build/obj1x", "obj1x"));
+    REQUIRE(!filter.excluded("build/objx1", "objx1"));
+    REQUIRE(!filter.excluded("sub/build/obj1x", "obj1x"));
+    REQUIRE(filter.included("usr/lib/libc.so", "libc.so"));
+    REQUIRE(filter.included("bin/ls", "ls"));
+    REQUIRE(!filter.included("bin/sub/ls", "ls"));
+    REQUIRE(!filter.included("usr/lib/libc.a", "libc.a"));
+    REQUIRE(path_filter({}, {}).included("anything", "anything"));
+    REQUIRE(path_filter({"[!a-c]*"}, {}).excluded("d", "d"));
+    REQUIRE(!path_filter({"[!a-c]*"}, {}).excluded("b", "b"));
+
+    fs::path root_dir = "test_filter_root";
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    for (const char* file : {"keep/a.so", "keep/b.bin", "cache/c.so", "keep/cache/d.so", "e.so.tmp", "f.so"}) {
+        fs::create_directories((root_dir / file).parent_path());
+        std::ofstream ofs(root_dir / file, std::ios::binary);
+        ofs << "\x7f" "ELF" << "\xDE\xAD\xBE\xEF";
+    }
+    std::ostringstream captured;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+    scan_options options;
+    options.exclude = {"cache", "*.tmp"};
+    options.include = {"*.so"};
+    options.one_file_system = true;
+    scanner(root_dir, signature, options);
+    std::cout.rdbuf(oldCoutBuf);
+    std::string out = captured.str();
+    INFO("Captured output:\n" << out);
+    REQUIRE(out.find((root_dir / "keep/a.so").string() + " is infected!") != std::string::npos);
+    REQUIRE(out.find((root_dir / "f.so").string() + " is infected!") != std::string::npos);
+    REQUIRE(out.find("b.bin") == std::string::npos);
+    REQUIRE(out.find("c.so") == std::string::npos);
+    REQUIRE(out.find("d.so") == std::string::npos);
+    REQUIRE(out.find("e.so.tmp") == std::string::npos);
+    fs::remove_all(root_dir);
+
+    struct stat info;
+    if (::stat("/proc/self", &info) == 0) {
+        REQUIRE(filesystem_type(info.st_dev) == "proc");
+        REQUIRE(std::find(pseudo_filesystems.begin(), pseudo_filesystems.end(), "proc") != pseudo_filesystems.end());
+    }
+}
+
+TEST_CASE("statx fills only what is asked and the scan reads to the end of the open file", "[file_stat]") {
+    fs::path file = "test_files/statx.elf";
+    {
+        std::ofstream ofs(file, std::ios::binary);
+        ofs << "\x7f" "ELF" << std::string(4092, 'x') << "\xDE\xAD\xBE\xEF";
+    }
+    file_stat info;
+    REQUIRE(stat_path(file.c_str(), STATX_TYPE | STATX_SIZE, stat_sync::cached, info) == 0);
+    REQUIRE(S_ISREG(info.mode));
+    REQUIRE(info.size == 4100);
+    file_stat directory;
+    REQUIRE(stat_path("test_files", STATX_TYPE | STATX_INO, stat_sync::as_stat, directory) == 0);
+    REQUIRE(S_ISDIR(directory.mode));
+    REQUIRE(directory.inode != 0);
+    REQUIRE(directory.device == info.device);
+    file_stat missing;
+    REQUIRE(stat_path("test_files/no_such_file", STATX_TYPE, stat_sync::as_stat, missing) == ENOENT);
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+    file_stat byFd;
+    REQUIRE(stat_fd(fd, STATX_TYPE | STATX_SIZE, stat_sync::as_stat, byFd) == 0);
+    ::close(fd);
+    REQUIRE(byFd.size == info.size);
+    REQUIRE(byFd.device == info.device);
+
+    // a known size may be stale cached attributes, the scan reads to the end of the open file
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    signature_matcher matcher(signature);
+    REQUIRE(contains_signature(file, matcher, scan_options(), &info));
+    file_stat shorter = info;
+    shorter.size = 4096;
+    REQUIRE(contains_signature(file, matcher, scan_options(), &shorter));
+    shorter.size = 2;
+    REQUIRE(contains_signature(file, matcher, scan_options(), &shorter));
+    fs::remove(file);
+}
+
+TEST_CASE("io_uring scans report what the blocking scans do", "[uring_scan]") {
+    fs::path root_dir = "test_uring_root";
+    std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    std::vector<std::uint8_t> elf = {0x7F, 'E', 'L', 'F'};
+    for (int d = 0; d < 3; ++d) {
+        fs::path dir = root_dir / ("dir" + std::to_string(d));
+        fs::create_directories(dir);
+        // more files than the ring has slots, so it runs full and waits
+        for (int f = 0; f < 60; ++f) {
+            std::ofstream ofs(dir / ("file" + std::to_string(f)), std::ios::binary);
+            ofs << (f % 5 == 4 ? "text" : "\x7f" "ELF") << std::string(100 + 37 * f, 'x');
+            if ((d + f) % 6 == 0) ofs << "\xDE\xAD\xBE\xEF";
+        }
+    }
+    std::ofstream(root_dir / "empty").close();
+    // compressed and too big for the ring: both go the blocking way
+    std::vector<std::uint8_t> infected = elf;
+    infected.insert(infected.end(), 1000, 'y');
+    infected.insert(infected.end(), signature.begin(), signature.end());
+    write_gzip(root_dir / "packed.gz", infected);
+    {
+        std::ofstream ofs(root_dir / "big", std::ios::binary);
+        ofs << "\x7f" "ELF" << std::string(uring_file_limit, 'z') << "\xDE\xAD\xBE\xEF";
+    }
+
+    std::vector<std::string> blocking = capture_scan(root_dir, signature).lines;
+    REQUIRE(blocking.size() == 26);
+    scan_options ring;
+    ring.io_uring = true;
+    REQUIRE(capture_scan(root_dir, signature, ring).lines == blocking);
+    ring.checkpoint_file = "test_files/uring.ckpt";
+    REQUIRE(capture_scan(root_dir, signature, ring).lines == blocking);
+    REQUIRE(!fs::exists(ring.checkpoint_file));
+    INFO("io_uring available: " << uring_available());
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("a directory summary reports unchanged files without reading them", "[dir_summary]") {
+    fs::path root_dir = "test_summary_root";
+    fs::create_directories(root_dir / "a");
+    fs::create_directories(root_dir / "b");
+    auto write = [](const fs::path& path, const std::string& content) {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs << content;
+    };
+    write(root_dir / "a" / "infected", "\x7f" "ELF" "xx\xDE\xAD\xBE\xEF");
+    write(root_dir / "a" / "clean", "\x7f" "ELFxxxx");
+    write(root_dir / "b" / "infected", "\x7f" "ELF" "\xDE\xAD\xBE\xEF" "yy");
+
+    scan_options options;
+    options.summary_file = "test_files/summary";
+    fs::remove(options.summary_file);
+    auto run = [&](const std::vector<std::uint8_t>& signature, std::uint64_t& unchanged) {
+        scan_capture scan = capture_scan(root_dir, signature, options, false, scan_counter::files_unchanged);
+        unchanged = scan.counted;
+        return scan.hits;
+    };
+    // the files were just written, a summary taken right after does not vouch for them. one taken
+    // a while later would
+    auto age = [&]() {
+        dir_summary summary;
+        REQUIRE(load_summary(options.summary_file, summary));
+        summary.taken_ns += 10000000000LL;
+        REQUIRE(save_summary(options.summary_file, summary));
+    };
+
+    const std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+    std::uint64_t unchanged = 0;
+    std::vector<std::string> first = run(signature, unchanged);
+    REQUIRE(first.size() == 2);
+    REQUIRE(unchanged == 0);
+    REQUIRE(run(signature, unchanged) == first);
+    REQUIRE(unchanged == 0);
+
+    age();
+    REQUIRE(run(signature, unchanged) == first);
+    REQUIRE(unchanged == 3);
+
+    // rewritten in place: another size and ctime, read again
+    age();
+    write(root_dir / "a" / "clean", "\x7f" "ELF" "\xDE\xAD\xBE\xEF");
+    std::vector<std::string> third = run(signature, unchanged);
+    REQUIRE(third.size() == 3);
+    REQUIRE(unchanged == 2);
+
+    // with trusted directory times the files in unchanged directories are not stat'ed either
+    age();
+    options.trust_dir_times = true;
+    REQUIRE(run(signature, unchanged) == third);
+    REQUIRE(unchanged == 3);
+
+    // another signature does not use the summary
+    age();
+    REQUIRE(run({0xDE, 0xAD}, unchanged).size() == 3);
+    REQUIRE(unchanged == 0);
+
+    // a summary that does not add up is not a summary
+    dir_summary summary;
+    REQUIRE(load_summary(options.summary_file, summary));
+    REQUIRE(summary.directories.size() == 3);
+    summary.directories["a"].entries.front().hits.clear();
+    REQUIRE(save_summary(options.summary_file, summary));
+    REQUIRE(!load_summary(options.summary_file, summary));
+
+    fs::remove(options.summary_file);
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("scanner scans the paths of a file list", "[files_from]") {
+    fs::path root_dir = "test_list_root";
+    fs::create_directories(root_dir / "dir");
+    auto write = [](const fs::path& path, const std::string& content) {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        ofs << content;
+    };
+    const std::string infected = "\x7f" "ELF" "\xDE\xAD\xBE\xEF";
+    write(root_dir / "listed", infected);
+    write(root_dir / "not listed", infected);
+    write(root_dir / "new\nline", infected);
+    write(root_dir / "dir" / "below", infected);
+    write(root_dir / "dir" / "skipped.tmp", infected);
+
+    auto run = [&](const std::string& list, const scan_options& base) {
+        scan_options options = base;
+        options.files_from = "test_files/list";
+        write(options.files_from, list);
+        // a name may have a newline
+        std::vector<std::string> hits = capture_scan(fs::path(), {0xDE, 0xAD, 0xBE, 0xEF}, options, true).hits;
+        fs::remove(options.files_from);
+        return hits;
+    };
+
+    // NUL separated, so the newline is part of a name. gone and empty entries are skipped, a
+    // directory is walked, the last path needs no separator
+    const std::string root = root_dir.string();
+    const std::string nul(1, '\0');
+    std::string list = root + "/listed" + nul + root + "/missing" + nul + nul + root + "/new\nline" + nul + root + "/dir";
+    std::vector<std::string> expected = {root + "/dir/below", root + "/dir/skipped.tmp", root + "/listed",
+                                         root + "/new\nline"};
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(run(list, scan_options()) == expected);
+
+    scan_options threaded;
+    threaded.threads = 3;
+    threaded.exclude = {"*.tmp"};
+    expected.erase(std::find(expected.begin(), expected.end(), root + "/dir/skipped.tmp"));
+    REQUIRE(run(list, threaded) == expected);
+
+    // newline separated, as ls or a change feed writes it
+    REQUIRE(run(root + "/listed\n" + root + "/dir/below\n", scan_options())
+            == std::vector<std::string>{root + "/dir/below", root + "/listed"});
+    // or on windows
+    REQUIRE(run(root + "/listed\r\n" + root + "/dir/below\r\n", scan_options())
+            == std::vector<std::string>{root + "/dir/below", root + "/listed"});
+
+    // from a pipe, the first path is scanned while the writer still holds it open
+    int ends[2];
+    REQUIRE(pipe(ends) == 0);
+    enable_metrics(true);
+    auto scanned = [] { return collect_metrics().counters[static_cast<std::size_t>(scan_counter::files_scanned)]; };
+    const std::uint64_t before = scanned();
+    bool early = false;
+    std::thread writer([&] {
+        const std::string first = root + "/listed\n";
+        const std::string rest = root + "/dir/below\n";
+        if (::write(ends[1], first.data(), first.size()) == static_cast<ssize_t>(first.size())) {
+            auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (scanned() == before && std::chrono::steady_clock::now() < give_up) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            early = scanned() > before;
+            (void)!::write(ends[1], rest.data(), rest.size());
+        }
+        ::close(ends[1]);
+    });
+    scan_options piped;
+    piped.files_from = "/dev/fd/" + std::to_string(ends[0]);
+    const std::string output = capture_scan(fs::path(), {0xDE, 0xAD, 0xBE, 0xEF}, piped).output;
+    writer.join();
+    ::close(ends[0]);
+    enable_metrics(false);
+    REQUIRE(early);
+    REQUIRE(output == root + "/listed is infected!\n" + root + "/dir/below is infected!\n");
+
+    // a list that is not there throws out of scanner(), find_sig finds out before it starts and exits 1
+    scan_options missing;
+    missing.files_from = "test_files/no such list";
+    int code = 0;
+    try {
+        scanner(fs::path(), {0xDE, 0xAD, 0xBE, 0xEF}, missing);
+    }
+    catch (int error) {
+        code = error;
+    }
+    REQUIRE(code == CANT_OPEN);
+    write("test_files/list.sig", "\xDE\xAD\xBE\xEF");
+    std::string refusal;
+    REQUIRE(run_find_sig("--files-from 'test_files/no such list' test_files/list.sig", refusal) == 1);
+    REQUIRE(refusal == "could'nt open the list of files test_files/no such list\n");
+    fs::remove("test_files/list.sig");
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("a sharded scan over local workers reports what the plain scan does", "[shard_scan]") {
+    fs::path root_dir = "test_shard_root";
+    const std::string infected = "\x7f" "ELF" "\xDE\xAD\xBE\xEF";
+    for (int d = 0; d < 4; ++d) {
+        for (int s = 0; s < 3; ++s) {
+            fs::path dir = root_dir / ("dir" + std::to_string(d)) / ("sub" + std::to_string(s));
+            fs::create_directories(dir);
+            for (int f = 0; f < 20; ++f) {
+                std::ofstream ofs(dir / ("file" + std::to_string(f)), std::ios::binary);
+                ofs << ((d + s + f) % 7 == 0 ? infected : std::string("\x7f" "ELFclean"));
+            }
+        }
+    }
+    std::ofstream(root_dir / "top", std::ios::binary) << infected;
+    // back up to the root, which the plain walk does not enter again. neither may a piece below it
+    fs::create_directory_symlink("../..", root_dir / "dir1" / "sub1" / "up");
+    const std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+
+    auto hits = [](const std::string& text) {
+        std::vector<std::string> lines;
+        std::istringstream in(text);
+        for (std::string line; std::getline(in, line);) lines.push_back(line);
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    };
+    std::ostringstream plain;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(plain.rdbuf());
+    scanner(root_dir, signature, scan_options());
+    std::cout.rdbuf(oldCoutBuf);
+    REQUIRE(hits(plain.str()).size() == 35);
+
+    // one piece up front: the other workers only get work by splitting the first one's
+    for (std::size_t shards : {std::size_t(1), default_shards}) {
+        const std::string address = "unix:test_files/shards.sock";
+        std::ostringstream merged;
+        oldCoutBuf = std::cout.rdbuf(merged.rdbuf());
+        std::thread coordinator([&] { shard_coordinator(root_dir, address, signature_list{{signature}, {}}, scan_options(), shards); });
+        std::vector<std::thread> workers;
+        for (int w = 0; w < 3; ++w) {
+            workers.emplace_back([&] { shard_worker(address, signature_list{{signature}, {}}, scan_options()); });
+        }
+        for (auto& worker : workers) worker.join();
+        coordinator.join();
+        std::cout.rdbuf(oldCoutBuf);
+        INFO("shards " << shards);
+        REQUIRE(hits(merged.str()) == hits(plain.str()));
+    }
+
+    // a worker with other signatures is turned away
+    const std::string address = "unix:test_files/shards.sock";
+    std::ostringstream ignored;
+    oldCoutBuf = std::cout.rdbuf(ignored.rdbuf());
+    std::thread coordinator([&] { shard_coordinator(root_dir, address, signature_list{{signature}, {}}, scan_options(), 4); });
+    bool refused = false;
+    std::ostringstream refusal;
+    std::streambuf* oldCerrBuf = std::cerr.rdbuf(refusal.rdbuf());
+    try {
+        shard_worker(address, signature_list{{{0xDE, 0xAD}}, {}}, scan_options());
+    }
+    catch (int code) {
+        refused = code == CANT_READ;
+    }
+    std::cerr.rdbuf(oldCerrBuf);
+    shard_worker(address, signature_list{{signature}, {}}, scan_options());
+    coordinator.join();
+    std::cout.rdbuf(oldCoutBuf);
+    REQUIRE(refused);
+    REQUIRE(refusal.str() == "the coordinator at " + address + " refused this worker: the worker has other signatures\n");
+
+    // a worker that speaks the protocol by hand: takes the whole tree, splits dir0 and dir1 off
+    // when asked and goes away. the rest of its piece is scanned again, what it gave away once
+    auto message = [](const std::vector<std::string>& fields) {
+        std::string out = std::to_string(fields.size()) + "\n";
+        for (const auto& field : fields) out += std::to_string(field.size()) + "\n" + field + "\n";
+        return out;
+    };
+    auto connect_to = [](const std::string& path) {
+        sockaddr_un socketAddress = {};
+        socketAddress.sun_family = AF_UNIX;
+        path.copy(socketAddress.sun_path, path.size());
+        for (;;) {
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (::connect(fd, reinterpret_cast<const sockaddr*>(&socketAddress), sizeof(socketAddress)) == 0) return fd;
+            ::close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    };
+    auto wait_for = [](int fd, const std::string& wanted) {
+        std::string received;
+        char buffer[4096];
+        ssize_t n;
+        while (received.find(wanted) == std::string::npos && (n = ::read(fd, buffer, sizeof(buffer))) > 0) {
+            received.append(buffer, n);
+        }
+        return received.find(wanted) != std::string::npos;
+    };
+    const std::string hello = message({"hello", "find_sig shards 1",
+                                       std::to_string(hash_signatures({signature}, {}))});
+    std::ostringstream rescanned;
+    oldCoutBuf = std::cout.rdbuf(rescanned.rdbuf());
+    std::thread splitCoordinator([&] { shard_coordinator(root_dir, address, signature_list{{signature}, {}}, scan_options(), 1); });
+    int fake = connect_to("test_files/shards.sock");
+    const std::string opening = hello + message({"next"});
+    REQUIRE(::write(fake, opening.data(), opening.size()) == static_cast<ssize_t>(opening.size()));
+    REQUIRE(wait_for(fake, "5\nshard\n0\n\n"));
+    std::thread taker([&] { shard_worker(address, signature_list{{signature}, {}}, scan_options()); });
+    REQUIRE(wait_for(fake, "5\nsplit\n"));
+    const std::string donated = message({"donated", "dir0", "dir1"});
+    REQUIRE(::write(fake, donated.data(), donated.size()) == static_cast<ssize_t>(donated.size()));
+    ::close(fake);
+    taker.join();
+    splitCoordinator.join();
+    std::cout.rdbuf(oldCoutBuf);
+    REQUIRE(hits(rescanned.str()) == hits(plain.str()));
+
+    // one that goes away when nobody else is there to take its piece fails the scan
+    bool lost = false;
+    oldCoutBuf = std::cout.rdbuf(ignored.rdbuf());
+    std::thread lostCoordinator([&] {
+        try {
+            shard_coordinator(root_dir, address, signature_list{{signature}, {}}, scan_options(), 1);
+        }
+        catch (int code) {
+            lost = code == CANT_READ;
+        }
+    });
+    fake = connect_to("test_files/shards.sock");
+    REQUIRE(::write(fake, opening.data(), opening.size()) == static_cast<ssize_t>(opening.size()));
+    REQUIRE(wait_for(fake, "5\nshard\n"));
+    ::close(fake);
+    lostCoordinator.join();
+    std::cout.rdbuf(oldCoutBuf);
+    REQUIRE(lost);
+
+    // a coordinator that hangs up on the hello (it is done) is not reported as a refusal
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un listenAddress = {};
+    listenAddress.sun_family = AF_UNIX;
+    const std::string hangUp = "test_files/hang_up.sock";
+    hangUp.copy(listenAddress.sun_path, hangUp.size());
+    ::unlink(hangUp.c_str());
+    REQUIRE(::bind(listener, reinterpret_cast<const sockaddr*>(&listenAddress), sizeof(listenAddress)) == 0);
+    REQUIRE(::listen(listener, 1) == 0);
+    std::thread closer([&] {
+        int accepted = ::accept(listener, nullptr, nullptr);
+        wait_for(accepted, "hello");
+        ::close(accepted);
+    });
+    bool hungUp = false;
+    std::ostringstream closing;
+    oldCerrBuf = std::cerr.rdbuf(closing.rdbuf());
+    try {
+        shard_worker("unix:" + hangUp, signature_list{{signature}, {}}, scan_options());
+    }
+    catch (int code) {
+        hungUp = code == CANT_READ;
+    }
+    std::cerr.rdbuf(oldCerrBuf);
+    closer.join();
+    ::close(listener);
+    ::unlink(hangUp.c_str());
+    REQUIRE(hungUp);
+    REQUIRE(closing.str() == "the coordinator at unix:" + hangUp + " closed the connection\n");
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("an isolated scan reports what the plain scan does and survives a worker dying", "[isolated_scan]") {
+    fs::path root_dir = "test_isolated_root";
+    const std::string infected = "\x7f" "ELF" "\xDE\xAD\xBE\xEF";
+    for (int d = 0; d < 4; ++d) {
+        fs::create_directories(root_dir / ("dir" + std::to_string(d)));
+        for (int f = 0; f < 500; ++f) {
+            std::ofstream ofs(root_dir / ("dir" + std::to_string(d)) / ("file" + std::to_string(f)), std::ios::binary);
+            ofs << ((d + f) % 7 == 0 ? infected : std::string("\x7f" "ELFclean"));
+        }
+    }
+    const std::vector<std::uint8_t> signature = {0xDE, 0xAD, 0xBE, 0xEF};
+
+    // the hits, the files that took a worker down go to crashed
+    auto run = [&](const scan_options& options, std::vector<std::string>& crashed) {
+        scan_capture scan = capture_scan(root_dir, signature, options);
+        const std::string crash = " crashed a scan worker (signal 11)";
+        for (const std::string& line : scan.lines) {
+            if (line.size() > crash.size() && line.compare(line.size() - crash.size(), crash.size(), crash) == 0) {
+                crashed.push_back(line.substr(0, line.size() - crash.size()));
+            }
+        }
+        return scan.hits;
+    };
+
+    std::vector<std::string> crashed;
+    const std::vector<std::string> plain = run(scan_options(), crashed);
+    REQUIRE(plain.size() == 285);
+
+    scan_options isolated;
+    isolated.isolate = 3;
+    REQUIRE(run(isolated, crashed) == plain);
+    REQUIRE(crashed.empty());
+
+    // a worker killed mid scan: the file it was on is reported as crashed, everything else as before.
+    // the workers are the children of the zygote, the scan's only child
+    std::atomic<bool> scanning{true};
+    std::thread killer([&] {
+        while (scanning) {
+            for (const auto& task : fs::directory_iterator("/proc/self/task")) {
+                std::ifstream children(task.path() / "children");
+                pid_t zygote, child;
+                if (!(children >> zygote)) continue;
+                std::ifstream workers("/proc/" + std::to_string(zygote) + "/task/" + std::to_string(zygote) + "/children");
+                if (workers >> child) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    ::kill(child, SIGSEGV);
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    });
+    const std::vector<std::string> survived = run(isolated, crashed);
+    scanning = false;
+    killer.join();
+    REQUIRE(crashed.size() <= 1);
+    std::vector<std::string> missing;
+    std::set_difference(plain.begin(), plain.end(), survived.begin(), survived.end(), std::back_inserter(missing));
+    REQUIRE(std::includes(plain.begin(), plain.end(), survived.begin(), survived.end()));
+    for (const auto& path : missing) REQUIRE(std::find(crashed.begin(), crashed.end(), path) != crashed.end());
+
+    // a file whose read fails (EIO from a sysfs attribute without runtime power management, where
+    // the machine has one) is left out, the scan goes on
+    const fs::path failing = "/sys/devices/software/power/autosuspend_delay_ms";
+    char probe;
+    const int probeFd = ::open(failing.c_str(), O_RDONLY);
+    const bool readFails = probeFd >= 0 && ::read(probeFd, &probe, 1) < 0;
+    if (probeFd >= 0) ::close(probeFd);
+    if (readFails) {
+        fs::create_symlink(failing, root_dir / "dir0" / "broken");
+        const scan_capture skipped = capture_scan(root_dir, signature, isolated);
+        REQUIRE(skipped.output.find((root_dir / "dir0" / "broken").string() + " could not be read, skipped\n") != std::string::npos);
+        REQUIRE(skipped.hits == plain);
+
+        // the in-process scan stops on it, find_sig says so and exits 1 instead of aborting
+        {
+            std::ofstream ofs("test_files/isolated.sig", std::ios::binary);
+            ofs.write(reinterpret_cast<const char*>(signature.data()), static_cast<std::streamsize>(signature.size()));
+        }
+        std::string output;
+        REQUIRE(run_find_sig(root_dir.string() + " test_files/isolated.sig 2>/dev/null", output) == 1);
+        REQUIRE(output.find("could'nt read a file, the scan is not complete\n") != std::string::npos);
+        fs::remove("test_files/isolated.sig");
+    }
+
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("a file out of time is reported with its coverage and a passed deadline stops the scan", "[scan_budget]") {
+    fs::path root_dir = "test_budget_root";
+    fs::create_directories(root_dir);
+    const std::string signature = "\xDE\xAD\xBE\xEF";
+    {
+        // the signature at the very end, a scan out of time does not get there
+        std::string big(4 << 20, 'x');
+        big.replace(0, 4, "\x7f" "ELF");
+        big.replace(big.size() - 4, 4, signature);
+        std::ofstream(root_dir / "big", std::ios::binary) << big;
+        std::ofstream(root_dir / "small", std::ios::binary) << "\x7f" "ELF" << signature;
+        std::ofstream(root_dir / "a_small", std::ios::binary) << "\x7f" "ELF" << signature;
+    }
+    const std::string big = (root_dir / "big").string();
+    const std::string small = (root_dir / "small").string();
+    const std::string firstSmall = (root_dir / "a_small").string();
+
+    auto run = [&](const scan_options& options) {
+        return capture_scan(root_dir, {0xDE, 0xAD, 0xBE, 0xEF}, options).output;
+    };
+
+    // 1MB/s: the 4MB file takes 4s, it is given up on after 200ms with what was read by then. a
+    // failed REQUIRE must not leave the tests after this one throttled
+    struct rate_reset {
+        ~rate_reset(){ set_io_rate_limit(0); }
+    } resetRate;
+    set_io_rate_limit(1 << 20);
+    for (unsigned isolate : {0u, 2u}) {
+        scan_options options;
+        options.file_timeout = std::chrono::milliseconds(200);
+        options.isolate = isolate;
+        const std::string output = run(options);
+        INFO(output);
+        REQUIRE(output.find(small + " is infected!") != std::string::npos);
+        REQUIRE(output.find(big + " is infected!") == std::string::npos);
+        std::smatch coverage;
+        REQUIRE(std::regex_search(output, coverage, std::regex(big + " timed out after ([0-9]+) of 4194304 bytes")));
+        const std::uint64_t covered = std::stoull(coverage[1]);
+        REQUIRE(covered > 0);
+        REQUIRE(covered < (4u << 20));
+    }
+
+    // the deadline runs out in the middle of the big file: it is reported with its coverage and
+    // not done, a resume starts in front of it
+    const std::string checkpoint = "test_files/budget.ckpt";
+    for (int mode = 0; mode < 3; ++mode) {
+        set_io_rate_limit(1 << 20);
+        scan_options cut;
+        cut.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+        cut.checkpoint_file = checkpoint;
+        cut.isolate = mode == 1 ? 2 : 0;
+        cut.threads = mode == 2 ? 2 : 1;
+        const std::string output = run(cut);
+        INFO("mode " << mode << "\n" << output);
+        REQUIRE(output.find(firstSmall + " is infected!") != std::string::npos);
+        REQUIRE(output.find(big + " is infected!") == std::string::npos);
+        REQUIRE(output.find("deadline reached, continue with --resume") != std::string::npos);
+        std::smatch coverage;
+        REQUIRE(std::regex_search(output, coverage, std::regex(big + " timed out after ([0-9]+) of 4194304 bytes")));
+        REQUIRE(std::stoull(coverage[1]) > 0);
+
+        set_io_rate_limit(0);
+        scan_options resumed;
+        resumed.checkpoint_file = checkpoint;
+        resumed.resume = true;
+        const std::string rest = run(resumed);
+        INFO(rest);
+        REQUIRE(rest.find("resuming after /a_small\n") != std::string::npos);
+        REQUIRE(rest.find(big + " is infected!") != std::string::npos);
+        REQUIRE(rest.find(small + " is infected!") != std::string::npos);
+        REQUIRE(!fs::exists(checkpoint));
+    }
+
+    // a gzip'ed file runs out of time in the decompressor's input
+    std::mt19937 random(7);
+    std::vector<std::uint8_t> noise(4 << 20);
+    for (auto& byte : noise) byte = static_cast<std::uint8_t>(random());
+    std::copy(signature.begin(), signature.end(), noise.end() - 4);
+    noise[0] = 0x7F; noise[1] = 'E'; noise[2] = 'L'; noise[3] = 'F';
+    const fs::path packed = root_dir / "noise.gz";
+    write_gzip(packed, noise);
+    set_io_rate_limit(1 << 20);
+    scan_options slow;
+    slow.file_timeout = std::chrono::milliseconds(200);
+    {
+        std::ostringstream captured;
+        std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+        const std::size_t hits = scan_path(packed, signature_matcher({0xDE, 0xAD, 0xBE, 0xEF}), slow, nullptr);
+        std::cout.rdbuf(oldCoutBuf);
+        REQUIRE(hits == 0);
+        REQUIRE(std::regex_search(captured.str(), std::regex(packed.string() + " timed out after [0-9]+ of "
+                                                             + std::to_string(fs::file_size(packed)) + " bytes")));
+    }
+
+    // a tar, plain or compressed (the data.tar of a .deb), reads under the budget of its file
+    fs::create_directories(root_dir / "layer");
+    std::ofstream(root_dir / "layer" / "noise", std::ios::binary).write(reinterpret_cast<const char*>(noise.data()), noise.size());
+    const std::string dir = root_dir.string();
+    REQUIRE(system(("tar -C " + dir + "/layer -cf " + dir + "/layer.tar .").c_str()) == 0);
+    REQUIRE(system(("tar -C " + dir + "/layer -czf " + dir + "/layer.tar.gz .").c_str()) == 0);
+    for (const std::string& tarball : {dir + "/layer.tar", dir + "/layer.tar.gz"}) {
+        const int fd = ::open(tarball.c_str(), O_RDONLY);
+        REQUIRE(fd >= 0);
+        const off_t size = static_cast<off_t>(fs::file_size(tarball));
+        int code = 0;
+        try {
+            file_budget budget(slow, static_cast<std::uint64_t>(size));
+            scan_tar_range(fd, 0, size, signature_matcher({0xDE, 0xAD, 0xBE, 0xEF}), slow, [](const std::string&) {});
+        }
+        catch (int error) {
+            code = error;
+        }
+        ::close(fd);
+        INFO(tarball);
+        REQUIRE(code == TIMED_OUT);
+        REQUIRE(last_file_coverage().timed_out);
+        REQUIRE(last_file_coverage().covered > 0);
+        REQUIRE(last_file_coverage().covered < static_cast<std::uint64_t>(size));
+    }
+    set_io_rate_limit(0);
+
+    // past the deadline nothing is started, a checkpoint picks up from there
+    fs::remove_all(root_dir / "layer");
+    fs::remove(root_dir / "layer.tar");
+    fs::remove(root_dir / "layer.tar.gz");
+    fs::remove(packed);
+    scan_options late;
+    late.deadline = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+    late.checkpoint_file = checkpoint;
+    const std::string stopped = run(late);
+    REQUIRE(stopped.find("deadline reached, continue with --resume") != std::string::npos);
+    REQUIRE(stopped.find("is infected!") == std::string::npos);
+
+    scan_options resumed;
+    resumed.checkpoint_file = late.checkpoint_file;
+    resumed.resume = true;
+    const std::string rest = run(resumed);
+    REQUIRE(rest.find(big + " is infected!") != std::string::npos);
+    REQUIRE(rest.find(small + " is infected!") != std::string::npos);
+
+    // scanner() says whether it got to the end, find_sig exits 2 when it did not
+    scan_options lateOnly;
+    lateOnly.deadline = late.deadline;
+    REQUIRE(!capture_scan(root_dir, {0xDE, 0xAD, 0xBE, 0xEF}, lateOnly).completed);
+    REQUIRE(capture_scan(root_dir, {0xDE, 0xAD, 0xBE, 0xEF}).completed);
+    std::ofstream("test_files/budget.sig", std::ios::binary) << signature;
+    std::string partial, whole;
+    REQUIRE(run_find_sig("--deadline 0 " + root_dir.string() + " test_files/budget.sig", partial) == 2);
+    REQUIRE(partial.find("deadline reached, the scan is not complete") != std::string::npos);
+    REQUIRE(run_find_sig(root_dir.string() + " test_files/budget.sig", whole) == 0);
+    REQUIRE(whole.find(big + " is infected!") != std::string::npos);
+    fs::remove("test_files/budget.sig");
+
+    fs::remove(late.checkpoint_file);
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("huge page allocations are 2MB aligned and counted in the coverage report", "[huge_pages]") {
+    huge_page_report before = huge_page_coverage();
+    {
+        std::vector<std::uint8_t, huge_page_allocator<std::uint8_t>> small(4096, 1);
+        REQUIRE(huge_page_coverage().bytes == before.bytes);
+
+        std::vector<std::uint8_t, huge_page_allocator<std::uint8_t>> big(3 * huge_page_size, 1);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(big.data()) % huge_page_size == 0);
+        huge_page_report during = huge_page_coverage();
+        REQUIRE(during.bytes == before.bytes + 3 * huge_page_size);
+        REQUIRE(during.hugetlb_bytes + during.thp_bytes <= during.bytes);
+    }
+    // released mappings stay in the totals
+    REQUIRE(huge_page_coverage().bytes == before.bytes + 3 * huge_page_size);
+
+    enable_huge_pages(false);
+    {
+        std::vector<std::uint8_t, huge_page_allocator<std::uint8_t>> big(3 * huge_page_size, 1);
+        REQUIRE(huge_page_coverage().bytes == before.bytes + 3 * huge_page_size);
+    }
+    enable_huge_pages(true);
+}
+
+TEST_CASE("signature sets find the leftmost match of any signature, big ones through the prefilter", "[signature_prefilter]") {
+    std::mt19937 rng(4321);
+    // 5 signatures are searched one by one, 100 go through 2 byte grams, 3000 through 3 byte grams
+    for (std::size_t count : {5, 100, 3000}) {
+        std::uniform_int_distribution<int> byte(0, count < 100 ? 3 : 63);
+        std::uniform_int_distribution<std::size_t> length(4, 16);
+        signature_set sigs(count);
+        for (auto& sig : sigs) {
+            sig.resize(length(rng));
+            for (auto& b : sig) b = static_cast<std::uint8_t>(byte(rng));
+        }
+        // too short for the grams, searched on its own next to the prefilter
+        sigs.push_back({200, 201});
+        signature_matcher matcher(sigs);
+        REQUIRE(matcher.size() <= 16);
+
+        for (int round = 0; round < 8; ++round) {
+            std::vector<std::uint8_t> hay(500 + round * 100);
+            for (auto& b : hay) b = static_cast<std::uint8_t>(byte(rng));
+            const auto& planted = sigs[static_cast<std::size_t>(round) * 7 % sigs.size()];
+            if (round % 2 == 0) std::copy(planted.begin(), planted.end(), hay.end() - planted.size());
+
+            const std::uint8_t* expected = hay.data() + hay.size();
+            for (const auto& sig : sigs) {
+                const std::uint8_t* hit = std::search(hay.data(), hay.data() + hay.size(), sig.begin(), sig.end());
+                expected = std::min(expected, hit);
+            }
+            INFO(count << " signatures, round " << round);
+            REQUIRE(matcher.find(hay.data(), hay.data() + hay.size()) == expected);
+        }
+    }
+
+    fs::path list = "test_files/signatures.txt";
+    {
+        std::ofstream ofs(list);
+        ofs << "# two signatures\n7f454c46\n\nde ad BE EF\n";
+    }
+    REQUIRE(extract_sig_list(list).literals == signature_set{{0x7F, 0x45, 0x4C, 0x46}, {0xDE, 0xAD, 0xBE, 0xEF}});
+    {
+        std::ofstream ofs(list);
+        ofs << "7f454c4\n";
+    }
+    REQUIRE_THROWS_AS(extract_sig_list(list), int);
+    fs::remove(list);
+}
+
+static std::string random_regex(std::mt19937& rng, int depth) {
+    const char* atoms[] = {"a", "b", "c", ".", "[ab]", "[^a]", "\\x61", "ab", "ca"};
+    switch (depth > 2 ? 0 : rng() % 5) {
+        case 0: return atoms[rng() % 9];
+        case 1: return random_regex(rng, depth + 1) + random_regex(rng, depth + 1);
+        case 2: return "(?:" + random_regex(rng, depth + 1) + "|" + random_regex(rng, depth + 1) + ")";
+        // quantifiers only on atoms, nested ones send std::regex into exponential backtracking
+        case 3: return "(?:" + std::string(atoms[rng() % 9]) + ")" + std::string(1, "*+?"[rng() % 3]);
+        default: return "(?:" + std::string(atoms[rng() % 9]) + "){1,3}";
+    }
+}
+
+TEST_CASE("regex signatures agree with std::regex fed in pieces and survive the dfa state limit", "[byte_regex]") {
+    std::mt19937 rng(99);
+    for (int round = 0; round < 300; ++round) {
+        std::string pattern = random_regex(rng, 0) + "cab" + random_regex(rng, 1);
+        std::string hay(rng() % 200, 'a');
+        for (auto& c : hay) c = "abc"[rng() % 3];
+        if (round % 2 == 0 && hay.size() > 10) hay.replace(rng() % (hay.size() - 5), 3, "cab");
+
+        byte_regex regex(pattern);
+        byte_regex_stream stream(regex);
+        const auto* data = reinterpret_cast<const std::uint8_t*>(hay.data());
+        const std::size_t piece = 1 + rng() % 17;
+        for (std::size_t i = 0; i < hay.size(); i += piece) stream.feed(data + i, std::min(piece, hay.size() - i));
+        INFO("/" << pattern << "/ on " << hay);
+        REQUIRE(stream.found() == std::regex_search(hay, std::regex(pattern)));
+    }
+
+    // the literal prefilter: "http://" is required and a match starts right at it
+    byte_regex url("http://[a-z.]{1,40}/\\x48\\x8b\\x05");
+    REQUIRE(url.required() == std::vector<std::uint8_t>{'h', 't', 't', 'p', ':', '/', '/'});
+    REQUIRE(url.lead() == 0);
+    REQUIRE(byte_regex("[a-z]{2,4}\\.exe").lead() == 4);
+    REQUIRE_THROWS_AS(byte_regex("(ab"), std::invalid_argument);
+    REQUIRE_THROWS_AS(byte_regex("a{5,2}"), std::invalid_argument);
+
+    // 2^13 dfa states, far over the limit: the states are flushed and the answer stays right
+    const std::string exploding = "(?:a|b)*a(?:a|b){12}c";
+    std::string hay(20000, 'a');
+    for (auto& c : hay) c = "ab"[rng() % 2];
+    hay.replace(15000, 14, "a" + std::string(12, 'b') + "c");
+    enable_metrics(true);
+    const std::uint64_t flushesBefore = collect_metrics().counters[static_cast<std::size_t>(scan_counter::regex_dfa_flushes)];
+    byte_regex_stream big{byte_regex(exploding)};
+    big.feed(reinterpret_cast<const std::uint8_t*>(hay.data()), hay.size());
+    REQUIRE(big.found());
+    REQUIRE(collect_metrics().counters[static_cast<std::size_t>(scan_counter::regex_dfa_flushes)] > flushesBefore);
+    enable_metrics(false);
+    hay[15013] = 'a';
+    big.reset();
+    big.feed(reinterpret_cast<const std::uint8_t*>(hay.data()), hay.size());
+    REQUIRE(!big.found());
+
+    // in contains_signature the regex runs over the chunks in the same pass as the literals
+    fs::path path = "test_files/regex_target";
+    {
+        std::ofstream ofs(path, std::ios::binary);
+        std::string content = "\x7f" "ELF" + std::string(100, '\0') + "http://evil.example/\x48\x8b\x05" + std::string(100, '\0');
+        ofs << content;
+    }
+    signature_list list{{{0xCA, 0xFE, 0xBA, 0xBE}}, {"http://[a-z.]{1,40}/\\x48\\x8b\\x05"}};
+    signature_matcher matcher(list);
+    scan_options options;
+    options.chunk_size = 16; // the url is cut over three chunks
+    REQUIRE(contains_signature(path, matcher, options));
+    signature_matcher other(signature_list{{}, {"http://[a-z.]{1,40}/\\x48\\x8b\\x06"}});
+    REQUIRE(!contains_signature(path, other, options));
+    fs::remove(path);
+}
+
+TEST_CASE("stream_matcher finds a signature split over many pieces", "[signature_matcher]") {
+    std::vector<std::uint8_t> sig = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    std::vector<std::uint8_t> data(100, 0);
+    std::copy(sig.begin(), sig.end(), data.begin() + 45);
+
+    signature_matcher matcher(sig);
+    for (std::size_t piece = 1; piece <= 12; ++piece) {
+        stream_matcher stream(matcher);
+        for (std::size_t i = 0; i < data.size(); i += piece) {
+            stream.feed(data.data() + i, std::min(piece, data.size() - i));
+        }
+        INFO("piece size " << piece);
+        REQUIRE(stream.found());
+    }
+}
+
 TEST_CASE("extract_sig on a sig file", "[file_scanner]") {
     fs::path sig_path = "test_files/test_signature.sig";
 
@@ -264,6 +1713,88 @@ TEST_CASE("scanner prints infected ELF files and std::cout is redirected", "[fil
     fs::remove_all(root_dir);
 }
 
+TEST_CASE("metrics file counts bytes, non-ELF skips and phases", "[scan_metrics]") {
+    fs::path root_dir = "test_metrics_root";
+    fs::create_directories(root_dir);
+    fs::path metrics_path = "test_files/find_sig.prom";
+
+    {
+        std::ofstream ofs(root_dir / "infected", std::ios::binary);
+        std::vector<std::uint8_t> data = {0x7F, 'E', 'L', 'F', 0xDE, 0xAD, 0xBE, 0xEF};
+        ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    {
+        std::ofstream ofs(root_dir / "text", std::ios::binary);
+        ofs << "not an elf at all";
+    }
+
+    enable_metrics(true);
+    metrics_snapshot before = collect_metrics();
+
+    std::ostringstream captured;
+    std::streambuf* oldCoutBuf = std::cout.rdbuf(captured.rdbuf());
+    scanner(root_dir, {0xDE, 0xAD, 0xBE, 0xEF});
+    std::cout.rdbuf(oldCoutBuf);
+
+    metrics_snapshot after = collect_metrics();
+    REQUIRE(write_metrics_file(metrics_path));
+    enable_metrics(false);
+
+    auto counter = [](const metrics_snapshot& m, scan_counter c) {
+        return m.counters[static_cast<std::size_t>(c)];
+    };
+    REQUIRE(counter(after, scan_counter::files_scanned) - counter(before, scan_counter::files_scanned) == 2);
+    REQUIRE(counter(after, scan_counter::skipped_non_elf) - counter(before, scan_counter::skipped_non_elf) == 1);
+    REQUIRE(counter(after, scan_counter::infected) - counter(before, scan_counter::infected) == 1);
+    REQUIRE(counter(after, scan_counter::bytes_read) - counter(before, scan_counter::bytes_read) == 8);
+
+    std::ifstream in(metrics_path);
+    std::stringstream text;
+    text << in.rdbuf();
+    INFO("Metrics file:\n" << text.str());
+    REQUIRE(text.str().find("# TYPE find_sig_phase_duration_seconds histogram") != std::string::npos);
+    REQUIRE(text.str().find("find_sig_phase_duration_seconds_bucket{phase=\"search\",le=\"+Inf\"}") != std::string::npos);
+    REQUIRE(text.str().find("find_sig_errors_total{type=\"cant_open\"}") != std::string::npos);
+    REQUIRE(!fs::exists(metrics_path.string() + ".tmp"));
+
+    fs::remove(metrics_path);
+    fs::remove_all(root_dir);
+}
+
+TEST_CASE("trace file has a span per directory, file and chunk", "[scan_trace]") {
+    fs::path root_dir = "test_trace_root";
+    fs::create_directories(root_dir);
+    fs::path trace_path = "test_files/trace.json";
+
+    fs::path elf_file = root_dir / "elf \"quoted\"";
+    {
+        std::ofstream ofs(elf_file, std::ios::binary);
+        std::vector<std::uint8_t> data = {0x7F, 'E', 'L', 'F', 0x00, 0x01};
+        ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    // utf-8 names come out as they are, a byte that is not utf-8 escaped
+    std::ofstream(root_dir / "caf\xC3\xA9 \xFF", std::ios::binary) << "\x7f" "ELF" "xx";
+
+    enable_tracing(1024);
+    scanner(root_dir, {0xDE, 0xAD, 0xBE, 0xEF});
+    REQUIRE(write_trace_file(trace_path));
+
+    std::ifstream in(trace_path);
+    std::stringstream text;
+    text << in.rdbuf();
+    INFO("Trace file:\n" << text.str());
+    REQUIRE(text.str().find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+    REQUIRE(text.str().find("\"name\":\"list dir\"") != std::string::npos);
+    REQUIRE(text.str().find("\"name\":\"chunk\"") != std::string::npos);
+    // the quotes in the file name must come out escaped
+    REQUIRE(text.str().find("elf \\\"quoted\\\"") != std::string::npos);
+    REQUIRE(text.str().find("caf\xC3\xA9 \\u00ff") != std::string::npos);
+
+    fs::remove(trace_path);
+    fs::remove_all(root_dir);
+}
+
 TEST_CASE("Full program test", "[find_sig]") {
 
     fs::path root_dir = "test_full_program_root";
@@ -0,0 +1,602 @@
+#include "tree_walk.hpp"
+#include "extent_order.hpp"
+#include "scan_budget.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace {
+
+volatile std::sig_atomic_t stop_flag = 0;
+
+void request_stop(int){
+    stop_flag = 1;
+}
+
+// what has to match for a summary to be used: the signatures, and the options that change
+// which files are scanned and what is found in them
+std::uint64_t summary_fingerprint(std::uint64_t signatureHash, const scan_options& options){
+    std::vector<summary_entry> settings(1);
+    summary_entry& entry = settings.front();
+    entry.inode = signatureHash;
+    entry.size = options.max_ratio;
+    entry.digest = options.max_decompressed;
+    entry.mtime_ns = (options.decompress ? 1 : 0) | (options.scan_archives ? 2 : 0) | (options.one_file_system ? 4 : 0)
+                     | (options.skip_pseudo_filesystems ? 8 : 0);
+    for (const auto& glob : options.exclude) entry.hits.push_back("-" + glob);
+    for (const auto& glob : options.include) entry.hits.push_back("+" + glob);
+    for (const auto& type : options.skip_fstypes) entry.hits.push_back("!" + type);
+    return summary_digest(settings);
+}
+
+std::int64_t realtime_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+tree_walk::tree_walk(const fs::path& root, const signature_list& signatures, const scan_options& options)
+    : root(root), options(options), filter(options.exclude, options.include) {
+    // a scan of options.files_from has no root
+    if (!root.empty()) checkpoint.root = fs::absolute(root).lexically_normal().string();
+    checkpoint.signature_hash = hash_signatures(signatures.literals, signatures.regexes);
+    if (!options.summary_file.empty()) {
+        current.root = checkpoint.root;
+        current.fingerprint = summary_fingerprint(checkpoint.signature_hash, options);
+        if (load_summary(options.summary_file, previous)
+            && (previous.root != current.root || previous.fingerprint != current.fingerprint)) {
+            std::cout << "the summary is for another root, signature or options, scanning everything" << "\n";
+            previous = dir_summary();
+        }
+    }
+    if (options.checkpoint_file.empty()) return;
+
+    // a preempted batch node gets SIGTERM, the files being scanned are finished and saved first
+    stop_flag = 0;
+    struct sigaction stop = {};
+    stop.sa_handler = request_stop;
+    sigemptyset(&stop.sa_mask);
+    ::sigaction(SIGINT, &stop, &oldInt);
+    ::sigaction(SIGTERM, &stop, &oldTerm);
+    handlersInstalled = true;
+}
+
+tree_walk::~tree_walk(){
+    if (!handlersInstalled) return;
+    ::sigaction(SIGINT, &oldInt, nullptr);
+    ::sigaction(SIGTERM, &oldTerm, nullptr);
+}
+
+void tree_walk::resume(){
+    if (!options.resume) return;
+    scan_checkpoint saved;
+    if (!load_checkpoint(options.checkpoint_file, saved)) {
+        std::cout << "no checkpoint to resume from, scanning everything" << "\n";
+        return;
+    }
+    if (saved.root != checkpoint.root || saved.signature_hash != checkpoint.signature_hash) {
+        std::cout << "the checkpoint is for another root or signature, scanning everything" << "\n";
+        return;
+    }
+    checkpoint = saved;
+    resumeAfter = saved.done;
+    std::string after;
+    for (const auto& name : saved.done) after += "/" + name;
+    std::cout << "resuming after " << (after.empty() ? "/" : after) << "\n";
+    for (const auto& name : saved.hits) std::cout << name << " is infected!" << "\n";
+}
+
+bool tree_walk::stop_requested() const {
+    return stop_flag != 0 || deadline_passed();
+}
+
+bool tree_walk::deadline_passed() const {
+    return options.deadline != std::chrono::steady_clock::time_point::max()
+        && std::chrono::steady_clock::now() >= options.deadline;
+}
+
+void tree_walk::finished(const std::vector<std::string>& done, const std::vector<std::string>& hits){
+    if (options.checkpoint_file.empty()) return;
+    std::lock_guard<std::mutex> guard(lock);
+    checkpoint.done = done;
+    checkpoint.hits.insert(checkpoint.hits.end(), hits.begin(), hits.end());
+    auto now = std::chrono::steady_clock::now();
+    if (stop_requested() || now - lastSave >= options.checkpoint_interval) {
+        save_checkpoint(options.checkpoint_file, checkpoint);
+        lastSave = now;
+    }
+}
+
+void tree_walk::save_as_is(){
+    if (options.checkpoint_file.empty()) return;
+    std::lock_guard<std::mutex> guard(lock);
+    save_checkpoint(options.checkpoint_file, checkpoint);
+    lastSave = std::chrono::steady_clock::now();
+}
+
+void tree_walk::report(const std::string& name, bool record){
+    std::lock_guard<std::mutex> guard(lock);
+    if (sink) sink(name);
+    else std::cout << name << " is infected!" << "\n";
+    if (fileHits) fileHits->push_back(name.substr(fileNameLength));
+    if (!record || options.checkpoint_file.empty()) return;
+    if (batchHits) batchHits->push_back(name);
+    else checkpoint.hits.push_back(name);
+}
+
+void tree_walk::complete(){
+    if (summarizing && resumeAfter.empty()) save_summary(options.summary_file, current);
+    if (options.checkpoint_file.empty()) return;
+    std::error_code error;
+    fs::remove(options.checkpoint_file, error);
+}
+
+void tree_walk::set_source(path_source source){
+    this->source = std::move(source);
+}
+
+void tree_walk::set_hit_sink(hit_sink sink){
+    this->sink = std::move(sink);
+}
+
+void tree_walk::set_splitter(std::atomic<bool>& wanted, split_fn give){
+    splitWanted = &wanted;
+    this->give = std::move(give);
+}
+
+void tree_walk::split(){
+    splitWanted->store(false);
+    std::vector<std::string> paths;
+    // the shallowest directory has the biggest subtrees left
+    for (auto& level : levels) {
+        if (level.next >= level.end) continue;
+        const std::size_t count = (level.end - level.next + 1) / 2;
+        for (std::size_t i = level.end - count; i < level.end; ++i) {
+            paths.push_back(level.prefix + (*level.entries)[i].name);
+        }
+        level.end -= count;
+        break;
+    }
+    give(std::move(paths));
+}
+
+bool tree_walk::run(const visit_fn& visit, bool filesDoneOnReturn){
+    this->visit = &visit;
+    filesDone = filesDoneOnReturn;
+    sequence = 0;
+    // batches are scanned long after their directory is done, other threads report hits of files
+    // the walk has long moved past. only the plain walk knows whose hits it is getting
+    summarizing = !options.summary_file.empty() && filesDone && options.extent_batch == 0 && options.files_from.empty();
+    current.directories.clear();
+    current.taken_ns = realtime_ns();
+    std::vector<summary_entry> top;
+    bool completed = options.files_from.empty() && !source
+        ? walk(root, !resumeAfter.empty(), 0, false, nullptr, summarizing ? &top : nullptr)
+        : walk_list();
+    if (completed && !batch.empty()) completed = flush_batch();
+    batch.clear();
+    return completed;
+}
+
+bool tree_walk::flush_batch(){
+    std::vector<fs::path> paths;
+    paths.reserve(batch.size());
+    for (const auto& file : batch) paths.push_back(file.path);
+    const std::vector<std::size_t> order = extent_order(paths);
+
+    if (!filesDone) {
+        for (std::size_t i : order) (*visit)(batch[i].path, batch[i].position, batch[i].sequence, batch[i].info);
+        batch.clear();
+        return !stop_requested();
+    }
+
+    // stopped halfway, scanned files sit behind unscanned ones. only the walk order prefix that
+    // is all scanned goes into the checkpoint, with its hits, the rest is scanned again on resume
+    std::vector<std::vector<std::string>> hits(batch.size());
+    std::vector<bool> scanned(batch.size(), false);
+    try {
+        for (std::size_t i : order) {
+            if (stop_requested()) break;
+            batchHits = &hits[i];
+            (*visit)(batch[i].path, batch[i].position, batch[i].sequence, batch[i].info);
+            scanned[i] = !cut_by_deadline();
+        }
+    }
+    catch (...) {
+        batchHits = nullptr;
+        throw;
+    }
+    batchHits = nullptr;
+
+    std::size_t prefix = 0;
+    std::vector<std::string> prefixHits;
+    for (; prefix < batch.size() && scanned[prefix]; ++prefix) {
+        prefixHits.insert(prefixHits.end(), hits[prefix].begin(), hits[prefix].end());
+    }
+    if (prefix > 0) finished(batch[prefix - 1].position, prefixHits);
+    batch.clear();
+    return !stop_requested();
+}
+
+bool tree_walk::walk_list(){
+    if (source) {
+        // the paths are below the root, mounts are judged against the root's device like in a
+        // walk of the whole root
+        file_stat info;
+        if (stat_path(root.c_str(), STATX_TYPE, stat_sync::cached, info) == 0) rootDevice = info.device;
+        for (std::string path; source(path);) {
+            if (!walk_listed(path)) return false;
+        }
+        return true;
+    }
+
+    int fd = 0;
+    if (options.files_from != "-") {
+        fd = ::open(options.files_from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "could not open " << options.files_from << "\n";
+            count_error(scan_error::cant_open);
+            throw CANT_OPEN;
+        }
+    }
+    struct list_guard {
+        int fd;
+        ~list_guard(){ if (fd > 0) ::close(fd); }
+    } guard{fd};
+
+    // a plain read, not a buffered stream: each path is scanned as soon as its separator is in,
+    // a find -print0 or a change feed on the other end of the pipe does not have to finish first
+    char separator = 0;
+    bool separated = false;
+    std::string pending;
+    // a list written on windows ends its lines in \r\n, the \r is not part of the name
+    auto nothing_pending = [&]() {
+        if (separator != '\0' && !pending.empty() && pending.back() == '\r') pending.pop_back();
+        return pending.empty();
+    };
+    char buffer[64 * 1024];
+    for (;;) {
+        ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            if (stop_requested()) return false;
+            continue;
+        }
+        if (n < 0) {
+            std::cerr << "could not read " << options.files_from << "\n";
+            count_error(scan_error::cant_read);
+            throw CANT_READ;
+        }
+        if (n == 0) break;
+        const char* data = buffer;
+        const char* end = buffer + n;
+        for (const char* c = data; c < end && !separated; ++c) {
+            if (*c == '\0' || *c == '\n') {
+                separator = *c;
+                separated = true;
+            }
+        }
+        while (separated) {
+            const char* found = static_cast<const char*>(std::memchr(data, separator, end - data));
+            if (!found) break;
+            pending.append(data, found);
+            data = found + 1;
+            if (!nothing_pending() && !walk_listed(pending)) return false;
+            pending.clear();
+        }
+        pending.append(data, end);
+    }
+    // the last path may come without a separator
+    return nothing_pending() || walk_listed(pending);
+}
+
+bool tree_walk::walk_listed(const std::string& listed){
+    const fs::path path = source ? (listed.empty() ? root : root / listed) : fs::path(listed);
+    // the position of a listed path is the path itself without a leading /, as one component,
+    // which is what globs with a / are matched against. below a listed directory the walk
+    // appends to it like below the root
+    const std::size_t start = listed.find_first_not_of('/');
+    const std::string relative = start == std::string::npos ? std::string() : listed.substr(start);
+    if (!relative.empty() && filter.excluded(relative, path.filename().string())) {
+        count_event(scan_counter::entries_pruned);
+        return !stop_requested();
+    }
+    if (!relative.empty()) position.assign(1, relative);
+    rootDepth = source ? 0 : position.size();
+    // a path of a sharded scan is a part of the root's walk, a symlink in it to a directory above
+    // it (a/b/up -> ../..) is a loop like it is in the walk of the whole root
+    if (source && !relative.empty()) {
+        fs::path above = root;
+        const fs::path below(relative);
+        for (auto component = below.begin(); component != below.end(); ++component) {
+            file_stat info;
+            if (stat_path(above.c_str(), STATX_TYPE | STATX_INO, stat_sync::cached, info) == 0 && S_ISDIR(info.mode)) {
+                ancestors.emplace_back(info.device, info.inode);
+            }
+            above /= *component;
+        }
+    }
+    bool keepGoing = walk(path, false, rootDevice, false, nullptr, nullptr);
+    ancestors.clear();
+    position.clear();
+    rootDepth = 0;
+    return keepGoing && !stop_requested();
+}
+
+bool tree_walk::skip_mount(dev_t device) const {
+    if (options.one_file_system) return true;
+    if (!options.skip_pseudo_filesystems && options.skip_fstypes.empty()) return false;
+    const std::string type = filesystem_type(device);
+    if (type.empty()) return false;
+    auto listed = [&](const std::vector<std::string>& types) {
+        return std::find(types.begin(), types.end(), type) != types.end();
+    };
+    return (options.skip_pseudo_filesystems && listed(pseudo_filesystems)) || listed(options.skip_fstypes);
+}
+
+void tree_walk::reuse(const fs::path& path, const summary_entry& before, std::vector<summary_entry>& recorded){
+    count_event(scan_counter::files_unchanged);
+    for (const auto& suffix : before.hits) report(path.string() + suffix);
+    recorded.push_back(before);
+    ++sequence;
+}
+
+bool tree_walk::unchanged_directory(const summary_directory* before, const file_stat& info) const {
+    // adding, removing or renaming an entry moves the directory's mtime and ctime, where the
+    // filesystem can be trusted to. a change in the second before the last scan may not have
+    return before && before->inode == info.inode && before->mtime_ns == info.mtime_ns
+        && before->ctime_ns == info.ctime_ns && previous.settled(info.mtime_ns, info.ctime_ns)
+        && trusts_directory_times(filesystem_type(info.device));
+}
+
+bool tree_walk::walk(const fs::path& path, bool onResumePath, dev_t parentDevice, bool includeChecked,
+                     const summary_entry* before, std::vector<summary_entry>* recorded){
+
+    // one statx for the type (passed on to the scan), the size and the ids the mount and loop
+    // checks use, following symlinks. cached attributes do for those, the scan takes the size it
+    // reads to from the open file. a summary decides by the size and times whether a file is read
+    // at all: on NFS and FUSE cached ones can be from before the file was written again, they are
+    // asked for fresh then. gone in the meantime is not an error
+    file_stat info;
+    int statError;
+    {
+        phase_timer timer(scan_phase::stat);
+        const unsigned times = summarizing ? STATX_MTIME | STATX_CTIME : 0;
+        statError = stat_path(path.c_str(), STATX_TYPE | STATX_SIZE | STATX_INO | times,
+                              summarizing ? stat_sync::as_stat : stat_sync::cached, info);
+    }
+    // ELOOP: a symlink chain that never ends in a file
+    if(statError == ENOENT || statError == ENOTDIR || statError == ELOOP){
+        return true;
+    }
+    if(statError != 0){
+        throw fs::filesystem_error("cannot stat", path, std::error_code(statError, std::generic_category()));
+    }
+
+    if(!S_ISDIR(info.mode)){
+        // sockets, fifos and device nodes below the root are not files anyone can run. only a
+        // root that is one gets to scan_path and its "does not point to a file"
+        if (!S_ISREG(info.mode) && !position.empty()) {
+            count_event(scan_counter::entries_pruned);
+            return true;
+        }
+        if (!includeChecked && !position.empty() && filter.has_includes()) {
+            std::string relative = position.front();
+            for (std::size_t i = 1; i < position.size(); ++i) relative += "/" + position[i];
+            if (!filter.included(relative, path.filename().string())) {
+                count_event(scan_counter::entries_pruned);
+                return true;
+            }
+        }
+        if (options.extent_batch > 0) {
+            batch.push_back({path, position, sequence++, info});
+            return batch.size() < options.extent_batch || flush_batch();
+        }
+        if (!recorded) {
+            (*visit)(path, position, sequence++, info);
+            return true;
+        }
+        // the same inode with the same size and times has the same content, unless it was written
+        // again in the same clock tick as the last scan read it: ctime cannot be set back
+        if (before && before->kind == summary_entry::file && before->inode == info.inode
+            && before->size == info.size && before->mtime_ns == info.mtime_ns && before->ctime_ns == info.ctime_ns
+            && previous.settled(info.mtime_ns, info.ctime_ns)) {
+            reuse(path, *before, *recorded);
+            return true;
+        }
+        summary_entry entry;
+        entry.name = position.empty() ? path.filename().string() : position.back();
+        entry.inode = info.inode;
+        entry.size = info.size;
+        entry.mtime_ns = info.mtime_ns;
+        entry.ctime_ns = info.ctime_ns;
+        fileHits = &entry.hits;
+        fileNameLength = path.string().size();
+        try {
+            (*visit)(path, position, sequence++, info);
+        }
+        catch (...) {
+            fileHits = nullptr;
+            throw;
+        }
+        fileHits = nullptr;
+        // only what was read to the end is vouched for, a file out of time is scanned again
+        if (!last_file_coverage().timed_out) recorded->push_back(std::move(entry));
+        return true;
+    }
+
+    // below the root a different device is a mount point (or a btrfs subvolume)
+    if (position.size() > rootDepth && info.device != parentDevice && skip_mount(info.device)) {
+        count_event(scan_counter::entries_pruned);
+        return true;
+    }
+
+    // a symlink back to a directory above (usr/bin/X11 -> .) would be walked forever
+    const std::pair<dev_t, ino_t> id(info.device, info.inode);
+    if (std::find(ancestors.begin(), ancestors.end(), id) != ancestors.end()) {
+        count_event(scan_counter::entries_pruned);
+        return true;
+    }
+
+    std::string relative;
+    for (const auto& component : position) relative += (relative.empty() ? "" : "/") + component;
+    const summary_directory* beforeDirectory = recorded ? previous.find(relative) : nullptr;
+    const bool unchanged = unchanged_directory(beforeDirectory, info);
+
+    // list the whole directory first so dir_read only measures the listing itself. with include
+    // globs the entries the listing already knows to be regular files are decided right here. a
+    // directory the summary has unchanged is not listed again
+    const bool including = filter.has_includes();
+    std::vector<listed_entry> entries;
+    if (unchanged) {
+        count_event(scan_counter::dirs_unchanged);
+        for (const auto& entry : beforeDirectory->entries) entries.push_back({entry.name, false});
+    }
+    else {
+        try {
+            phase_timer timer(scan_phase::dir_read);
+            trace_span span("list dir", path.c_str());
+            for(auto const& entry : fs::directory_iterator(path)){
+                std::error_code error;
+                // the type comes from the listing (d_type), only symlinks and unknown types cost a stat
+                const bool regular = including && entry.is_regular_file(error);
+                entries.push_back({entry.path().filename().string(), regular});
+            }
+        }
+        catch (const fs::filesystem_error&) {
+            count_error(scan_error::dir_iterate);
+            throw;
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    const std::string prefix = relative.empty() ? relative : relative + "/";
+    std::vector<summary_entry> children;
+    std::size_t beforeIndex = 0;
+
+    const std::size_t depth = position.size();
+    ancestors.push_back(id);
+    const std::size_t level = levels.size();
+    levels.push_back({prefix, &entries, 0, entries.size()});
+    for (std::size_t i = 0;; ++i) {
+        levels[level].next = i;
+        if (splitWanted && splitWanted->load(std::memory_order_relaxed)) split();
+        if (i >= levels[level].end) break;
+        levels[level].next = i + 1;
+        const listed_entry& entry = entries[i];
+        const std::string& name = entry.name;
+        bool resumeBelow = false;
+        if (onResumePath && depth < resumeAfter.size()) {
+            const std::string& mark = resumeAfter[depth];
+            if (name < mark) continue;
+            if (name == mark) {
+                // the checkpointed entry itself is done, a directory on its path only partly
+                if (depth + 1 == resumeAfter.size()) continue;
+                resumeBelow = true;
+            }
+        }
+        if (!filter.empty()) {
+            const std::string relative = prefix + name;
+            if (filter.excluded(relative, name) || (entry.regular && !filter.included(relative, name))) {
+                count_event(scan_counter::entries_pruned);
+                continue;
+            }
+        }
+        // both are in name order
+        const summary_entry* childBefore = nullptr;
+        if (beforeDirectory) {
+            const auto& beforeEntries = beforeDirectory->entries;
+            while (beforeIndex < beforeEntries.size() && beforeEntries[beforeIndex].name < name) ++beforeIndex;
+            if (beforeIndex < beforeEntries.size() && beforeEntries[beforeIndex].name == name) {
+                childBefore = &beforeEntries[beforeIndex];
+            }
+        }
+        position.push_back(name);
+        bool keepGoing = true;
+        if (unchanged && options.trust_dir_times && childBefore && childBefore->kind == summary_entry::file
+            && previous.settled(childBefore->mtime_ns, childBefore->ctime_ns)) {
+            reuse(path / name, *childBefore, children);
+        }
+        else {
+            const std::size_t recordedBefore = children.size();
+            keepGoing = walk(path / name, resumeBelow, info.device, entry.regular, childBefore,
+                             recorded ? &children : nullptr);
+            if (recorded && children.size() == recordedBefore) {
+                summary_entry skipped;
+                skipped.name = name;
+                skipped.kind = summary_entry::other;
+                children.push_back(std::move(skipped));
+            }
+        }
+        // batched files are finished by flush_batch, which may be long after their directory. a
+        // file the deadline cut short is not done, the checkpoint stays in front of it
+        if (keepGoing && filesDone && options.extent_batch == 0) {
+            if (cut_by_deadline()) save_as_is();
+            else finished(position);
+        }
+        position.pop_back();
+        if (!keepGoing || stop_requested()) {
+            ancestors.pop_back();
+            levels.pop_back();
+            return false;
+        }
+    }
+    ancestors.pop_back();
+    levels.pop_back();
+
+    if (recorded) {
+        summary_entry entry;
+        entry.name = position.empty() ? std::string() : position.back();
+        entry.kind = summary_entry::directory;
+        entry.inode = info.inode;
+        entry.mtime_ns = info.mtime_ns;
+        entry.ctime_ns = info.ctime_ns;
+        entry.digest = summary_digest(children);
+        summary_directory& directory = current.directories[relative];
+        directory = {entry.inode, entry.mtime_ns, entry.ctime_ns, entry.digest, std::move(children)};
+        recorded->push_back(std::move(entry));
+    }
+    return true;
+}
+
+void completion_tracker::queued(std::uint64_t sequence, const std::vector<std::string>& position){
+    std::lock_guard<std::mutex> guard(lock);
+    const std::size_t index = static_cast<std::size_t>(sequence - first);
+    if (index >= window.size()) window.resize(index + 1);
+    window[index].position = position;
+}
+
+void completion_tracker::done(std::uint64_t sequence, std::vector<std::string>&& hits, tree_walk& walk){
+    std::lock_guard<std::mutex> guard(lock);
+    pending_file& file = window[static_cast<std::size_t>(sequence - first)];
+    file.done = true;
+    file.hits = std::move(hits);
+    bool moved = false;
+    std::vector<std::string> passedHits;
+    while (!window.empty() && window.front().done) {
+        last = std::move(window.front().position);
+        passedHits.insert(passedHits.end(), window.front().hits.begin(), window.front().hits.end());
+        window.pop_front();
+        ++first;
+        moved = true;
+    }
+    if (moved) {
+        advanced = true;
+        walk.finished(last, passedHits);
+    }
+}
+
+void completion_tracker::flush(tree_walk& walk){
+    std::lock_guard<std::mutex> guard(lock);
+    if (advanced) walk.finished(last);
+}
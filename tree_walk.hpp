@@ -0,0 +1,200 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include "dir_summary.hpp"
+#include "file_scanner.hpp"
+#include "file_stat.hpp"
+#include "path_filter.hpp"
+#include "scan_checkpoint.hpp"
+
+namespace fs = std::filesystem;
+
+// the depth-first walk behind scanner(). entries are visited in sorted name order so that the
+// last finished entry is all a checkpoint (options.checkpoint_file) has to remember, a resumed
+// walk only lists the directories on the way to it. hits and progress may come from other
+// threads than the walking one. with options.extent_batch the files are handed out a batch at a
+// time in physical order, the checkpoint still only moves along the walk order. excluded entries,
+// other filesystems and pseudo filesystems are pruned before they are stat'ed or entered. with
+// options.summary_file the walk compares what it finds to the summary of the last complete scan
+// and records a new one, unchanged files are reported from it instead of being visited. with
+// options.files_from the files come from a list instead, read while it is being visited. the
+// workers of a sharded scan (shard_scan.hpp) get their paths from the coordinator, and give back
+// part of what they have not walked yet when asked to
+class tree_walk {
+public:
+    // position is the file's path below the root as components, sequence counts the files in walk
+    // order (from 0, also on a resumed walk), info has the mode and size the walk got, to pass on to
+    // scan_path
+    using visit_fn = std::function<void(const fs::path& path, const std::vector<std::string>& position,
+                                        std::uint64_t sequence, const file_stat& info)>;
+    // gives the next path below the root to walk, false when there are no more
+    using path_source = std::function<bool(std::string& path)>;
+    using hit_sink = std::function<void(const std::string& name)>;
+    using split_fn = std::function<void(std::vector<std::string>&& paths)>;
+
+    // while checkpointing SIGINT/SIGTERM only set a stop flag, for as long as the walk exists
+    tree_walk(const fs::path& root, const signature_list& signatures, const scan_options& options);
+    ~tree_walk();
+    tree_walk(const tree_walk&) = delete;
+    tree_walk& operator=(const tree_walk&) = delete;
+
+    // with options.resume loads the checkpoint, prints where it continues and the hits found before
+    void resume();
+
+    // calls visit for every file in walk order. with filesDoneOnReturn a file counts as scanned
+    // once visit returns, otherwise whoever scans it calls finished(). returns false when the
+    // walk was stopped by SIGINT/SIGTERM
+    bool run(const visit_fn& visit, bool filesDoneOnReturn);
+
+    // everything up to and including position is scanned, hits are the ones found in there that
+    // were reported without being recorded. saves the checkpoint when it is due
+    void finished(const std::vector<std::string>& position, const std::vector<std::string>& hits = {});
+
+    // prints "<name> is infected!". recorded hits go into the checkpoint right away, which is only
+    // right when the file is finished before anything after it (the single threaded walk, batches
+    // keep them until the files in front are scanned too)
+    void report(const std::string& name, bool record = true);
+
+    // the scan got through the whole tree, the checkpoint is not needed any more. the summary of
+    // the walk is saved, unless it was resumed and so did not see everything
+    void complete();
+
+    // SIGINT/SIGTERM, or options.deadline passed
+    bool stop_requested() const;
+    bool deadline_passed() const;
+
+    // run() walks the paths source gives instead of the root (or options.files_from)
+    void set_source(path_source source);
+    // hits go to sink instead of std::cout
+    void set_hit_sink(hit_sink sink);
+    // when the walk finds wanted set between two entries it clears it and hands give the later
+    // half of the entries it has not started in the shallowest directory that has any, as paths
+    // below the root, and leaves them out. give may get none, the walk is on its last entries
+    void set_splitter(std::atomic<bool>& wanted, split_fn give);
+
+private:
+    // parentDevice is the st_dev of the directory path is in, includeChecked says the include
+    // globs were already applied from the listing. when summarizing, before is the entry the last
+    // summary has for path (nullptr when none) and the entry for path is added to recorded
+    bool walk(const fs::path& path, bool onResumePath, dev_t parentDevice, bool includeChecked,
+              const summary_entry* before, std::vector<summary_entry>* recorded);
+    // a file the last summary vouches for: its hits are reported again and it goes into recorded
+    void reuse(const fs::path& path, const summary_entry& before, std::vector<summary_entry>& recorded);
+    // a directory whose entries the last summary has, because nothing in it was added, removed
+    // or renamed since
+    bool unchanged_directory(const summary_directory* before, const file_stat& info) const;
+    // a mount point the options say to stay out of
+    bool skip_mount(dev_t device) const;
+    // visits the collected files in physical order, false when stopped
+    bool flush_batch();
+    // visits the paths in options.files_from as they arrive, false when stopped
+    bool walk_list();
+    // one path of the list: a file is visited, a directory walked. below the root when there is
+    // one (set_source)
+    bool walk_listed(const std::string& listed);
+    // answers set_splitter's wanted
+    void split();
+    // saves the checkpoint without moving it, the walk stops on a file that is not done
+    void save_as_is();
+
+    const fs::path root;
+    const scan_options& options;
+    const path_filter filter;
+    const visit_fn* visit = nullptr;
+    bool filesDone = true;
+
+    std::mutex lock; // checkpoint, lastSave and std::cout
+    scan_checkpoint checkpoint;
+    std::chrono::steady_clock::time_point lastSave = std::chrono::steady_clock::now();
+
+    // components below the root of the entry being walked
+    std::vector<std::string> position;
+    // the size of position at the root being walked, 1 for a listed path (options.files_from)
+    std::size_t rootDepth = 0;
+    dev_t rootDevice = 0;
+
+    struct listed_entry {
+        std::string name;
+        bool regular;
+        bool operator<(const listed_entry& other) const { return name < other.name; }
+    };
+    // the directories being walked: entries before next are started, entries from end on were
+    // given away by split()
+    struct walk_level {
+        std::string prefix;
+        const std::vector<listed_entry>* entries;
+        std::size_t next;
+        std::size_t end;
+    };
+    std::vector<walk_level> levels;
+
+    path_source source;
+    hit_sink sink;
+    std::atomic<bool>* splitWanted = nullptr;
+    split_fn give;
+    // st_dev and st_ino of the directories being walked, to catch symlink loops
+    std::vector<std::pair<dev_t, ino_t>> ancestors;
+    // what a resumed walk skips
+    std::vector<std::string> resumeAfter;
+
+    struct pending_file {
+        fs::path path;
+        std::vector<std::string> position;
+        std::uint64_t sequence;
+        file_stat info;
+    };
+    std::vector<pending_file> batch;
+    std::uint64_t sequence = 0;
+    // where report() puts recorded hits while a batch is scanned on the walking thread
+    std::vector<std::string>* batchHits = nullptr;
+
+    // the summary of the last complete scan (empty when there is none or it does not fit this
+    // one) and the one this walk builds
+    dir_summary previous;
+    dir_summary current;
+    bool summarizing = false;
+    // where report() puts the hits of the file being visited, without the file's path
+    std::vector<std::string>* fileHits = nullptr;
+    std::size_t fileNameLength = 0;
+
+    bool handlersInstalled = false;
+    struct sigaction oldInt = {};
+    struct sigaction oldTerm = {};
+};
+
+// files finish out of order, the checkpoint may only move past a file (and take its hits) once
+// all before it are done. a hit of a later file would be found again after a resume. sequence is
+// the walk order, extent ordered batches queue the files of a batch in any order. for walks run
+// with filesDoneOnReturn false (parallel_scan, uring_scan)
+class completion_tracker {
+public:
+    void queued(std::uint64_t sequence, const std::vector<std::string>& position);
+    void done(std::uint64_t sequence, std::vector<std::string>&& hits, tree_walk& walk);
+    // the last word after a stop, nothing is written when no file got done at all
+    void flush(tree_walk& walk);
+
+private:
+    struct pending_file {
+        bool done = false;
+        std::vector<std::string> position;
+        std::vector<std::string> hits;
+    };
+
+    std::mutex lock;
+    std::uint64_t first = 0;
+    std::deque<pending_file> window;
+    std::vector<std::string> last;
+    bool advanced = false;
+};
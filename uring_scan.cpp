@@ -0,0 +1,350 @@
+#include "uring_scan.hpp"
+#include "archive_scan.hpp"
+#include "compressed_scan.hpp"
+#include "huge_pages.hpp"
+#include "io_throttle.hpp"
+#include "scan_budget.hpp"
+#include "scan_metrics.hpp"
+#include "scan_trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+// no liburing, the three system calls are all it takes
+int ring_setup(unsigned entries, io_uring_params* params){
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ring_enter(int fd, unsigned submit, unsigned wait){
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0u,
+                                      nullptr, 0));
+}
+
+int ring_register(int fd, unsigned opcode, const void* arg, unsigned count){
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+enum chain_step : std::uint64_t { step_open, step_read, step_close, steps };
+
+// an io_uring where slot i owns direct descriptor i and buffer i. a file is the chain
+// openat (into the slot) -> read (from the slot, hard linked so a short read still closes) ->
+// close, the slot is free again once all three completions are in
+class file_ring {
+public:
+    struct file {
+        std::string path;
+        std::uint64_t sequence = 0;
+        file_stat info;
+        int openResult = 0;
+        int readResult = 0;
+        unsigned completions = 0;
+        bool busy = false;
+    };
+
+    file_ring(unsigned slotCount, std::size_t bufferSize) : bufferSize(bufferSize), files(slotCount) {
+        io_uring_params params = {};
+        fd = ring_setup(slotCount * steps, &params);
+        if (fd < 0) return;
+        // openat into a direct descriptor came with 5.15, older kernels would hand back a plain
+        // descriptor nobody closes. CQE_SKIP (5.17) is the first feature bit that says it is there
+        if (!(params.features & IORING_FEAT_CQE_SKIP) || !map(params)) {
+            shut();
+            return;
+        }
+        std::vector<int> sparse(slotCount, -1);
+        if (ring_register(fd, IORING_REGISTER_FILES, sparse.data(), slotCount) != 0) {
+            shut();
+            return;
+        }
+        buffers.resize(bufferSize * slotCount);
+        std::vector<iovec> vectors(slotCount);
+        for (unsigned i = 0; i < slotCount; ++i) vectors[i] = {buffers.data() + i * bufferSize, bufferSize};
+        // pinned once instead of on every read. a low RLIMIT_MEMLOCK (before 5.12) only costs
+        // that, the reads then go to the same buffers unregistered
+        registered = ring_register(fd, IORING_REGISTER_BUFFERS, vectors.data(), slotCount) == 0;
+        for (unsigned i = 0; i < slotCount; ++i) freeSlots.push_back(slotCount - 1 - i);
+    }
+
+    ~file_ring(){
+        if (fd < 0) return;
+        // the kernel may still write into the buffers, they go only after every chain is back
+        while (inFlight > 0) {
+            if (ring_enter(fd, unsubmitted, 1) < 0 && errno != EINTR) break;
+            unsubmitted = 0;
+            reap([](file&, const std::uint8_t*) {});
+        }
+        shut();
+    }
+
+    file_ring(const file_ring&) = delete;
+    file_ring& operator=(const file_ring&) = delete;
+
+    bool ready() const { return fd >= 0; }
+    bool full() const { return freeSlots.empty(); }
+    bool idle() const { return inFlight == 0; }
+
+    // queues the chain for path, sent to the kernel with the next wait
+    void queue(const std::string& path, std::uint64_t sequence, const file_stat& info){
+        const unsigned slot = freeSlots.back();
+        freeSlots.pop_back();
+        file& entry = files[slot];
+        entry.path = path;
+        entry.sequence = sequence;
+        entry.info = info;
+        entry.completions = 0;
+        entry.busy = true;
+        ++inFlight;
+
+        io_uring_sqe* open = next_sqe();
+        open->opcode = IORING_OP_OPENAT;
+        open->fd = AT_FDCWD;
+        open->addr = reinterpret_cast<std::uint64_t>(entry.path.c_str());
+        open->open_flags = O_RDONLY | O_NOCTTY;
+        open->file_index = slot + 1;
+        open->flags = IOSQE_IO_LINK;
+        open->user_data = slot * steps + step_open;
+
+        io_uring_sqe* read = next_sqe();
+        read->opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        read->fd = static_cast<int>(slot);
+        read->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        read->addr = reinterpret_cast<std::uint64_t>(buffers.data() + slot * bufferSize);
+        read->len = static_cast<std::uint32_t>(bufferSize);
+        read->off = 0;
+        read->buf_index = static_cast<std::uint16_t>(slot);
+        read->user_data = slot * steps + step_read;
+
+        io_uring_sqe* close = next_sqe();
+        close->opcode = IORING_OP_CLOSE;
+        close->file_index = slot + 1;
+        close->user_data = slot * steps + step_close;
+    }
+
+    // submits what is queued and waits until at least one file (with all, every file) is back,
+    // done gets each with its buffer, the slot is free again after it returns
+    template <class Done>
+    void wait(bool all, Done&& done){
+        while (inFlight > 0) {
+            int entered;
+            {
+                phase_timer timer(scan_phase::read);
+                entered = ring_enter(fd, unsubmitted, 1);
+            }
+            if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // the ring broke, what is in flight is lost to it and goes the blocking way
+                for (auto& entry : files) {
+                    if (!entry.busy) continue;
+                    entry.openResult = -errno;
+                    finish(entry, done);
+                }
+                return;
+            }
+            if (entered >= 0) unsubmitted -= std::min<unsigned>(unsubmitted, static_cast<unsigned>(entered));
+            if (reap(done) > 0 && !all) return;
+        }
+    }
+
+private:
+    bool map(const io_uring_params& params){
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return (sqRing = nullptr), false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cqRing = sqRing;
+        }
+        else {
+            cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) return (cqRing = nullptr), false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* mapped = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (mapped == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(mapped);
+
+        auto* sq = static_cast<char*>(sqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void shut(){
+        if (sqes) ::munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+        if (sqRing) ::munmap(sqRing, sqRingSize);
+        sqes = nullptr;
+        sqRing = cqRing = nullptr;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    // the ring has room for every step of every slot, a free slot always finds its entries
+    io_uring_sqe* next_sqe(){
+        const unsigned tail = *sqTail;
+        const unsigned index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        return sqe;
+    }
+
+    template <class Done>
+    unsigned reap(Done&& done){
+        unsigned finished = 0;
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            file& entry = files[cqe.user_data / steps];
+            if (cqe.user_data % steps == step_open) entry.openResult = cqe.res;
+            else if (cqe.user_data % steps == step_read) entry.readResult = cqe.res;
+            if (++entry.completions == steps) {
+                // done may throw (a file the blocking path cannot read), the slot is free first
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                ++finished;
+                finish(entry, done);
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return finished;
+    }
+
+    template <class Done>
+    void finish(file& entry, Done&& done){
+        const std::size_t slot = static_cast<std::size_t>(&entry - files.data());
+        entry.busy = false;
+        --inFlight;
+        freeSlots.push_back(static_cast<unsigned>(slot));
+        if (entry.openResult < 0) entry.readResult = entry.openResult;
+        done(entry, buffers.data() + slot * bufferSize);
+    }
+
+    int fd = -1;
+    const std::size_t bufferSize;
+    std::vector<file> files;
+    std::vector<unsigned> freeSlots;
+    std::vector<std::uint8_t, huge_page_allocator<std::uint8_t>> buffers;
+    bool registered = false;
+    unsigned inFlight = 0;
+    unsigned unsubmitted = 0;
+
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    std::size_t sqRingSize = 0;
+    std::size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    std::size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+
+} // namespace
+
+bool uring_available(){
+    static const bool available = file_ring(1, 4096).ready();
+    return available;
+}
+
+bool uring_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options){
+    const signature_matcher matcher(signatures);
+    stream_matcher search(matcher);
+    file_ring ring(uring_chains, uring_file_limit);
+    // cache neutral reads need O_DIRECT or the page dropping around every read
+    const bool useRing = ring.ready() && !options.cache_neutral;
+    const bool tracking = !options.checkpoint_file.empty();
+    completion_tracker progress;
+
+    auto scan_blocking = [&](const fs::path& path, std::uint64_t sequence, const file_stat& info) {
+        std::vector<std::string> hits;
+        scan_path(path, matcher, options, [&](const std::string& hit){
+            walk.report(hit, false);
+            if (tracking) hits.push_back(hit);
+        }, &info);
+        if (tracking && !cut_by_deadline()) progress.done(sequence, std::move(hits), walk);
+    };
+
+    // what scan_descriptor and check_range do, on the whole file in memory
+    auto check = [&](file_ring::file& file, const std::uint8_t* data) {
+        trace_span span("file", file.path.c_str());
+        const std::size_t length = file.readResult > 0 ? static_cast<std::size_t>(file.readResult) : 0;
+        const std::size_t headerLength = std::min<std::size_t>(length, 8);
+        // failed, or changed since the walk saw it: the blocking path reads it again and says why
+        if (file.readResult < 0 || length != file.info.size ||
+            (options.decompress && detect_compression(data, headerLength) != compression::none) ||
+            (options.scan_archives && is_ar_archive(data, headerLength))) {
+            scan_blocking(file.path, file.sequence, file.info);
+            return;
+        }
+        count_event(scan_counter::files_scanned);
+        count_event(scan_counter::bytes_read, length);
+
+        bool infected = false;
+        if (length < 4) {
+            std::clog << "not an elf file";
+            count_event(scan_counter::skipped_non_elf);
+        }
+        else if (!is_elf(std::vector<std::uint8_t>(data, data + 4))) {
+            count_event(scan_counter::skipped_non_elf);
+        }
+        else {
+            phase_timer timer(scan_phase::search);
+            search.reset();
+            infected = search.feed(data, length);
+        }
+
+        std::vector<std::string> hits;
+        if (infected) {
+            count_event(scan_counter::infected);
+            walk.report(file.path, false);
+            hits.push_back(file.path);
+        }
+        if (tracking) progress.done(file.sequence, std::move(hits), walk);
+    };
+
+    const bool completed = walk.run([&](const fs::path& path, const std::vector<std::string>& position,
+                                        std::uint64_t sequence, const file_stat& info){
+        if (tracking) progress.queued(sequence, position);
+        if (!useRing || info.size >= uring_file_limit) {
+            scan_blocking(path, sequence, info);
+            return;
+        }
+        throttle_io(static_cast<std::size_t>(info.size));
+        if (ring.full()) ring.wait(false, check);
+        ring.queue(path.string(), sequence, info);
+    }, false);
+    // also after a stop: the files in flight are scanned and recorded
+    if (useRing) ring.wait(true, check);
+
+    if (!completed || walk.stop_requested()) {
+        if (tracking) progress.flush(walk);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+
+#include "file_scanner.hpp"
+#include "tree_walk.hpp"
+
+// files smaller than this are read whole through the ring, bigger ones take the blocking path
+constexpr std::size_t uring_file_limit = 64 * 1024;
+// files in flight at once, each has a direct descriptor slot and a registered buffer
+constexpr unsigned uring_chains = 64;
+
+// scanner() with options.io_uring: walks on the calling thread and reads small files through an
+// io_uring, each an openat -> read -> close chain linked in the kernel, submitted uring_chains at
+// a time with one io_uring_enter. the ELF check and the search run on the read's completion.
+// compressed files, ar archives, big files and files the ring could not read go through
+// scan_path like before, as does everything when io_uring is not there (old kernel, seccomp,
+// kernel.io_uring_disabled). returns false when the walk was stopped
+bool uring_scan(tree_walk& walk, const signature_list& signatures, const scan_options& options);
+
+// whether this process can set up an io_uring with direct descriptors
+bool uring_available();
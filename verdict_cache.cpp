@@ -0,0 +1,58 @@
+#include "verdict_cache.hpp"
+
+file_key make_file_key(const struct stat& st){
+    file_key key;
+    key.dev = static_cast<std::uint64_t>(st.st_dev);
+    key.ino = static_cast<std::uint64_t>(st.st_ino);
+    key.size = static_cast<std::int64_t>(st.st_size);
+    key.mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    key.ctime_ns = static_cast<std::int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+    return key;
+}
+
+std::size_t verdict_cache::key_hash::operator()(const file_key& key) const {
+    // 64 bit mix (splitmix64 finalizer) over the fields, inode and device dominate
+    std::uint64_t h = key.ino * 0x9E3779B97F4A7C15ULL ^ key.dev;
+    h ^= static_cast<std::uint64_t>(key.mtime_ns) + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    h ^= static_cast<std::uint64_t>(key.size) + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return static_cast<std::size_t>(h);
+}
+
+verdict_cache::verdict_cache(std::size_t max_entries)
+    : max_per_shard(max_entries / shard_count + 1) {}
+
+verdict_cache::shard& verdict_cache::shard_for(const file_key& key){
+    // the low bits go to the bucket index inside the map, use the high ones for the shard
+    return shards[(key_hash{}(key) >> 56) % shard_count];
+}
+
+bool verdict_cache::lookup(const file_key& key, bool& infected){
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.entries.find(key);
+    if (it == s.entries.end()) return false;
+    infected = it->second;
+    return true;
+}
+
+void verdict_cache::store(const file_key& key, bool infected){
+    shard& s = shard_for(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    // a full shard is simply dropped, it refills with whatever is being executed now
+    if (s.entries.size() >= max_per_shard) s.entries.clear();
+    s.entries[key] = infected;
+}
+
+std::size_t verdict_cache::size(){
+    std::size_t total = 0;
+    for (auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        total += s.entries.size();
+    }
+    return total;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+// identity of a file's content as far as the kernel tells us without reading it,
+// any write to the file moves mtime/ctime so a stale entry can never match
+struct file_key {
+    std::uint64_t dev;
+    std::uint64_t ino;
+    std::int64_t size;
+    std::int64_t mtime_ns;
+    std::int64_t ctime_ns;
+
+    bool operator==(const file_key& other) const {
+        return dev == other.dev && ino == other.ino && size == other.size &&
+               mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+    }
+};
+
+file_key make_file_key(const struct stat& st);
+
+// remembers the scan result per file so an unchanged file is never read twice.
+// lookups and stores are spread over shards so the fanotify reader thread and the
+// workers rarely wait on each other
+class verdict_cache {
+public:
+    explicit verdict_cache(std::size_t max_entries = 65536);
+
+    // returns true and fills infected when the file was already scanned
+    bool lookup(const file_key& key, bool& infected);
+    void store(const file_key& key, bool infected);
+
+    std::size_t size();
+
+private:
+    struct key_hash {
+        std::size_t operator()(const file_key& key) const;
+    };
+
+    struct shard {
+        std::mutex lock;
+        std::unordered_map<file_key, bool, key_hash> entries;
+    };
+
+    static constexpr std::size_t shard_count = 16;
+
+    shard& shard_for(const file_key& key);
+
+    std::size_t max_per_shard;
+    std::array<shard, shard_count> shards;
+};